@@ -0,0 +1,299 @@
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include "channel.h"
+
+#include <algorithm>
+
+#include <boost/bind.hpp>
+
+#include "assert.h"
+#include "timer.h"
+
+namespace Mordor {
+
+ChannelBase::WaitState::WaitState()
+    : scheduler(Scheduler::getThis()),
+      fiber(Fiber::getThis()),
+      fired(-1)
+{
+    MORDOR_ASSERT(scheduler);
+}
+
+void
+ChannelBase::Wakeups::add(WaitState &state)
+{
+    // Once scheduled, the waiter may return (and destroy state) at any time
+    m_fibers.push_back(std::make_pair(state.scheduler, state.fiber));
+}
+
+void
+ChannelBase::Wakeups::wake()
+{
+    for (size_t i = 0; i < m_fibers.size(); ++i)
+        m_fibers[i].first->schedule(m_fibers[i].second);
+    m_fibers.clear();
+}
+
+ChannelBase::ChannelBase()
+    : m_closed(false)
+{}
+
+ChannelBase::~ChannelBase()
+{
+    MORDOR_ASSERT(!m_senders.head);
+    MORDOR_ASSERT(!m_receivers.head);
+}
+
+void
+ChannelBase::close()
+{
+    Wakeups wakeups;
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (m_closed)
+        return;
+    m_closed = true;
+    Waiter *waiter;
+    while ( (waiter = claim(m_senders)) )
+        wakeups.add(*waiter->state);
+    while ( (waiter = claim(m_receivers)) )
+        wakeups.add(*waiter->state);
+}
+
+bool
+ChannelBase::closed() const
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    return m_closed;
+}
+
+void
+ChannelBase::enqueue(WaiterList &list, Waiter &waiter)
+{
+    MORDOR_ASSERT(!waiter.linked);
+    waiter.prev = list.tail;
+    waiter.next = NULL;
+    if (list.tail)
+        list.tail->next = &waiter;
+    else
+        list.head = &waiter;
+    list.tail = &waiter;
+    waiter.linked = true;
+}
+
+void
+ChannelBase::dequeue(WaiterList &list, Waiter &waiter)
+{
+    if (!waiter.linked)
+        return;
+    if (waiter.prev)
+        waiter.prev->next = waiter.next;
+    else
+        list.head = waiter.next;
+    if (waiter.next)
+        waiter.next->prev = waiter.prev;
+    else
+        list.tail = waiter.prev;
+    waiter.linked = false;
+}
+
+ChannelBase::Waiter *
+ChannelBase::claim(WaiterList &list)
+{
+    while (list.head) {
+        Waiter *waiter = list.head;
+        dequeue(list, *waiter);
+        if (waiter->state->claim(waiter->index))
+            return waiter;
+        // Part of a Select that already completed some other way; the
+        // Select will notice it's been unlinked
+    }
+    return NULL;
+}
+
+bool
+ChannelBase::wait(boost::mutex::scoped_lock &lock, WaiterList &list,
+    void *value, Wakeups &wakeups)
+{
+    WaitState state;
+    Waiter waiter;
+    waiter.state = &state;
+    waiter.value = value;
+    enqueue(list, waiter);
+    lock.unlock();
+    wakeups.wake();
+    Scheduler::yieldTo();
+    MORDOR_ASSERT(!waiter.linked);
+    return waiter.ok;
+}
+
+size_t
+Select::add(ChannelBase *channel, bool send, void *value)
+{
+    Case c;
+    c.channel = channel;
+    c.send = send;
+    c.value = value;
+    c.timerManager = NULL;
+    c.us = 0;
+    m_cases.push_back(c);
+    return m_cases.size() - 1;
+}
+
+size_t
+Select::timeout(TimerManager &timerManager, unsigned long long us)
+{
+    Case c;
+    c.channel = NULL;
+    c.send = false;
+    c.value = NULL;
+    c.timerManager = &timerManager;
+    c.us = us;
+    m_cases.push_back(c);
+    return m_cases.size() - 1;
+}
+
+std::vector<boost::mutex *>
+Select::mutexes() const
+{
+    std::vector<boost::mutex *> result;
+    for (size_t i = 0; i < m_cases.size(); ++i)
+        if (m_cases[i].channel)
+            result.push_back(&m_cases[i].channel->m_mutex);
+    // Always lock in the same order, so Selects can't deadlock each other
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+static void
+lockAll(const std::vector<boost::mutex *> &mutexes)
+{
+    for (size_t i = 0; i < mutexes.size(); ++i)
+        mutexes[i]->lock();
+}
+
+static void
+unlockAll(const std::vector<boost::mutex *> &mutexes)
+{
+    for (size_t i = mutexes.size(); i > 0; --i)
+        mutexes[i - 1]->unlock();
+}
+
+size_t
+Select::tryLocked(ChannelBase::Wakeups &wakeups)
+{
+    for (size_t i = 0; i < m_cases.size(); ++i) {
+        Case &c = m_cases[i];
+        if (!c.channel)
+            continue;
+        if (c.send) {
+            if (c.channel->m_closed)
+                return completed(i, false);
+            if (c.channel->trySendLocked(c.value, wakeups))
+                return completed(i, true);
+        } else {
+            if (c.channel->tryReceiveLocked(c.value, wakeups))
+                return completed(i, true);
+            if (c.channel->m_closed)
+                return completed(i, false);
+        }
+    }
+    return ~0u;
+}
+
+size_t
+Select::completed(size_t index, bool ok)
+{
+    m_ok = ok;
+    return index;
+}
+
+size_t
+Select::poll()
+{
+    size_t result;
+    {
+        ChannelBase::Wakeups wakeups;
+        std::vector<boost::mutex *> mutexes = this->mutexes();
+        lockAll(mutexes);
+        result = tryLocked(wakeups);
+        unlockAll(mutexes);
+    }
+    if (result != ~0u && m_cases[result].send && !m_ok)
+        MORDOR_THROW_EXCEPTION(ChannelClosedException());
+    return result;
+}
+
+size_t
+Select::wait()
+{
+    MORDOR_ASSERT(!m_cases.empty());
+    std::vector<boost::mutex *> mutexes = this->mutexes();
+    size_t result;
+    {
+        ChannelBase::Wakeups wakeups;
+        lockAll(mutexes);
+        result = tryLocked(wakeups);
+        if (result != ~0u)
+            unlockAll(mutexes);
+    }
+    if (result != ~0u) {
+        if (m_cases[result].send && !m_ok)
+            MORDOR_THROW_EXCEPTION(ChannelClosedException());
+        return result;
+    }
+
+    // Nothing's ready; wait on everything.  The state is shared with the
+    // timers, which may still fire after we've moved on
+    boost::shared_ptr<ChannelBase::WaitState> state(
+        new ChannelBase::WaitState());
+    std::vector<ChannelBase::Waiter> waiters(m_cases.size());
+    for (size_t i = 0; i < m_cases.size(); ++i) {
+        Case &c = m_cases[i];
+        if (!c.channel)
+            continue;
+        waiters[i].state = state.get();
+        waiters[i].index = (intptr_t)i;
+        waiters[i].value = c.value;
+        c.channel->enqueue(c.send ? c.channel->m_senders :
+            c.channel->m_receivers, waiters[i]);
+    }
+    unlockAll(mutexes);
+    std::vector<Timer::ptr> timers;
+    for (size_t i = 0; i < m_cases.size(); ++i) {
+        Case &c = m_cases[i];
+        if (c.timerManager)
+            timers.push_back(c.timerManager->registerTimer(c.us,
+                boost::bind(&Select::timedOut, state, (intptr_t)i)));
+    }
+
+    Scheduler::yieldTo();
+
+    for (size_t i = 0; i < timers.size(); ++i)
+        timers[i]->cancel();
+    lockAll(mutexes);
+    for (size_t i = 0; i < m_cases.size(); ++i) {
+        Case &c = m_cases[i];
+        if (c.channel)
+            c.channel->dequeue(c.send ? c.channel->m_senders :
+                c.channel->m_receivers, waiters[i]);
+    }
+    unlockAll(mutexes);
+    result = (size_t)state->fired;
+    MORDOR_ASSERT(result < m_cases.size());
+    m_ok = m_cases[result].channel ? waiters[result].ok : true;
+    if (m_cases[result].send && !m_ok)
+        MORDOR_THROW_EXCEPTION(ChannelClosedException());
+    return result;
+}
+
+void
+Select::timedOut(boost::shared_ptr<ChannelBase::WaitState> state,
+    intptr_t index)
+{
+    ChannelBase::Wakeups wakeups;
+    if (state->claim(index))
+        wakeups.add(*state);
+}
+
+}
@@ -0,0 +1,376 @@
+#ifndef __MORDOR_CHANNEL_H__
+#define __MORDOR_CHANNEL_H__
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include <utility>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "atomic.h"
+#include "exception.h"
+#include "fiber.h"
+#include "scheduler.h"
+
+namespace Mordor {
+
+class Select;
+class TimerManager;
+
+struct ChannelClosedException : virtual Exception {};
+
+/// The part of Channel<T> that doesn't depend on T
+class ChannelBase : boost::noncopyable
+{
+    friend class Select;
+public:
+    virtual ~ChannelBase();
+
+    /// Wake everyone waiting on the Channel; blocked (and future) senders
+    /// get a ChannelClosedException, and receivers drain whatever is still
+    /// buffered, and then get nothing
+    void close();
+    bool closed() const;
+
+protected:
+    /// The Fiber behind a blocked operation (or a whole Select)
+    struct WaitState
+    {
+        WaitState();
+
+        /// @return If the operation now belongs to the caller, who must
+        /// complete it and then wake it (see Wakeups)
+        bool claim(intptr_t index)
+        { return atomicCompareAndSwap(fired, index, (intptr_t)-1) == -1; }
+
+        Scheduler *scheduler;
+        Fiber::ptr fiber;
+        volatile intptr_t fired;
+    };
+
+    /// A blocked send or receive, linked into a Channel
+    struct Waiter
+    {
+        Waiter()
+            : state(NULL), index(0), value(NULL), ok(false), linked(false),
+              prev(NULL), next(NULL)
+        {}
+
+        WaitState *state;
+        intptr_t index;
+        /// const T * for senders, T * for receivers
+        void *value;
+        /// If the operation completed (instead of the Channel closing)
+        bool ok;
+        bool linked;
+        Waiter *prev, *next;
+    };
+
+    struct WaiterList
+    {
+        WaiterList() : head(NULL), tail(NULL) {}
+
+        Waiter *head, *tail;
+    };
+
+    /// Fibers to reschedule once the Channel's mutex has been released
+
+    /// A woken Fiber may return, and even destroy the Channel, immediately,
+    /// so nothing may touch the Channel after waking it.  Declare this
+    /// before the lock, so it is destroyed after it.
+    class Wakeups : boost::noncopyable
+    {
+    public:
+        ~Wakeups() { wake(); }
+
+        void add(WaitState &state);
+        /// @pre The Channel's mutex is not locked
+        void wake();
+
+    private:
+        std::vector<std::pair<Scheduler *, Fiber::ptr> > m_fibers;
+    };
+
+protected:
+    ChannelBase();
+
+    void enqueue(WaiterList &list, Waiter &waiter);
+    void dequeue(WaiterList &list, Waiter &waiter);
+    /// Unlink waiters from the front of list until one can be claimed
+    /// @return The claimed waiter, or NULL
+    Waiter *claim(WaiterList &list);
+    /// Park the current Fiber on list until something claims it
+    /// @pre lock is locked
+    /// @param wakeups Woken after unlocking, before parking
+    /// @return If the operation completed (instead of the Channel closing)
+    bool wait(boost::mutex::scoped_lock &lock, WaiterList &list, void *value,
+        Wakeups &wakeups);
+
+    /// Queue *(const T *)value, or hand it directly to a waiting receiver
+    /// @pre m_mutex is locked, and !m_closed
+    /// @return false if it would block
+    virtual bool trySendLocked(const void *value, Wakeups &wakeups) = 0;
+    /// Dequeue into *(T *)value, or take it directly from a waiting sender
+    /// @pre m_mutex is locked
+    /// @return false if it would block (or the Channel is closed and empty)
+    virtual bool tryReceiveLocked(void *value, Wakeups &wakeups) = 0;
+
+protected:
+    mutable boost::mutex m_mutex;
+    bool m_closed;
+    WaiterList m_senders, m_receivers;
+};
+
+/// A bounded, multi-producer multi-consumer queue for Fibers
+
+/// Items are kept in a fixed-capacity ring buffer, so sending never
+/// allocates.  A sender blocks (by parking its Fiber, not the thread) while
+/// the buffer is full, and a receiver while it's empty; items are handed
+/// directly from sender to receiver when one is already waiting.  Senders and
+/// receivers can be on any Scheduler; each is woken on its own.  Use a Select
+/// to wait on several Channels (and timeouts) at once.
+/// @code
+/// Channel<Request> requests(64);
+/// // Producers
+/// requests.send(request);
+/// // Consumers
+/// Request request;
+/// while (requests.receive(request))
+///     handle(request);
+/// // Shutdown
+/// requests.close();
+/// @endcode
+template <class T>
+class Channel : public ChannelBase
+{
+public:
+    /// @param capacity How many items are buffered before send() blocks; 0
+    /// means each send() waits for a matching receive()
+    Channel(size_t capacity)
+        : m_buffer(capacity),
+          m_head(0),
+          m_size(0)
+    {}
+
+    /// Suspend until t has been buffered (or handed to a receiver)
+    /// @throws ChannelClosedException
+    void send(const T &t)
+    {
+        Wakeups wakeups;
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (m_closed)
+            MORDOR_THROW_EXCEPTION(ChannelClosedException());
+        if (trySendLocked(&t, wakeups))
+            return;
+        if (!wait(lock, m_senders, (void *)&t, wakeups))
+            MORDOR_THROW_EXCEPTION(ChannelClosedException());
+    }
+
+    /// Send a batch of items, taking the lock once per run that fits in the
+    /// buffer, instead of once per item
+    /// @throws ChannelClosedException
+    template <class Iterator>
+    void send(Iterator first, Iterator last)
+    {
+        while (first != last) {
+            Wakeups wakeups;
+            boost::mutex::scoped_lock lock(m_mutex);
+            if (m_closed)
+                MORDOR_THROW_EXCEPTION(ChannelClosedException());
+            for (; first != last; ++first) {
+                const T &t = *first;
+                if (!trySendLocked(&t, wakeups)) {
+                    if (!wait(lock, m_senders, (void *)&t, wakeups))
+                        MORDOR_THROW_EXCEPTION(ChannelClosedException());
+                    ++first;
+                    break;
+                }
+            }
+        }
+    }
+
+    /// Send t if it can be done without suspending
+    /// @throws ChannelClosedException
+    bool trySend(const T &t)
+    {
+        Wakeups wakeups;
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (m_closed)
+            MORDOR_THROW_EXCEPTION(ChannelClosedException());
+        return trySendLocked(&t, wakeups);
+    }
+
+    /// Suspend until an item is available
+    /// @return false if the Channel has been closed and drained
+    bool receive(T &t)
+    {
+        Wakeups wakeups;
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (tryReceiveLocked(&t, wakeups))
+            return true;
+        if (m_closed)
+            return false;
+        return wait(lock, m_receivers, &t, wakeups);
+    }
+
+    /// Receive up to max items at once, suspending only until there is at
+    /// least one
+    /// @return How many items were received; 0 if the Channel has been closed
+    /// and drained
+    template <class OutputIterator>
+    size_t receive(OutputIterator out, size_t max)
+    {
+        Wakeups wakeups;
+        boost::mutex::scoped_lock lock(m_mutex);
+        T t;
+        size_t received = 0;
+        while (received < max && tryReceiveLocked(&t, wakeups)) {
+            *out++ = t;
+            ++received;
+        }
+        if (received > 0 || max == 0 || m_closed)
+            return received;
+        if (!wait(lock, m_receivers, &t, wakeups))
+            return 0;
+        *out++ = t;
+        return 1;
+    }
+
+    /// Receive an item if it can be done without suspending
+    bool tryReceive(T &t)
+    {
+        Wakeups wakeups;
+        boost::mutex::scoped_lock lock(m_mutex);
+        return tryReceiveLocked(&t, wakeups);
+    }
+
+    size_t capacity() const { return m_buffer.size(); }
+    /// @return How many items are currently buffered
+    size_t size() const
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        return m_size;
+    }
+
+private:
+    bool trySendLocked(const void *value, Wakeups &wakeups)
+    {
+        const T &t = *(const T *)value;
+        Waiter *receiver = claim(m_receivers);
+        if (receiver) {
+            *(T *)receiver->value = t;
+            receiver->ok = true;
+            wakeups.add(*receiver->state);
+            return true;
+        }
+        if (m_size == m_buffer.size())
+            return false;
+        m_buffer[(m_head + m_size++) % m_buffer.size()] = t;
+        return true;
+    }
+
+    bool tryReceiveLocked(void *value, Wakeups &wakeups)
+    {
+        T &t = *(T *)value;
+        Waiter *sender;
+        if (m_size > 0) {
+            t = m_buffer[m_head];
+            // Don't hang on to whatever the item references
+            m_buffer[m_head] = T();
+            m_head = (m_head + 1) % m_buffer.size();
+            --m_size;
+            // Make room for a blocked sender
+            sender = claim(m_senders);
+            if (sender)
+                m_buffer[(m_head + m_size++) % m_buffer.size()] =
+                    *(const T *)sender->value;
+        } else {
+            // Unbuffered (or the sender is in a Select); take it directly
+            sender = claim(m_senders);
+            if (!sender)
+                return false;
+            t = *(const T *)sender->value;
+        }
+        if (sender) {
+            sender->ok = true;
+            wakeups.add(*sender->state);
+        }
+        return true;
+    }
+
+private:
+    std::vector<T> m_buffer;
+    size_t m_head, m_size;
+};
+
+/// Wait for the first of several Channel operations (or timeouts)
+
+/// Add cases with send(), receive() and timeout(), and then wait() for
+/// exactly one of them to complete.  When several cases are ready at once,
+/// the one added first wins.  A Select can be waited on repeatedly.
+/// @code
+/// Select select;
+/// size_t gotWork = select.receive(work, item);
+/// size_t gotControl = select.receive(control, message);
+/// size_t timedOut = select.timeout(ioManager, 1000000);
+/// size_t which = select.wait();
+/// if (which == gotWork && select.ok())
+///     ...
+/// @endcode
+class Select : boost::noncopyable
+{
+public:
+    Select() : m_ok(false) {}
+
+    /// @return The index of the case
+    template <class T>
+    size_t receive(Channel<T> &channel, T &value)
+    { return add(&channel, false, &value); }
+    /// @return The index of the case
+    template <class T>
+    size_t send(Channel<T> &channel, const T &value)
+    { return add(&channel, true, (void *)&value); }
+    /// @return The index of a case that completes after us microseconds
+    size_t timeout(TimerManager &timerManager, unsigned long long us);
+
+    /// Suspend until one of the cases completes
+    /// @return The index of the completed case
+    /// @throws ChannelClosedException if it was a send on a closed Channel
+    size_t wait();
+    /// Complete a case if one is ready, without suspending
+    /// @return The index of the completed case, or ~0u
+    /// @throws ChannelClosedException if it was a send on a closed Channel
+    size_t poll();
+
+    /// @return If the last completed receive got an item (instead of its
+    /// Channel being closed)
+    bool ok() const { return m_ok; }
+
+private:
+    struct Case
+    {
+        ChannelBase *channel;
+        bool send;
+        void *value;
+        TimerManager *timerManager;
+        unsigned long long us;
+    };
+
+    size_t add(ChannelBase *channel, bool send, void *value);
+    std::vector<boost::mutex *> mutexes() const;
+    size_t tryLocked(ChannelBase::Wakeups &wakeups);
+    size_t completed(size_t index, bool ok);
+
+    static void timedOut(boost::shared_ptr<ChannelBase::WaitState> state,
+        intptr_t index);
+
+private:
+    std::vector<Case> m_cases;
+    bool m_ok;
+};
+
+}
+
+#endif
@@ -0,0 +1,258 @@
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include "deadline.h"
+
+#include <algorithm>
+
+#include <boost/bind.hpp>
+
+#include "assert.h"
+#include "fiber.h"
+#include "log.h"
+
+namespace Mordor {
+
+static Logger::ptr g_log = Log::lookup("mordor:deadline");
+
+static FiberLocalStorage<Deadline *> f_deadline;
+
+#ifdef WINDOWS
+static const error_t TIMED_OUT = WSAETIMEDOUT;
+static const error_t CANCELLED = ERROR_OPERATION_ABORTED;
+#else
+static const error_t TIMED_OUT = ETIMEDOUT;
+static const error_t CANCELLED = ECANCELED;
+#endif
+
+Deadline::Registration::Registration(boost::function<void (error_t)> dg,
+    TimerManager *timerManager)
+    : m_deadline(Deadline::getThis()),
+      m_dg(dg),
+      m_prev(NULL),
+      m_next(NULL),
+      m_linked(false)
+{
+    init(timerManager);
+}
+
+Deadline::Registration::Registration(Deadline &deadline,
+    boost::function<void (error_t)> dg, TimerManager *timerManager)
+    : m_deadline(&deadline),
+      m_dg(dg),
+      m_prev(NULL),
+      m_next(NULL),
+      m_linked(false)
+{
+    init(timerManager);
+}
+
+void
+Deadline::Registration::init(TimerManager *timerManager)
+{
+    if (!m_deadline)
+        return;
+    error_t error;
+    {
+        boost::mutex::scoped_lock lock(m_deadline->m_mutex);
+        error = m_deadline->m_error;
+        if (!error) {
+            m_prev = m_deadline->m_tail;
+            if (m_prev)
+                m_prev->m_next = this;
+            else
+                m_deadline->m_head = this;
+            m_deadline->m_tail = this;
+            m_linked = true;
+            if (m_deadline->m_expiration == ~0ull)
+                return;
+            unsigned long long now = TimerManager::now();
+            if (now < m_deadline->m_expiration) {
+                if (timerManager && !m_deadline->m_timer) {
+                    MORDOR_LOG_DEBUG(g_log) << m_deadline << " arming for "
+                        << m_deadline->m_expiration - now << "us";
+                    m_deadline->m_timer = timerManager->registerTimer(
+                        m_deadline->m_expiration - now,
+                        boost::bind(&Deadline::expired,
+                            boost::weak_ptr<Deadline>(
+                                m_deadline->shared_from_this())));
+                }
+                return;
+            }
+        }
+    }
+    if (error)
+        m_dg(error);
+    else
+        // Passed without anyone noticing yet; tell everyone, including us
+        m_deadline->fire(TIMED_OUT);
+}
+
+Deadline::Registration::~Registration()
+{
+    if (!m_deadline)
+        return;
+    {
+        boost::mutex::scoped_lock lock(m_deadline->m_mutex);
+        if (m_linked) {
+            if (m_prev)
+                m_prev->m_next = m_next;
+            else
+                m_deadline->m_head = m_next;
+            if (m_next)
+                m_next->m_prev = m_prev;
+            else
+                m_deadline->m_tail = m_prev;
+            return;
+        }
+    }
+    // fire() may still be calling m_dg
+    boost::mutex::scoped_lock lock(m_deadline->m_fireMutex);
+}
+
+void
+Deadline::Registration::check() const
+{
+    if (m_deadline)
+        m_deadline->check();
+}
+
+Deadline::Deadline(unsigned long long us, Deadline::ptr parent)
+    : m_expiration(us == ~0ull ? ~0ull : TimerManager::now() + us),
+      m_error(0),
+      m_head(NULL),
+      m_tail(NULL),
+      m_parentDeadline(parent)
+{
+    if (parent) {
+        m_expiration = std::min(m_expiration, parent->m_expiration);
+        m_parent.reset(new Registration(*parent,
+            boost::bind(&Deadline::fire, this, _1)));
+    }
+}
+
+Deadline::~Deadline()
+{
+    m_parent.reset();
+    MORDOR_ASSERT(!m_head);
+    if (m_timer)
+        m_timer->cancel();
+}
+
+unsigned long long
+Deadline::remaining() const
+{
+    if (error())
+        return 0;
+    if (m_expiration == ~0ull)
+        return ~0ull;
+    unsigned long long now = TimerManager::now();
+    return now < m_expiration ? m_expiration - now : 0;
+}
+
+error_t
+Deadline::error() const
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (m_error)
+        return m_error;
+    if (m_expiration != ~0ull && TimerManager::now() >= m_expiration)
+        return TIMED_OUT;
+    return 0;
+}
+
+void
+Deadline::cancel()
+{
+    MORDOR_LOG_DEBUG(g_log) << this << " cancelled";
+    fire(CANCELLED);
+}
+
+void
+Deadline::check() const
+{
+    error_t error = this->error();
+    if (error)
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "deadline");
+}
+
+void
+Deadline::fire(error_t error)
+{
+    boost::mutex::scoped_lock fireLock(m_fireMutex, boost::defer_lock);
+    Registration *registrations;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (m_error)
+            return;
+        m_error = error;
+        // Take everyone registered, and call them without m_mutex; they
+        // usually cancel I/O, which takes other locks
+        registrations = m_head;
+        m_head = m_tail = NULL;
+        size_t count = 0;
+        for (Registration *it = registrations; it; it = it->m_next, ++count)
+            it->m_linked = false;
+        MORDOR_LOG_VERBOSE(g_log) << this << " reached (" << error << "), "
+            << count << " operation(s) interrupted";
+        fireLock.lock();
+        if (m_timer) {
+            m_timer->cancel();
+            m_timer.reset();
+        }
+    }
+    for (Registration *it = registrations; it; it = it->m_next)
+        it->m_dg(error);
+}
+
+void
+Deadline::expired(boost::weak_ptr<Deadline> self)
+{
+    Deadline::ptr deadline = self.lock();
+    if (deadline)
+        deadline->fire(TIMED_OUT);
+}
+
+Deadline *
+Deadline::getThis()
+{
+    return f_deadline.get();
+}
+
+unsigned long long
+Deadline::timeLeft()
+{
+    Deadline *deadline = getThis();
+    return deadline ? deadline->remaining() : ~0ull;
+}
+
+void
+Deadline::throwIfReached()
+{
+    Deadline *deadline = getThis();
+    if (deadline)
+        deadline->check();
+}
+
+DeadlineScope::DeadlineScope(unsigned long long us)
+    : m_previous(Deadline::getThis())
+{
+    m_deadline.reset(new Deadline(us, m_previous ?
+        m_previous->shared_from_this() : Deadline::ptr()));
+    f_deadline = m_deadline.get();
+}
+
+DeadlineScope::DeadlineScope(Deadline::ptr deadline)
+    : m_deadline(deadline),
+      m_previous(Deadline::getThis())
+{
+    MORDOR_ASSERT(m_deadline);
+    f_deadline = m_deadline.get();
+}
+
+DeadlineScope::~DeadlineScope()
+{
+    MORDOR_ASSERT(Deadline::getThis() == m_deadline.get());
+    f_deadline = m_previous;
+}
+
+}
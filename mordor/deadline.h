@@ -0,0 +1,138 @@
+#ifndef __MORDOR_DEADLINE_H__
+#define __MORDOR_DEADLINE_H__
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "exception.h"
+#include "timer.h"
+
+namespace Mordor {
+
+/// A point in time by which work must be done, that can also be cancelled
+
+/// Rather than configuring a timeout on every Socket, Stream, and connection
+/// pool involved in a request, a Fiber can enter a DeadlineScope; blocking
+/// operations that honor deadlines (Socket, FDStream, ClientConnection,
+/// RetryRequestBroker, ...) will then give up with a TimedOutException once
+/// the deadline passes (see socket.h), or an OperationAbortedException if it's
+/// cancelled.
+///
+/// A Deadline arms at most one Timer, and only when an operation actually
+/// blocks under it, no matter how many operations are performed.
+class Deadline : public boost::enable_shared_from_this<Deadline>,
+    boost::noncopyable
+{
+public:
+    typedef boost::shared_ptr<Deadline> ptr;
+
+    /// Arranges for an in-progress operation to be interrupted
+
+    /// While a Registration exists, dg will be called (at most once) if the
+    /// current Fiber's Deadline expires or is cancelled, with the error
+    /// (ETIMEDOUT or ECANCELED, or their Windows equivalents).  If the
+    /// Deadline has already passed, dg is called immediately.  If the Fiber
+    /// has no Deadline, a Registration does nothing.
+    class Registration : boost::noncopyable
+    {
+        friend class Deadline;
+    public:
+        /// @param timerManager Where to arm the Deadline's Timer, if it isn't
+        /// already; if NULL, dg is only called for an explicit cancel()
+        Registration(boost::function<void (error_t)> dg,
+            TimerManager *timerManager = NULL);
+        Registration(Deadline &deadline, boost::function<void (error_t)> dg,
+            TimerManager *timerManager = NULL);
+        ~Registration();
+
+        /// Throw if the Deadline passed while registered
+        void check() const;
+
+    private:
+        void init(TimerManager *timerManager);
+
+    private:
+        Deadline *m_deadline;
+        boost::function<void (error_t)> m_dg;
+        /// Linked intrusively into m_deadline's registrations, so that
+        /// registering doesn't allocate
+        Registration *m_prev, *m_next;
+        bool m_linked;
+    };
+
+public:
+    /// @param us How long from now until the deadline; ~0ull for none (i.e.
+    /// it can only be cancelled)
+    /// @param parent An enclosing Deadline; this Deadline will be no later
+    /// than parent, and is cancelled along with it
+    Deadline(unsigned long long us = ~0ull,
+        Deadline::ptr parent = Deadline::ptr());
+    ~Deadline();
+
+    /// @return The deadline, in TimerManager::now() terms; ~0ull for none
+    unsigned long long expiration() const { return m_expiration; }
+    /// @return Microseconds until the deadline; 0 if it has already passed or
+    /// been cancelled, ~0ull if there isn't one
+    unsigned long long remaining() const;
+    /// @return 0, or why the Deadline has been reached
+    error_t error() const;
+
+    /// Interrupt everything currently running under this Deadline, and
+    /// anything that tries to later
+    void cancel();
+
+    /// @throws TimedOutException or OperationAbortedException if the Deadline
+    /// has been reached
+    void check() const;
+
+    /// @return The Deadline for the current Fiber, or NULL
+    static Deadline *getThis();
+    /// @return Microseconds until the current Fiber's deadline, or ~0ull if
+    /// there isn't one
+    static unsigned long long timeLeft();
+    /// Throw if the current Fiber's Deadline has been reached
+    static void throwIfReached();
+
+private:
+    void fire(error_t error);
+    static void expired(boost::weak_ptr<Deadline> self);
+
+private:
+    unsigned long long m_expiration;
+    mutable boost::mutex m_mutex;
+    /// Held while fire() calls the delegates of the Registrations it took,
+    /// so they can't be destroyed out from under it
+    boost::mutex m_fireMutex;
+    error_t m_error;
+    Registration *m_head, *m_tail;
+    Timer::ptr m_timer;
+    Deadline::ptr m_parentDeadline;
+    boost::scoped_ptr<Registration> m_parent;
+};
+
+/// Sets the Deadline for the current Fiber until it goes out of scope
+class DeadlineScope : boost::noncopyable
+{
+public:
+    /// Start a new Deadline us microseconds from now (but never later than
+    /// the enclosing one)
+    DeadlineScope(unsigned long long us);
+    /// Adopt an existing Deadline, i.e. to propagate it to a different Fiber
+    DeadlineScope(Deadline::ptr deadline);
+    ~DeadlineScope();
+
+    Deadline::ptr deadline() const { return m_deadline; }
+
+private:
+    Deadline::ptr m_deadline;
+    Deadline *m_previous;
+};
+
+}
+
+#endif
@@ -0,0 +1,94 @@
+//
+// Mordor Buffer::find benchmark app.
+//
+// Searches a multi-megabyte, multi-segment Buffer for a byte (only present
+// at the very end), for the blank line ending a block of CRLF-terminated
+// lines, and for lines the way getDelimited() would, comparing the scalar
+// and vectorized search kernels.
+//
+
+#include "mordor/predef.h"
+
+#include <iostream>
+#include <string>
+
+#include "mordor/config.h"
+#include "mordor/main.h"
+#include "mordor/streams/buffer.h"
+#include "mordor/timer.h"
+
+using namespace Mordor;
+
+static ConfigVar<size_t>::ptr g_size = Config::lookup<size_t>(
+    "bufferbench.size", 8388608u, "Bytes in the Buffer to search");
+static ConfigVar<size_t>::ptr g_segmentSize = Config::lookup<size_t>(
+    "bufferbench.segmentsize", 65536u, "Bytes per segment");
+static ConfigVar<size_t>::ptr g_iterations = Config::lookup<size_t>(
+    "bufferbench.iterations", 50u, "Number of searches of each kind");
+static ConfigVar<size_t>::ptr g_lineLength = Config::lookup<size_t>(
+    "bufferbench.linelength", 80u, "Length of each line for the line search");
+
+static void report(const char *impl, const char *op, size_t bytes,
+    unsigned long long elapsed)
+{
+    std::cout << impl << " " << op << " bytes=" << bytes << " time="
+        << elapsed << "us rate="
+        << (unsigned long long)(bytes / (elapsed ? elapsed : 1)) << "MB/s"
+        << std::endl;
+}
+
+static Buffer makeBuffer(size_t size, size_t segmentSize, size_t lineLength,
+    const std::string &tail)
+{
+    std::string segment(segmentSize, 'a');
+    if (lineLength)
+        for (size_t i = lineLength - 2; i + 1 < segmentSize; i += lineLength) {
+            segment[i] = '\r';
+            segment[i + 1] = '\n';
+        }
+    Buffer result;
+    while (result.readAvailable() + segmentSize <= size)
+        result.copyIn(Buffer(segment));
+    result.copyIn(tail);
+    return result;
+}
+
+static void run(const char *impl, size_t size, size_t segmentSize,
+    size_t iterations, size_t lineLength)
+{
+    Buffer haystack = makeBuffer(size, segmentSize, 0, "\r\n\r\n");
+    size_t bytes = haystack.readAvailable() * iterations;
+
+    unsigned long long start = TimerManager::now();
+    for (size_t i = 0; i < iterations; ++i)
+        haystack.find('\r');
+    report(impl, "find(char)", bytes, TimerManager::now() - start);
+
+    Buffer lines = makeBuffer(size, segmentSize, lineLength, "\r\n\r\n");
+    bytes = lines.readAvailable() * iterations;
+    start = TimerManager::now();
+    for (size_t i = 0; i < iterations; ++i)
+        lines.find("\r\n\r\n");
+    report(impl, "find(string)", bytes, TimerManager::now() - start);
+
+    bytes = lines.readAvailable();
+    start = TimerManager::now();
+    while (lines.readAvailable() > 0)
+        lines.getDelimited('\n');
+    report(impl, "getDelimited", bytes, TimerManager::now() - start);
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    Config::loadFromEnvironment();
+    size_t size = g_size->val();
+    size_t segmentSize = g_segmentSize->val();
+    size_t iterations = g_iterations->val();
+    size_t lineLength = g_lineLength->val();
+    ConfigVarBase::ptr simd = Config::lookup("buffer.simd");
+    simd->fromString("0");
+    run("scalar", size, segmentSize, iterations, lineLength);
+    simd->fromString("1");
+    run("simd", size, segmentSize, iterations, lineLength);
+    return 0;
+}
@@ -0,0 +1,105 @@
+//
+// Mordor Fiber benchmark app.
+//
+// Measures how many context switches per second the compiled in Fiber
+// implementation can do, and for comparison, how many raw swapcontext()
+// can do on platforms that have it.
+//
+
+#include "mordor/predef.h"
+
+#include <iostream>
+#include <vector>
+
+#include <boost/bind.hpp>
+
+#include "mordor/config.h"
+#include "mordor/fiber.h"
+#include "mordor/main.h"
+#include "mordor/timer.h"
+
+#ifdef POSIX
+#ifdef __APPLE__
+#include <sys/ucontext.h>
+#else
+#include <ucontext.h>
+#endif
+#endif
+
+using namespace Mordor;
+
+static ConfigVar<size_t>::ptr g_switches = Config::lookup<size_t>(
+    "fiberbench.switches", 10000000u, "Number of context switches per run");
+
+#ifdef NATIVE_WINDOWS_FIBERS
+static const char *g_implementation = "windows";
+#elif defined(ASM_FIBERS)
+static const char *g_implementation = "asm";
+#elif defined(UCONTEXT_FIBERS)
+static const char *g_implementation = "ucontext";
+#elif defined(SETJMP_FIBERS)
+static const char *g_implementation = "setjmp";
+#endif
+
+static void report(const char *name, size_t switches,
+    unsigned long long elapsed)
+{
+    std::cout << name << " switches=" << switches << " time=" << elapsed
+        << "us rate="
+        << (unsigned long long)(switches * 1000000.0 / (elapsed ? elapsed : 1))
+        << "/s" << std::endl;
+}
+
+static void pingPong(size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        Fiber::yield();
+}
+
+static void fibers(size_t switches)
+{
+    // Each call() and yield() is a switch
+    size_t count = switches / 2;
+    Fiber::ptr fiber(new Fiber(boost::bind(&pingPong, count)));
+    unsigned long long start = TimerManager::now();
+    for (size_t i = 0; i <= count; ++i)
+        fiber->call();
+    report(g_implementation, count * 2, TimerManager::now() - start);
+}
+
+#ifdef POSIX
+static ucontext_t g_caller, g_callee;
+
+static void ucontextPingPong()
+{
+    while (true)
+        swapcontext(&g_callee, &g_caller);
+}
+
+static void ucontexts(size_t switches)
+{
+    size_t count = switches / 2;
+    std::vector<char> stack(65536);
+    getcontext(&g_callee);
+    g_callee.uc_link = NULL;
+    g_callee.uc_stack.ss_sp = &stack[0];
+    g_callee.uc_stack.ss_size = stack.size();
+    makecontext(&g_callee, &ucontextPingPong, 0);
+    unsigned long long start = TimerManager::now();
+    for (size_t i = 0; i < count; ++i)
+        swapcontext(&g_caller, &g_callee);
+    report("swapcontext", count * 2, TimerManager::now() - start);
+}
+#endif
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    Config::loadFromEnvironment();
+    size_t switches = g_switches->val();
+    Fiber::getThis();
+    fibers(switches);
+#ifdef POSIX
+    ucontexts(switches);
+#endif
+    return 0;
+}
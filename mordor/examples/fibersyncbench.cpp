@@ -0,0 +1,167 @@
+//
+// Mordor fiber synchronization benchmark app.
+//
+// Measures how many critical sections per second a set of fibers can get
+// through when they all contend for a single FiberMutex, FiberRWMutex (with
+// mostly shared access) or FiberSemaphore (used as a mutex), as the number of
+// threads grows.
+//
+
+#include "mordor/predef.h"
+
+#include <iostream>
+#include <map>
+
+#include <boost/bind.hpp>
+
+#include "mordor/config.h"
+#include "mordor/fibersynchronization.h"
+#include "mordor/main.h"
+#include "mordor/timer.h"
+#include "mordor/workerpool.h"
+
+using namespace Mordor;
+
+static ConfigVar<size_t>::ptr g_maxThreads = Config::lookup<size_t>(
+    "fibersyncbench.threads", 8u, "Maximum number of threads to benchmark with");
+static ConfigVar<size_t>::ptr g_fibers = Config::lookup<size_t>(
+    "fibersyncbench.fibers", 64u, "Number of fibers contending for the lock");
+static ConfigVar<size_t>::ptr g_ops = Config::lookup<size_t>(
+    "fibersyncbench.ops", 1000000u, "Number of critical sections per run");
+static ConfigVar<size_t>::ptr g_writePercent = Config::lookup<size_t>(
+    "fibersyncbench.writepercent", 5u,
+    "Percentage of critical sections that need exclusive access");
+
+namespace {
+
+// Stands in for something like a routing table
+struct Table
+{
+    Table()
+    {
+        for (int i = 0; i < 256; ++i)
+            m_map[i] = i;
+    }
+
+    int lookup(int key) const
+    {
+        std::map<int, int>::const_iterator it = m_map.find(key & 255);
+        return it == m_map.end() ? 0 : it->second;
+    }
+
+    void update(int key) { ++m_map[key & 255]; }
+
+private:
+    std::map<int, int> m_map;
+};
+
+}
+
+// Keeps the lookups from being optimized away
+static volatile int g_sink;
+
+static void mutexWorker(FiberMutex &mutex, Table &table, size_t ops,
+    size_t writePercent)
+{
+    int sum = 0;
+    for (size_t i = 0; i < ops; ++i) {
+        FiberMutex::ScopedLock lock(mutex);
+        if (i % 100 < writePercent)
+            table.update((int)i);
+        else
+            sum += table.lookup((int)i);
+    }
+    g_sink = sum;
+}
+
+static void rwMutexWorker(FiberRWMutex &mutex, Table &table, size_t ops,
+    size_t writePercent)
+{
+    int sum = 0;
+    for (size_t i = 0; i < ops; ++i) {
+        if (i % 100 < writePercent) {
+            FiberRWMutex::ScopedLock lock(mutex);
+            table.update((int)i);
+        } else {
+            FiberRWMutex::SharedScopedLock lock(mutex);
+            sum += table.lookup((int)i);
+        }
+    }
+    g_sink = sum;
+}
+
+static void semaphoreWorker(FiberSemaphore &semaphore, Table &table,
+    size_t ops, size_t writePercent)
+{
+    int sum = 0;
+    for (size_t i = 0; i < ops; ++i) {
+        semaphore.wait();
+        if (i % 100 < writePercent)
+            table.update((int)i);
+        else
+            sum += table.lookup((int)i);
+        semaphore.notify();
+    }
+    g_sink = sum;
+}
+
+static void report(const char *name, size_t threads, size_t ops,
+    unsigned long long elapsed)
+{
+    std::cout << name << " threads=" << threads << " ops=" << ops
+        << " time=" << elapsed << "us rate="
+        << (unsigned long long)(ops * 1000000.0 / (elapsed ? elapsed : 1))
+        << "/s" << std::endl;
+}
+
+template <class Lock>
+static void run(const char *name,
+    void (*worker)(Lock &, Table &, size_t, size_t), size_t threads,
+    size_t fibers, size_t ops, size_t writePercent)
+{
+    Lock lock;
+    Table table;
+    size_t perFiber = ops / fibers;
+    WorkerPool pool(threads, false);
+    unsigned long long start = TimerManager::now();
+    for (size_t i = 0; i < fibers; ++i)
+        pool.schedule(boost::bind(worker, boost::ref(lock), boost::ref(table),
+            perFiber, writePercent));
+    pool.stop();
+    report(name, threads, perFiber * fibers, TimerManager::now() - start);
+}
+
+static void semaphoreRun(size_t threads, size_t fibers, size_t ops,
+    size_t writePercent)
+{
+    FiberSemaphore semaphore(1);
+    Table table;
+    size_t perFiber = ops / fibers;
+    WorkerPool pool(threads, false);
+    unsigned long long start = TimerManager::now();
+    for (size_t i = 0; i < fibers; ++i)
+        pool.schedule(boost::bind(&semaphoreWorker, boost::ref(semaphore),
+            boost::ref(table), perFiber, writePercent));
+    pool.stop();
+    report("semaphore", threads, perFiber * fibers,
+        TimerManager::now() - start);
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    Config::loadFromEnvironment();
+    size_t maxThreads = g_maxThreads->val();
+    size_t fibers = g_fibers->val();
+    size_t ops = g_ops->val();
+    size_t writePercent = g_writePercent->val();
+    if (fibers == 0)
+        fibers = 1;
+    for (size_t threads = 1; threads <= maxThreads; threads *= 2) {
+        run<FiberMutex>("mutex", &mutexWorker, threads, fibers, ops,
+            writePercent);
+        run<FiberRWMutex>("rwmutex", &rwMutexWorker, threads, fibers, ops,
+            writePercent);
+        semaphoreRun(threads, fibers, ops, writePercent);
+    }
+    return 0;
+}
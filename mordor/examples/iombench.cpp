@@ -1,7 +1,9 @@
 //
 // Mordor IOManager benchmark app.
 //
-// Can act as both the client and the server.
+// Can act as both the client and the server.  With iombench.shards set,
+// the server (and the clients) run on a ShardedIOManager instead of sharing
+// a single IOManager, so the two modes can be compared.
 //
 
 #include "mordor/predef.h"
@@ -11,6 +13,7 @@
 #include <iostream>
 
 #include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include "mordor/atomic.h"
 #include "mordor/config.h"
@@ -18,39 +21,32 @@
 #include "mordor/iomanager.h"
 #include "mordor/log.h"
 #include "mordor/main.h"
+#include "mordor/sharded_iomanager.h"
 #include "mordor/socket.h"
 
 using namespace Mordor;
 
 static ConfigVar<int>::ptr g_iomThreads = Config::lookup<int>(
     "iombench.threads", 1, "Number of threads used by the iomanager");
+static ConfigVar<size_t>::ptr g_shards = Config::lookup<size_t>(
+    "iombench.shards", 0u,
+    "Number of independent event loops to shard connections across (0 to "
+    "share a single iomanager)");
 
 static Logger::ptr g_log = Log::lookup("mordor:iombench");
 
 class IOMBenchServer : public NetBenchServer
 {
 public:
-    IOMBenchServer(IOManager& iom)
-        : m_iom(iom)
+    IOMBenchServer(IOManager& iom, ShardedIOManager *shards)
+        : m_iom(iom),
+          m_shards(shards)
     {}
 
     void run(std::string& host,
              size_t perConnToRead,
              size_t perConnToWrite,
              boost::function<void()> done)
-    {
-        m_iom.schedule(boost::bind(&IOMBenchServer::server, this, host,
-                                   perConnToRead, perConnToWrite));
-        done();
-    }
-
-    void stop()
-    {
-        m_sock->cancelAccept();
-    }
-
-private:
-    void server(std::string host, size_t perConnToRead, size_t perConnToWrite)
     {
         m_data.reset(new char[perConnToWrite]);
         memset(m_data.get(), 'B', perConnToWrite);
@@ -61,25 +57,51 @@ private:
         MORDOR_VERIFY(!addrs.empty());
 
         // setup the server
-        m_sock = addrs.front()->createSocket(m_iom);
-        unsigned int opt = 1;
-        m_sock->setOption(SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        m_sock->bind(addrs.front());
-        m_sock->listen();
+        if (m_shards) {
+            m_socks = m_shards->listen(addrs.front());
+        } else {
+            Socket::ptr sock = addrs.front()->createSocket(m_iom);
+            unsigned int opt = 1;
+            sock->setOption(SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+            sock->bind(addrs.front());
+            sock->listen();
+            m_socks.push_back(sock);
+        }
 
+        // Each listening socket accepts on its own shard, and its
+        // connections stay there
+        for (size_t i = 0; i < m_socks.size(); ++i) {
+            IOManager &iom = m_shards ? m_shards->shard(i) : m_iom;
+            iom.schedule(boost::bind(&IOMBenchServer::server, this,
+                                     m_socks[i], boost::ref(iom),
+                                     perConnToRead, perConnToWrite));
+        }
+        done();
+    }
+
+    void stop()
+    {
+        for (size_t i = 0; i < m_socks.size(); ++i)
+            m_socks[i]->cancelAccept();
+    }
+
+private:
+    void server(Socket::ptr sock, IOManager &iom, size_t perConnToRead,
+                size_t perConnToWrite)
+    {
         // accept connections
         while (true) {
             Socket::ptr conn;
             try {
-                conn = m_sock->accept();
+                conn = sock->accept();
             } catch (Exception&) {
                 return;
             }
-            m_iom.schedule(boost::bind(&IOMBenchServer::handleConn,
-                                               this,
-                                               conn,
-                                               perConnToRead,
-                                               perConnToWrite));
+            iom.schedule(boost::bind(&IOMBenchServer::handleConn,
+                                     this,
+                                     conn,
+                                     perConnToRead,
+                                     perConnToWrite));
         }
     }
 
@@ -107,15 +129,17 @@ private:
 
 private:
     IOManager& m_iom;
-    Socket::ptr m_sock;
+    ShardedIOManager *m_shards;
+    std::vector<Socket::ptr> m_socks;
     boost::scoped_array<char> m_data;
 };
 
 class IOMBenchClient : public NetBenchClient
 {
 public:
-    IOMBenchClient(IOManager& iom)
+    IOMBenchClient(IOManager& iom, ShardedIOManager *shards)
         : m_iom(iom),
+          m_shards(shards),
           m_connectedCond(m_mutex),
           m_readyCond(m_mutex),
           m_doneCond(m_mutex),
@@ -161,8 +185,9 @@ public:
             << "iters " << iters;
 
         for (size_t i = 0; i < newClients; i++) {
-            m_iom.schedule(boost::bind(&IOMBenchClient::client,
-                                               this, newActive > 0));
+            IOManager &iom = m_shards ? m_shards->next() : m_iom;
+            iom.schedule(boost::bind(&IOMBenchClient::client,
+                                     this, boost::ref(iom), newActive > 0));
             if (newActive) {
                 newActive--;
             }
@@ -211,7 +236,7 @@ public:
         m_readyCond.broadcast();
     }
 
-    void client(bool active)
+    void client(IOManager &iom, bool active)
     {
         MORDOR_LOG_DEBUG(g_log) << "client start " << active;
 
@@ -221,7 +246,7 @@ public:
         int round = m_round;
         lock.unlock();
 
-        Socket::ptr conn = m_addr->createSocket(m_iom);
+        Socket::ptr conn = m_addr->createSocket(iom);
         conn->connect(m_addr);
 
         lock.lock();
@@ -277,6 +302,7 @@ public:
 
 private:
     IOManager& m_iom;
+    ShardedIOManager *m_shards;
     Address::ptr m_addr;
 
     boost::scoped_array<char> m_data;
@@ -308,11 +334,16 @@ MORDOR_MAIN(int argc, char *argv[])
 
         Config::loadFromEnvironment();
         IOManager iom(g_iomThreads->val());
+        boost::scoped_ptr<ShardedIOManager> shards;
+        if (g_shards->val() != 0)
+            shards.reset(new ShardedIOManager(g_shards->val()));
 
-        IOMBenchServer server(iom);
-        IOMBenchClient client(iom);
+        IOMBenchServer server(iom, shards.get());
+        IOMBenchClient client(iom, shards.get());
 
         bench.run(&server, &client);
+        if (shards)
+            shards->stop();
         iom.stop();
         return 0;
     } catch (...) {
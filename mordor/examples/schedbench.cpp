@@ -0,0 +1,116 @@
+//
+// Mordor Scheduler benchmark app.
+//
+// Measures schedule/dispatch throughput of a WorkerPool as the number of
+// threads grows, both for work scheduled from outside the Scheduler and for
+// work fanned out from fibers already running on it.
+//
+
+#include "mordor/predef.h"
+
+#include <iostream>
+
+#include <boost/bind.hpp>
+
+#include "mordor/atomic.h"
+#include "mordor/config.h"
+#include "mordor/main.h"
+#include "mordor/semaphore.h"
+#include "mordor/timer.h"
+#include "mordor/workerpool.h"
+
+using namespace Mordor;
+
+static ConfigVar<size_t>::ptr g_maxThreads = Config::lookup<size_t>(
+    "schedbench.threads", 8u, "Maximum number of threads to benchmark with");
+static ConfigVar<size_t>::ptr g_ops = Config::lookup<size_t>(
+    "schedbench.ops", 1000000u, "Number of delegates to schedule per run");
+static ConfigVar<size_t>::ptr g_fanout = Config::lookup<size_t>(
+    "schedbench.fanout", 16u,
+    "Number of fibers scheduling work from within the Scheduler");
+
+namespace {
+
+struct Counter
+{
+    Counter(size_t target)
+        : m_target(target)
+    {}
+
+    void done()
+    {
+        if (++m_done == m_target)
+            m_semaphore.notify();
+    }
+
+    void wait() { m_semaphore.wait(); }
+
+private:
+    size_t m_target;
+    Atomic<size_t> m_done;
+    Semaphore m_semaphore;
+};
+
+}
+
+static void nop(Counter &counter)
+{
+    counter.done();
+}
+
+static void fanOut(Counter &counter, size_t count)
+{
+    Scheduler *scheduler = Scheduler::getThis();
+    for (size_t i = 0; i < count; ++i)
+        scheduler->schedule(boost::bind(&nop, boost::ref(counter)));
+}
+
+static void report(const char *name, size_t threads, size_t ops,
+    unsigned long long elapsed)
+{
+    std::cout << name << " threads=" << threads << " ops=" << ops
+        << " time=" << elapsed << "us rate="
+        << (unsigned long long)(ops * 1000000.0 / (elapsed ? elapsed : 1))
+        << "/s" << std::endl;
+}
+
+static void external(size_t threads, size_t ops)
+{
+    Counter counter(ops);
+    WorkerPool pool(threads, false);
+    unsigned long long start = TimerManager::now();
+    for (size_t i = 0; i < ops; ++i)
+        pool.schedule(boost::bind(&nop, boost::ref(counter)));
+    counter.wait();
+    report("external", threads, ops, TimerManager::now() - start);
+    pool.stop();
+}
+
+static void internal(size_t threads, size_t ops, size_t fanout)
+{
+    size_t perFiber = ops / fanout;
+    Counter counter(perFiber * fanout);
+    WorkerPool pool(threads, false);
+    unsigned long long start = TimerManager::now();
+    for (size_t i = 0; i < fanout; ++i)
+        pool.schedule(boost::bind(&fanOut, boost::ref(counter), perFiber));
+    counter.wait();
+    report("internal", threads, perFiber * fanout,
+        TimerManager::now() - start);
+    pool.stop();
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    Config::loadFromEnvironment();
+    size_t maxThreads = g_maxThreads->val();
+    size_t ops = g_ops->val();
+    size_t fanout = g_fanout->val();
+    if (fanout == 0)
+        fanout = 1;
+    for (size_t threads = 1; threads <= maxThreads; threads *= 2)
+        external(threads, ops);
+    for (size_t threads = 1; threads <= maxThreads; threads *= 2)
+        internal(threads, ops, fanout);
+    return 0;
+}
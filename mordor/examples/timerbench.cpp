@@ -0,0 +1,86 @@
+//
+// Mordor TimerManager benchmark app.
+//
+// Simulates per-connection timeouts (an idle timeout and a read timeout for
+// each connection, with the read timeout refreshed on every read), and
+// compares the tree-based TimerManager with the timing wheel.
+//
+
+#include "mordor/predef.h"
+
+#include <iostream>
+#include <vector>
+
+#include "mordor/config.h"
+#include "mordor/main.h"
+#include "mordor/timer.h"
+
+using namespace Mordor;
+
+static ConfigVar<size_t>::ptr g_connections = Config::lookup<size_t>(
+    "timerbench.connections", 200000u, "Number of simulated connections");
+static ConfigVar<size_t>::ptr g_reads = Config::lookup<size_t>(
+    "timerbench.reads", 10u, "Number of reads (timer refreshes) per connection");
+
+static void nop()
+{}
+
+static void report(const char *impl, const char *op, size_t ops,
+    unsigned long long elapsed)
+{
+    std::cout << impl << " " << op << " ops=" << ops << " time=" << elapsed
+        << "us rate="
+        << (unsigned long long)(ops * 1000000.0 / (elapsed ? elapsed : 1))
+        << "/s" << std::endl;
+}
+
+static void run(const char *impl, size_t connections, size_t reads)
+{
+    TimerManager manager;
+    std::vector<Timer::ptr> idle, read;
+    idle.reserve(connections);
+    read.reserve(connections);
+
+    unsigned long long start = TimerManager::now();
+    for (size_t i = 0; i < connections; ++i) {
+        // Spread them out a bit, like real connections
+        idle.push_back(manager.registerTimer(60000000ull + i % 1000 * 1000,
+            &nop));
+        read.push_back(manager.registerTimer(30000000ull + i % 1000 * 1000,
+            &nop));
+    }
+    report(impl, "register", connections * 2, TimerManager::now() - start);
+
+    start = TimerManager::now();
+    for (size_t r = 0; r < reads; ++r)
+        for (size_t i = 0; i < connections; ++i)
+            read[i]->refresh();
+    report(impl, "refresh", connections * reads, TimerManager::now() - start);
+
+    start = TimerManager::now();
+    for (size_t i = 0; i < connections; ++i) {
+        read[i]->reset(10000000ull, true);
+        idle[i]->reset(120000000ull, false);
+    }
+    report(impl, "reset", connections * 2, TimerManager::now() - start);
+
+    start = TimerManager::now();
+    for (size_t i = 0; i < connections; ++i) {
+        read[i]->cancel();
+        idle[i]->cancel();
+    }
+    report(impl, "cancel", connections * 2, TimerManager::now() - start);
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    Config::loadFromEnvironment();
+    size_t connections = g_connections->val();
+    size_t reads = g_reads->val();
+    ConfigVarBase::ptr wheel = Config::lookup("timer.wheel");
+    wheel->fromString("0");
+    run("tree", connections, reads);
+    wheel->fromString("1");
+    run("wheel", connections, reads);
+    return 0;
+}
@@ -2,12 +2,15 @@
 
 #include "fiber.h"
 
+#include <map>
+
 #include <boost/thread/tss.hpp>
 
 #include "assert.h"
 #include "config.h"
 #include "exception.h"
 #include "statistics.h"
+#include "thread.h"
 #include "version.h"
 
 #ifdef WINDOWS
@@ -17,6 +20,8 @@
 #else
 #include <sys/mman.h>
 #include <pthread.h>
+#include <string.h>
+#include <time.h>
 #endif
 
 namespace Mordor {
@@ -27,6 +32,20 @@ static AverageMinMaxStatistic<unsigned int> &g_statAlloc =
 static AverageMinMaxStatistic<unsigned int> &g_statFree=
     Statistics::registerStatistic("fiber.freestack",
     AverageMinMaxStatistic<unsigned int>("us"));
+#ifdef POSIX
+static CountStatistic<unsigned int> &g_statAllocPooled =
+    Statistics::registerStatistic("fiber.allocstack.pooled",
+    CountStatistic<unsigned int>("stacks"),
+    "Stacks allocated from a stack pool instead of mmap");
+static CountStatistic<unsigned int> &g_statFreePooled =
+    Statistics::registerStatistic("fiber.freestack.pooled",
+    CountStatistic<unsigned int>("stacks"),
+    "Stacks freed to a stack pool instead of munmap");
+static AverageMinMaxStatistic<unsigned int> &g_statStackUsage =
+    Statistics::registerStatistic("fiber.stackusage",
+    AverageMinMaxStatistic<unsigned int>("bytes"),
+    "High-water stack usage of fibers (if fiber.measurestackusage)");
+#endif
 
 static void fiber_switchContext(void **oldsp, void *newsp);
 
@@ -65,6 +84,29 @@ static ConfigVar<size_t>::ptr g_defaultStackSize = Config::lookup<size_t>(
 #endif
     "Default stack size for new fibers.  This is the virtual size; physical "
     "memory isn't consumed until it is actually referenced.");
+#ifdef POSIX
+static ConfigVar<size_t>::ptr g_stackCacheSize = Config::lookup<size_t>(
+    "fiber.stackcachesize", 16u,
+    "Number of freed stacks (of each size) each thread keeps for reuse.");
+static ConfigVar<size_t>::ptr g_stackPoolSize = Config::lookup<size_t>(
+    "fiber.stackpoolsize", 128u,
+    "Number of freed stacks (of each size) kept for reuse by any thread (on "
+    "the same NUMA node), once a thread's own cache is full.");
+static ConfigVar<bool>::ptr g_stackPoolTrim = Config::lookup(
+    "fiber.stackpooltrim", true,
+    "Give the physical memory of stacks in the shared pool back to the OS.  "
+    "It is repopulated on demand when the stack is reused.");
+static ConfigVar<bool>::ptr g_measureStackUsage = Config::lookup(
+    "fiber.measurestackusage", false,
+    "Measure how much of its stack each fiber used when it is freed, "
+    "and report it in the fiber.stackusage statistic.  Freed stacks are "
+    "cleared, so this costs a page fault for every page reused.");
+#endif
+
+static ConfigVar<bool>::ptr g_measureCpuTime = Config::lookup(
+    "fiber.cputime", false,
+    "Measure the CPU time used by each fiber (see Fiber::cpuTime()).  This "
+    "reads the thread's CPU clock on every switch between fibers.");
 
 // t_fiber is the Fiber currently executing on this thread
 // t_threadFiber is the Fiber that represents the thread's original stack
@@ -93,6 +135,8 @@ Fiber::Fiber()
     m_stack = NULL;
     m_stacksize = 0;
     m_sp = NULL;
+    m_cpuTime = m_switchedIn = 0;
+    m_priority = 0;
     setThis(this);
 #ifdef NATIVE_WINDOWS_FIBERS
     if (!pIsThreadAFiber())
@@ -113,6 +157,8 @@ Fiber::Fiber(boost::function<void ()> dg, size_t stacksize)
     m_state = INIT;
     m_stack = NULL;
     m_stacksize = stacksize;
+    m_cpuTime = m_switchedIn = 0;
+    m_priority = 0;
     allocStack();
 #ifdef UCONTEXT_FIBERS
     m_sp = &m_ctx;
@@ -159,6 +205,7 @@ Fiber::reset()
     MORDOR_ASSERT(m_dg);
     initStack();
     m_state = INIT;
+    m_cpuTime = 0;
 }
 
 void
@@ -170,6 +217,7 @@ Fiber::reset(boost::function<void ()> dg)
     m_dg = dg;
     initStack();
     m_state = INIT;
+    m_cpuTime = 0;
 }
 
 Fiber::ptr
@@ -183,9 +231,41 @@ Fiber::getThis()
     return t_fiber->shared_from_this();
 }
 
+static unsigned long long threadCpuTime()
+{
+#ifdef WINDOWS
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+        return 0;
+    // 100ns units
+    return ((((unsigned long long)kernel.dwHighDateTime << 32) |
+        kernel.dwLowDateTime) + (((unsigned long long)user.dwHighDateTime
+        << 32) | user.dwLowDateTime)) / 10;
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+        return 0;
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+#else
+    return 0;
+#endif
+}
+
 void
 Fiber::setThis(Fiber* f)
 {
+    // Every switch between fibers goes through here (on one side or the
+    // other), so charge the outgoing fiber for the time since it came in
+    // (g_measureCpuTime may not be constructed yet during static
+    // initialization)
+    if (g_measureCpuTime && g_measureCpuTime->val()) {
+        unsigned long long now = threadCpuTime();
+        Fiber *cur = t_fiber.get();
+        if (cur && cur->m_switchedIn)
+            cur->m_cpuTime += now - cur->m_switchedIn;
+        if (f)
+            f->m_switchedIn = now;
+    }
     t_fiber = f;
 }
 
@@ -378,6 +458,141 @@ static VOID CALLBACK native_fiber_entryPoint(PVOID lpParameter)
 }
 #endif
 
+#ifdef POSIX
+namespace {
+
+typedef std::map<size_t, std::vector<void *> > StackPool;
+
+// Stacks freed on this thread; the only ones that can be reused without
+// taking a lock
+struct StackCache
+{
+    ~StackCache();
+
+    StackPool stacks;
+};
+
+struct SharedStackPool
+{
+    boost::mutex mutex;
+    StackPool stacks;
+};
+
+}
+
+// There is a shared pool per NUMA node, since a stack's pages were (most
+// likely) allocated on the node of the thread that first touched them.
+// These are intentionally leaked; Fibers may still be freeing their stacks
+// during static destruction
+static SharedStackPool &g_stackPool()
+{
+    static size_t nodes = numaNodeCount();
+    static SharedStackPool *pools = new SharedStackPool[nodes];
+    size_t node = currentNumaNode();
+    return pools[node < nodes ? node : 0];
+}
+static boost::thread_specific_ptr<StackCache> t_stackCache;
+
+// Every stack is preceded by a PROT_NONE guard page, so that overflowing it
+// faults instead of silently scribbling on whatever is mapped below it
+static void *
+mapStack(size_t stacksize)
+{
+    void *base = mmap(NULL, stacksize + g_pagesize, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (base == MAP_FAILED)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+    if (mprotect(base, g_pagesize, PROT_NONE)) {
+        error_t error = lastError();
+        munmap(base, stacksize + g_pagesize);
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "mprotect");
+    }
+    return (char *)base + g_pagesize;
+}
+
+static void
+unmapStack(void *stack, size_t stacksize)
+{
+    munmap((char *)stack - g_pagesize, stacksize + g_pagesize);
+}
+
+static void *
+popStack(StackPool &pool, size_t stacksize)
+{
+    StackPool::iterator it = pool.find(stacksize);
+    if (it == pool.end() || it->second.empty())
+        return NULL;
+    void *stack = it->second.back();
+    it->second.pop_back();
+    return stack;
+}
+
+static bool
+pushStack(StackPool &pool, void *stack, size_t stacksize, size_t max)
+{
+    std::vector<void *> &stacks = pool[stacksize];
+    if (stacks.size() >= max)
+        return false;
+    stacks.push_back(stack);
+    return true;
+}
+
+// Put a stack in the shared pool, or unmap it if the pool is full
+static bool
+releaseStack(void *stack, size_t stacksize)
+{
+    if (g_stackPoolTrim->val()) {
+#ifdef MADV_FREE
+        madvise(stack, stacksize, MADV_FREE);
+#else
+        madvise(stack, stacksize, MADV_DONTNEED);
+#endif
+    }
+    {
+        SharedStackPool &pool = g_stackPool();
+        boost::mutex::scoped_lock lock(pool.mutex);
+        if (pushStack(pool.stacks, stack, stacksize, g_stackPoolSize->val()))
+            return true;
+    }
+    unmapStack(stack, stacksize);
+    return false;
+}
+
+// How many bytes from the top of the stack have been written to.  Pages that
+// have never been touched aren't resident, and the untouched part of the
+// lowest resident page is still zeroed (as long as the stack was cleared
+// before it was reused)
+static size_t
+stackUsage(void *stack, size_t stacksize)
+{
+    size_t pages = stacksize / g_pagesize;
+    std::vector<unsigned char> resident(pages);
+#ifdef LINUX
+    if (mincore(stack, stacksize, &resident[0]))
+#else
+    if (mincore(stack, stacksize, (char *)&resident[0]))
+#endif
+        return stacksize;
+    size_t page = 0;
+    while (page < pages && !(resident[page] & 1))
+        ++page;
+    const intptr_t *top = (const intptr_t *)((char *)stack + stacksize);
+    const intptr_t *p = (const intptr_t *)((char *)stack + page * g_pagesize);
+    while (p < top && *p == 0)
+        ++p;
+    return (const char *)top - (const char *)p;
+}
+
+StackCache::~StackCache()
+{
+    for (StackPool::iterator it = stacks.begin(); it != stacks.end(); ++it)
+        for (std::vector<void *>::iterator it2 = it->second.begin();
+            it2 != it->second.end();
+            ++it2)
+            releaseStack(*it2, it->first);
+}
+#endif
+
 void
 Fiber::allocStack()
 {
@@ -397,9 +612,19 @@ Fiber::allocStack()
     VirtualAlloc((char*)m_stack + g_pagesize, m_stacksize, MEM_COMMIT, PAGE_READWRITE);
     m_sp = (char*)m_stack + m_stacksize + g_pagesize;
 #elif defined(POSIX)
-    m_stack = mmap(NULL, m_stacksize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-    if (m_stack == MAP_FAILED)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+    m_stack = NULL;
+    StackCache *cache = t_stackCache.get();
+    if (cache)
+        m_stack = popStack(cache->stacks, m_stacksize);
+    if (!m_stack) {
+        SharedStackPool &pool = g_stackPool();
+        boost::mutex::scoped_lock lock(pool.mutex);
+        m_stack = popStack(pool.stacks, m_stacksize);
+    }
+    if (m_stack)
+        g_statAllocPooled.increment();
+    else
+        m_stack = mapStack(m_stacksize);
 #if defined(VALGRIND) && (defined(LINUX) || defined(OSX))
     m_valgrindStackId = VALGRIND_STACK_REGISTER(m_stack, (char *)m_stack + m_stacksize);
 #endif
@@ -420,7 +645,18 @@ Fiber::freeStack()
 #if defined(VALGRIND) && (defined(LINUX) || defined(OSX))
     VALGRIND_STACK_DEREGISTER(m_valgrindStackId);
 #endif
-    munmap(m_stack, m_stacksize);
+    if (g_measureStackUsage->val()) {
+        g_statStackUsage.update((unsigned int)stackUsage(m_stack, m_stacksize));
+        madvise(m_stack, m_stacksize, MADV_DONTNEED);
+    }
+    StackCache *cache = t_stackCache.get();
+    if (!cache) {
+        cache = new StackCache();
+        t_stackCache.reset(cache);
+    }
+    if (pushStack(cache->stacks, m_stack, m_stacksize,
+        g_stackCacheSize->val()) || releaseStack(m_stack, m_stacksize))
+        g_statFreePooled.increment();
 #endif
 }
 
@@ -444,6 +680,112 @@ fiber_switchContext(void **oldsp, void *newsp)
     if (!setjmp(**(jmp_buf**)oldsp))
          longjmp(*(jmp_buf*)newsp, 1);
 }
+#elif defined(ASM_FIBERS)
+// Pushes the callee-saved registers (and floating point control state) onto
+// the current stack, saves the stack pointer in *oldsp, and pops the same
+// from newsp.  Unlike swapcontext, there's no need to save the
+// caller-saved registers (the compiler already did), or to make a syscall to
+// save and restore the signal mask.  initStack() must lay out a new Fiber's
+// stack to match.
+extern "C" void mordor_fiber_switchContext(void **oldsp, void *newsp);
+
+#ifdef X86_64
+asm(
+    ".text\n"
+    ".p2align 4\n"
+    ".globl mordor_fiber_switchContext\n"
+    ".hidden mordor_fiber_switchContext\n"
+    ".type mordor_fiber_switchContext, @function\n"
+"mordor_fiber_switchContext:\n"
+    "pushq %rbp\n"
+    "pushq %rbx\n"
+    "pushq %r15\n"
+    "pushq %r14\n"
+    "pushq %r13\n"
+    "pushq %r12\n"
+    "subq $8, %rsp\n"
+    "stmxcsr (%rsp)\n"
+    "fnstcw 4(%rsp)\n"
+    "movq %rsp, (%rdi)\n"
+    "movq %rsi, %rsp\n"
+    "ldmxcsr (%rsp)\n"
+    "fldcw 4(%rsp)\n"
+    "addq $8, %rsp\n"
+    "popq %r12\n"
+    "popq %r13\n"
+    "popq %r14\n"
+    "popq %r15\n"
+    "popq %rbx\n"
+    "popq %rbp\n"
+    "ret\n"
+    ".size mordor_fiber_switchContext, .-mordor_fiber_switchContext\n"
+);
+#elif defined(ARM64)
+asm(
+    ".text\n"
+    ".p2align 4\n"
+    ".globl mordor_fiber_switchContext\n"
+    ".hidden mordor_fiber_switchContext\n"
+    ".type mordor_fiber_switchContext, %function\n"
+"mordor_fiber_switchContext:\n"
+    "sub sp, sp, #176\n"
+    "stp x19, x20, [sp, #0]\n"
+    "stp x21, x22, [sp, #16]\n"
+    "stp x23, x24, [sp, #32]\n"
+    "stp x25, x26, [sp, #48]\n"
+    "stp x27, x28, [sp, #64]\n"
+    "stp x29, x30, [sp, #80]\n"
+    "stp d8, d9, [sp, #96]\n"
+    "stp d10, d11, [sp, #112]\n"
+    "stp d12, d13, [sp, #128]\n"
+    "stp d14, d15, [sp, #144]\n"
+    "mrs x9, fpcr\n"
+    "str x9, [sp, #160]\n"
+    "mov x9, sp\n"
+    "str x9, [x0]\n"
+    "mov sp, x1\n"
+    "ldp x19, x20, [sp, #0]\n"
+    "ldp x21, x22, [sp, #16]\n"
+    "ldp x23, x24, [sp, #32]\n"
+    "ldp x25, x26, [sp, #48]\n"
+    "ldp x27, x28, [sp, #64]\n"
+    "ldp x29, x30, [sp, #80]\n"
+    "ldp d8, d9, [sp, #96]\n"
+    "ldp d10, d11, [sp, #112]\n"
+    "ldp d12, d13, [sp, #128]\n"
+    "ldp d14, d15, [sp, #144]\n"
+    "ldr x9, [sp, #160]\n"
+    "msr fpcr, x9\n"
+    "add sp, sp, #176\n"
+    "ret\n"
+    ".size mordor_fiber_switchContext, .-mordor_fiber_switchContext\n"
+);
+
+// The first switch to a new Fiber "returns" here, with the entry point in
+// x19.  Calling it with a NULL frame pointer and link register terminates
+// stack walks, and makes returning from it fault instead of re-entering it.
+extern "C" void mordor_fiber_start();
+asm(
+    ".text\n"
+    ".p2align 4\n"
+    ".globl mordor_fiber_start\n"
+    ".hidden mordor_fiber_start\n"
+    ".type mordor_fiber_start, %function\n"
+"mordor_fiber_start:\n"
+    "mov x29, xzr\n"
+    "mov x30, xzr\n"
+    "br x19\n"
+    ".size mordor_fiber_start, .-mordor_fiber_start\n"
+);
+#else
+#error Architecture not supported
+#endif
+
+static inline void
+fiber_switchContext(void **oldsp, void *newsp)
+{
+    mordor_fiber_switchContext(oldsp, newsp);
+}
 #endif
 
 
@@ -471,6 +813,26 @@ Fiber::initStack()
     m_ctx.uc_mcontext = (mcontext_t)m_mctx;
 #endif
     makecontext(&m_ctx, &Fiber::entryPoint, 0);
+#elif defined(ASM_FIBERS)
+    // Lay out the frame that fiber_switchContext will pop off
+    void **sp = (void **)((char *)m_stack + m_stacksize);
+#ifdef X86_64
+    // "Return" into entryPoint as if it had been called from a function with
+    // a NULL return address (which also terminates stack walks)
+    *--sp = NULL;                               // entryPoint's return address
+    *--sp = (void *)&Fiber::entryPoint;         // fiber_switchContext's
+    for (int i = 0; i < 6; ++i)
+        *--sp = NULL;                           // rbp, rbx, r15-r12
+    *--sp = (void *)0x0000037f00001f80ull;      // default x87 CW, MXCSR
+#elif defined(ARM64)
+    // "Return" into mordor_fiber_start, which clears the frame pointer and
+    // link register and branches to entryPoint
+    sp -= 22;
+    memset(sp, 0, 22 * sizeof(void *));         // x19-x29, d8-d15, FPCR
+    sp[0] = (void *)&Fiber::entryPoint;         // x19
+    sp[11] = (void *)&mordor_fiber_start;       // x30
+#endif
+    m_sp = sp;
 #elif defined(SETJMP_FIBERS)
     if (setjmp(m_env)) {
         Fiber::entryPoint();
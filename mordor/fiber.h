@@ -14,12 +14,17 @@
 #include "version.h"
 
 // Fiber impl selection
+// (define UCONTEXT_FIBERS to force the ucontext implementation, e.g. on
+// platforms that would otherwise use ASM_FIBERS)
 
-#ifdef X86_64
+#ifdef UCONTEXT_FIBERS
+#elif defined(X86_64)
 #   ifdef WINDOWS
 #       define NATIVE_WINDOWS_FIBERS
 #   elif defined(OSX)
 #       define SETJMP_FIBERS
+#   elif defined(LINUX)
+#       define ASM_FIBERS
 #   elif defined(POSIX)
 #       define UCONTEXT_FIBERS
 #   endif
@@ -35,6 +40,12 @@
 #   define UCONTEXT_FIBERS
 #elif defined(ARM)
 #   define UCONTEXT_FIBERS
+#elif defined(ARM64)
+#   ifdef LINUX
+#       define ASM_FIBERS
+#   else
+#       define UCONTEXT_FIBERS
+#   endif
 #else
 #   error Platform not supported
 #endif
@@ -56,6 +67,7 @@ namespace Mordor {
 class Fiber : public boost::enable_shared_from_this<Fiber>
 {
     template <class T> friend class FiberLocalStorageBase;
+    friend class Scheduler;
 public:
     typedef boost::shared_ptr<Fiber> ptr;
     typedef boost::weak_ptr<Fiber> weak_ptr;
@@ -151,6 +163,18 @@ public:
     /// The current execution state of the Fiber
     State state();
 
+    /// CPU time (in microseconds) this Fiber has used since it was created
+    /// or last reset()
+
+    /// Only measured while fiber.cputime is enabled; otherwise 0
+    unsigned long long cpuTime() const { return m_cpuTime; }
+
+    /// The priority a Scheduler runs this Fiber at (see Scheduler::Priority)
+
+    /// Defaults to 0 (Scheduler::NORMAL); it's kept across reset()
+    int priority() const { return m_priority; }
+    void priority(int priority) { m_priority = priority; }
+
     /// Get the backtrace of a fiber
 
     /// The fiber must not be currently executing.  If it's in a state other
@@ -184,6 +208,8 @@ private:
     int m_valgrindStackId;
 #endif
     State m_state, m_yielderNextState;
+    unsigned long long m_cpuTime, m_switchedIn;
+    int m_priority;
     ptr m_outer, m_yielder;
     weak_ptr m_terminateOuter;
     boost::exception_ptr m_exception;
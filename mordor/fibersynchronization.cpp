@@ -3,84 +3,244 @@
 #include "fibersynchronization.h"
 
 #include "assert.h"
+#include "atomic.h"
+#include "config.h"
 #include "fiber.h"
 #include "scheduler.h"
+#include "thread_local_storage.h"
 
 namespace Mordor {
 
+static ConfigVar<int>::ptr g_maxSpin = Config::lookup(
+    "fibermutex.maxspin", 100,
+    "Maximum number of times to spin on a contended FiberMutex before "
+    "yielding");
+
+static ConfigVar<size_t>::ptr g_starvationLimit = Config::lookup<size_t>(
+    "fibermutex.starvationlimit", 16u,
+    "Maximum number of higher priority fibers that can queue ahead of a "
+    "fiber waiting on a FiberMutex (or other fiber synchronization object)");
+
+// Cached so that recording which thread owns a FiberMutex doesn't cost a
+// syscall per lock
+static ThreadLocalStorage<intptr_t> t_tid;
+
+static inline tid_t currentThread()
+{
+    intptr_t tid = t_tid.get();
+    if (!tid)
+        t_tid = tid = (intptr_t)gettid();
+    return (tid_t)tid;
+}
+
+static inline void spinPause()
+{
+#ifdef MSVC
+    YieldProcessor();
+#elif defined(GCC) && (defined(X86_64) || defined(X86))
+    __asm__ __volatile__("pause");
+#elif defined(GCC) && defined(ARM64)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+FiberMutex::FiberMutex()
+    : m_state(UNLOCKED),
+      m_spin(0),
+      m_ownerThread(emptytid()),
+      m_head(NULL),
+      m_tail(NULL)
+#ifdef DEBUG
+      , m_owner(NULL)
+#endif
+{}
+
 FiberMutex::~FiberMutex()
 {
 #ifdef DEBUG
     boost::mutex::scoped_lock scopeLock(m_mutex);
+    MORDOR_ASSERT(m_state == UNLOCKED);
     MORDOR_ASSERT(!m_owner);
-    MORDOR_ASSERT(m_waiters.empty());
+    MORDOR_ASSERT(!m_head);
 #endif
 }
 
+void
+FiberMutex::queue(Waiter *&head, Waiter *&tail, Waiter &waiter)
+{
+    int priority = waiter.fiber->priority();
+    waiter.bypassed = 0;
+    waiter.next = NULL;
+    if (!tail || tail->fiber->priority() <= priority) {
+        // Usual case; nobody to cut in front of
+        if (tail)
+            tail->next = &waiter;
+        else
+            head = &waiter;
+        tail = &waiter;
+        return;
+    }
+    size_t limit = g_starvationLimit->val();
+    Waiter *prev = NULL;
+    for (Waiter *other = head; other; other = other->next)
+        if (other->fiber->priority() <= priority || other->bypassed >= limit)
+            prev = other;
+    if (prev) {
+        waiter.next = prev->next;
+        prev->next = &waiter;
+    } else {
+        waiter.next = head;
+        head = &waiter;
+    }
+    if (!waiter.next)
+        tail = &waiter;
+    for (Waiter *other = waiter.next; other; other = other->next)
+        ++other->bypassed;
+}
+
+void
+FiberMutex::wake(Waiter *waiter)
+{
+    while (waiter) {
+        // waiter is gone as soon as its Fiber runs
+        Waiter *next = waiter->next;
+        Scheduler *scheduler = waiter->scheduler;
+        Fiber::ptr fiber;
+        fiber.swap(waiter->fiber);
+        scheduler->schedule(fiber);
+        waiter = next;
+    }
+}
+
+bool
+FiberMutex::tryLock()
+{
+    if (m_state == UNLOCKED && atomicCompareAndSwap(m_state,
+        (unsigned int)LOCKED, (unsigned int)UNLOCKED) == UNLOCKED) {
+        m_ownerThread = currentThread();
+        return true;
+    }
+    return false;
+}
+
 void
 FiberMutex::lock()
 {
     MORDOR_ASSERT(Scheduler::getThis());
-    {
-        boost::mutex::scoped_lock scopeLock(m_mutex);
-        MORDOR_ASSERT(m_owner != Fiber::getThis());
-        MORDOR_ASSERT(std::find(m_waiters.begin(), m_waiters.end(),
-            std::make_pair(Scheduler::getThis(), Fiber::getThis()))
-            == m_waiters.end());
-        if (!m_owner) {
-            m_owner = Fiber::getThis();
+    MORDOR_ASSERT(m_owner != Fiber::getThis().get());
+    if (!tryLock()) {
+        // Spin a little in case the owner is about to release it from
+        // another thread; aim for about as long as it took last time.  If
+        // the owner can only be running on this thread, it can't release it
+        // until we yield, so don't bother
+        int maxSpin = 0;
+        if (Scheduler::getThis()->threadCount() > 1 &&
+            m_ownerThread != currentThread())
+            maxSpin = std::min(g_maxSpin->val(), m_spin * 2 + 10);
+        int spin = 0;
+        for (; spin < maxSpin; ++spin) {
+            spinPause();
+            if (tryLock())
+                break;
+        }
+        if (spin < maxSpin) {
+            m_spin += (spin - m_spin) / 8;
+        } else {
+            // It didn't pay off
+            if (maxSpin)
+                m_spin -= m_spin / 8;
+            Waiter waiter;
+            waiter.scheduler = Scheduler::getThis();
+            waiter.fiber = Fiber::getThis();
+            {
+                boost::mutex::scoped_lock scopeLock(m_mutex);
+                if (lockOrQueue(waiter)) {
+                    m_ownerThread = currentThread();
+                    return;
+                }
+            }
+            // unlock() hands us the mutex before rescheduling us
+            Scheduler::yieldTo();
+            MORDOR_ASSERT(m_owner == Fiber::getThis().get());
+            m_ownerThread = currentThread();
             return;
         }
-        m_waiters.push_back(std::make_pair(Scheduler::getThis(),
-            Fiber::getThis()));
     }
-    Scheduler::yieldTo();
 #ifdef DEBUG
-    boost::mutex::scoped_lock scopeLock(m_mutex);
-    MORDOR_ASSERT(m_owner == Fiber::getThis());
-    MORDOR_ASSERT(std::find(m_waiters.begin(), m_waiters.end(),
-            std::make_pair(Scheduler::getThis(), Fiber::getThis()))
-            == m_waiters.end());
+    m_owner = Fiber::getThis().get();
 #endif
 }
 
+bool
+FiberMutex::lockOrQueue(Waiter &waiter)
+{
+    while (true) {
+        unsigned int state = m_state;
+        if (state == UNLOCKED) {
+            if (atomicCompareAndSwap(m_state, (unsigned int)LOCKED,
+                (unsigned int)UNLOCKED) == UNLOCKED) {
+#ifdef DEBUG
+                m_owner = waiter.fiber.get();
+#endif
+                return true;
+            }
+        } else if (state == CONTENDED ||
+            atomicCompareAndSwap(m_state, (unsigned int)CONTENDED,
+                (unsigned int)LOCKED) == LOCKED) {
+            // Only unlock() (with m_mutex held) takes it out of CONTENDED
+            break;
+        }
+    }
+    queue(m_head, m_tail, waiter);
+    return false;
+}
+
 void
 FiberMutex::unlock()
 {
-    boost::mutex::scoped_lock lock(m_mutex);
-    unlockNoLock();
+    MORDOR_ASSERT(m_owner == Fiber::getThis().get());
+#ifdef DEBUG
+    m_owner = NULL;
+#endif
+    if (atomicCompareAndSwap(m_state, (unsigned int)UNLOCKED,
+        (unsigned int)LOCKED) == LOCKED)
+        return;
+    Waiter *next;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        MORDOR_ASSERT(m_state == CONTENDED);
+        next = m_head;
+        MORDOR_ASSERT(next);
+        m_head = next->next;
+        next->next = NULL;
+        // Hand it directly to the next waiter
+        if (!m_head) {
+            m_tail = NULL;
+            atomicSwap(m_state, (unsigned int)LOCKED);
+        }
+#ifdef DEBUG
+        m_owner = next->fiber.get();
+#endif
+    }
+    wake(next);
 }
 
 bool
 FiberMutex::unlockIfNotUnique()
 {
-    boost::mutex::scoped_lock lock(m_mutex);
-    MORDOR_ASSERT(m_owner == Fiber::getThis());
-    if (!m_waiters.empty()) {
-        unlockNoLock();
+    MORDOR_ASSERT(m_owner == Fiber::getThis().get());
+    if (m_state == CONTENDED) {
+        unlock();
         return true;
     }
     return false;
 }
 
-void
-FiberMutex::unlockNoLock()
-{
-    MORDOR_ASSERT(m_owner == Fiber::getThis());
-    m_owner.reset();
-    if (!m_waiters.empty()) {
-        std::pair<Scheduler *, Fiber::ptr> next = m_waiters.front();
-        m_waiters.pop_front();
-        m_owner = next.second;
-        next.first->schedule(next.second);
-    }
-}
-
 FiberCondition::~FiberCondition()
 {
 #ifdef DEBUG
     boost::mutex::scoped_lock lock(m_mutex);
-    MORDOR_ASSERT(m_waiters.empty());
+    MORDOR_ASSERT(!m_head);
 #endif
 }
 
@@ -88,70 +248,61 @@ void
 FiberCondition::wait()
 {
     MORDOR_ASSERT(Scheduler::getThis());
+    FiberMutex::Waiter waiter;
+    waiter.scheduler = Scheduler::getThis();
+    waiter.fiber = Fiber::getThis();
+    waiter.next = NULL;
     {
         boost::mutex::scoped_lock lock(m_mutex);
-        boost::mutex::scoped_lock lock2(m_fiberMutex.m_mutex);
-        MORDOR_ASSERT(m_fiberMutex.m_owner == Fiber::getThis());
-        m_waiters.push_back(std::make_pair(Scheduler::getThis(),
-            Fiber::getThis()));
-        m_fiberMutex.unlockNoLock();
+        MORDOR_ASSERT(m_fiberMutex.m_owner == Fiber::getThis().get());
+        FiberMutex::queue(m_head, m_tail, waiter);
+        m_fiberMutex.unlock();
     }
     Scheduler::yieldTo();
-#ifdef DEBUG
-    boost::mutex::scoped_lock lock2(m_fiberMutex.m_mutex);
-    MORDOR_ASSERT(m_fiberMutex.m_owner == Fiber::getThis());
-#endif
+    MORDOR_ASSERT(m_fiberMutex.m_owner == Fiber::getThis().get());
 }
 
 void
 FiberCondition::signal()
 {
-    std::pair<Scheduler *, Fiber::ptr> next;
+    FiberMutex::Waiter *next;
     {
         boost::mutex::scoped_lock lock(m_mutex);
-        if (m_waiters.empty())
+        next = m_head;
+        if (!next)
             return;
-        next = m_waiters.front();
-        m_waiters.pop_front();
+        m_head = next->next;
+        if (!m_head)
+            m_tail = NULL;
     }
-    boost::mutex::scoped_lock lock2(m_fiberMutex.m_mutex);
-    MORDOR_ASSERT(m_fiberMutex.m_owner != next.second);
-    MORDOR_ASSERT(std::find(m_fiberMutex.m_waiters.begin(),
-        m_fiberMutex.m_waiters.end(), next)
-        == m_fiberMutex.m_waiters.end());
-    if (!m_fiberMutex.m_owner) {
-        m_fiberMutex.m_owner = next.second;
-        next.first->schedule(next.second);
-    } else {
-        m_fiberMutex.m_waiters.push_back(next);
+    {
+        boost::mutex::scoped_lock lock2(m_fiberMutex.m_mutex);
+        MORDOR_ASSERT(m_fiberMutex.m_owner != next->fiber.get());
+        if (!m_fiberMutex.lockOrQueue(*next))
+            return;
+        next->next = NULL;
     }
+    FiberMutex::wake(next);
 }
 
 void
 FiberCondition::broadcast()
 {
     boost::mutex::scoped_lock lock(m_mutex);
-    if (m_waiters.empty())
+    if (!m_head)
         return;
     boost::mutex::scoped_lock lock2(m_fiberMutex.m_mutex);
 
-    std::list<std::pair<Scheduler *, Fiber::ptr> >::iterator it;
-    for (it = m_waiters.begin();
-        it != m_waiters.end();
-        ++it) {
-        std::pair<Scheduler *, Fiber::ptr> &next = *it;
-        MORDOR_ASSERT(m_fiberMutex.m_owner != next.second);
-        MORDOR_ASSERT(std::find(m_fiberMutex.m_waiters.begin(),
-            m_fiberMutex.m_waiters.end(), next)
-            == m_fiberMutex.m_waiters.end());
-        if (!m_fiberMutex.m_owner) {
-            m_fiberMutex.m_owner = next.second;
-            next.first->schedule(next.second);
-        } else {
-            m_fiberMutex.m_waiters.push_back(next);
+    while (m_head) {
+        FiberMutex::Waiter *next = m_head;
+        m_head = next->next;
+        MORDOR_ASSERT(m_fiberMutex.m_owner != next->fiber.get());
+        if (m_fiberMutex.lockOrQueue(*next)) {
+            next->next = NULL;
+            FiberMutex::wake(next);
         }
     }
-    m_waiters.clear();
+    m_tail = NULL;
 }
 
 
@@ -210,4 +361,150 @@ FiberEvent::reset()
     m_signalled = false;
 }
 
+FiberRWMutex::~FiberRWMutex()
+{
+#ifdef DEBUG
+    boost::mutex::scoped_lock lock(m_mutex);
+    MORDOR_ASSERT(!m_writer);
+    MORDOR_ASSERT(m_readers == 0);
+    MORDOR_ASSERT(!m_readersHead);
+    MORDOR_ASSERT(!m_writersHead);
+#endif
+}
+
+void
+FiberRWMutex::lock()
+{
+    MORDOR_ASSERT(Scheduler::getThis());
+    FiberMutex::Waiter waiter;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (!m_writer && m_readers == 0) {
+            m_writer = true;
+            return;
+        }
+        waiter.scheduler = Scheduler::getThis();
+        waiter.fiber = Fiber::getThis();
+        FiberMutex::queue(m_writersHead, m_writersTail, waiter);
+    }
+    // Whoever releases us marks us as the writer first
+    Scheduler::yieldTo();
+}
+
+void
+FiberRWMutex::unlock()
+{
+    FiberMutex::Waiter *next;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        MORDOR_ASSERT(m_writer);
+        MORDOR_ASSERT(m_readers == 0);
+        if (m_readersHead) {
+            // Release every waiting reader in one batch
+            next = m_readersHead;
+            m_readersHead = m_readersTail = NULL;
+            for (FiberMutex::Waiter *reader = next; reader;
+                reader = reader->next)
+                ++m_readers;
+            m_writer = false;
+        } else if (m_writersHead) {
+            next = m_writersHead;
+            m_writersHead = next->next;
+            if (!m_writersHead)
+                m_writersTail = NULL;
+            next->next = NULL;
+        } else {
+            m_writer = false;
+            return;
+        }
+    }
+    FiberMutex::wake(next);
+}
+
+void
+FiberRWMutex::lockShared()
+{
+    MORDOR_ASSERT(Scheduler::getThis());
+    FiberMutex::Waiter waiter;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        // Don't cut in front of a waiting writer
+        if (!m_writer && !m_writersHead) {
+            ++m_readers;
+            return;
+        }
+        waiter.scheduler = Scheduler::getThis();
+        waiter.fiber = Fiber::getThis();
+        FiberMutex::queue(m_readersHead, m_readersTail, waiter);
+    }
+    Scheduler::yieldTo();
+}
+
+void
+FiberRWMutex::unlockShared()
+{
+    FiberMutex::Waiter *next;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        MORDOR_ASSERT(!m_writer);
+        MORDOR_ASSERT(m_readers > 0);
+        if (--m_readers != 0 || !m_writersHead)
+            return;
+        next = m_writersHead;
+        m_writersHead = next->next;
+        if (!m_writersHead)
+            m_writersTail = NULL;
+        next->next = NULL;
+        m_writer = true;
+    }
+    FiberMutex::wake(next);
+}
+
+
+FiberSemaphore::~FiberSemaphore()
+{
+#ifdef DEBUG
+    boost::mutex::scoped_lock lock(m_mutex);
+    MORDOR_ASSERT(!m_head);
+#endif
+}
+
+void
+FiberSemaphore::wait()
+{
+    MORDOR_ASSERT(Scheduler::getThis());
+    FiberMutex::Waiter waiter;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (m_count > 0) {
+            --m_count;
+            return;
+        }
+        waiter.scheduler = Scheduler::getThis();
+        waiter.fiber = Fiber::getThis();
+        FiberMutex::queue(m_head, m_tail, waiter);
+    }
+    // notify() hands its count directly to us
+    Scheduler::yieldTo();
+}
+
+void
+FiberSemaphore::notify()
+{
+    FiberMutex::Waiter *next;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        next = m_head;
+        if (!next) {
+            ++m_count;
+            return;
+        }
+        m_head = next->next;
+        if (!m_head)
+            m_tail = NULL;
+        next->next = NULL;
+    }
+    FiberMutex::wake(next);
+}
+
 }
@@ -8,6 +8,8 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
 
+#include "thread.h"
+
 namespace Mordor {
 
 class Fiber;
@@ -17,11 +19,24 @@ class Scheduler;
 
 /// Mutex for use by Fibers that yields to a Scheduler instead of blocking
 /// if the mutex cannot be immediately acquired.  It also provides the
-/// additional guarantee that it is strictly FIFO, instead of random which
-/// Fiber will acquire the mutex next after it is released.
+/// additional guarantee that it is FIFO within a priority (see
+/// Fiber::priority()), instead of random which Fiber will acquire the mutex
+/// next after it is released.  Higher priority Fibers queue ahead of lower
+/// priority ones, but no Fiber is passed over more than
+/// fibermutex.starvationlimit times.  The other Fiber synchronization
+/// primitives queue their waiters the same way.
+///
+/// Acquiring and releasing an uncontended FiberMutex is a single atomic
+/// operation each.  When it is contended, lock() spins briefly (adapting to
+/// how long the mutex is typically held, up to fibermutex.maxspin) in case
+/// the owner is about to release it from another thread, before queueing
+/// the Fiber and yielding.  Once there are Fibers queued, the mutex is handed
+/// directly to the first of them when it is released.
 struct FiberMutex : boost::noncopyable
 {
     friend struct FiberCondition;
+    friend struct FiberRWMutex;
+    friend struct FiberSemaphore;
 public:
     /// Type that will lock the mutex on construction, and unlock on
     /// destruction
@@ -72,6 +87,7 @@ public:
     };
 
 public:
+    FiberMutex();
     ~FiberMutex();
 
     /// @brief Locks the mutex
@@ -92,12 +108,49 @@ public:
     bool unlockIfNotUnique();
 
 private:
-    void unlockNoLock();
+    /// A Fiber waiting for the mutex (or a FiberCondition); it lives on the
+    /// waiting Fiber's stack, since the Fiber isn't going anywhere until it
+    /// is removed from the queue
+    struct Waiter
+    {
+        Scheduler *scheduler;
+        boost::shared_ptr<Fiber> fiber;
+        /// How many times another Waiter has been queued ahead of this one
+        size_t bypassed;
+        Waiter *next;
+    };
+
+    enum State {
+        UNLOCKED,
+        LOCKED,
+        /// Locked, and unlock() has to look at m_waiters
+        CONTENDED
+    };
+
+    /// Queue waiter behind every Waiter of the same or higher priority (or
+    /// that has been passed over too many times already)
+    static void queue(Waiter *&head, Waiter *&tail, Waiter &waiter);
+    /// Schedule waiter, and every Waiter linked after it
+    static void wake(Waiter *waiter);
+
+    bool tryLock();
+    /// Acquire the mutex on behalf of waiter, or queue it if it's owned
+    /// @pre m_mutex is locked
+    /// @return If it was acquired (otherwise it is queued)
+    bool lockOrQueue(Waiter &waiter);
 
 private:
+    volatile unsigned int m_state;
+    /// Running estimate of how long it's worth spinning in lock()
+    int m_spin;
+    /// Thread the current owner acquired the mutex on (lock() doesn't spin
+    /// when it's this one)
+    volatile tid_t m_ownerThread;
     boost::mutex m_mutex;
-    boost::shared_ptr<Fiber> m_owner;
-    std::list<std::pair<Scheduler *, boost::shared_ptr<Fiber> > > m_waiters;
+    Waiter *m_head, *m_tail;
+#ifdef DEBUG
+    Fiber *m_owner;
+#endif
 };
 
 /// Scheduler based condition variable for Fibers
@@ -111,7 +164,9 @@ struct FiberCondition : boost::noncopyable
 public:
     /// @param mutex The mutex to associate with the Condition
     FiberCondition(FiberMutex &mutex)
-        : m_fiberMutex(mutex)
+        : m_fiberMutex(mutex),
+          m_head(NULL),
+          m_tail(NULL)
     {}
     ~FiberCondition();
 
@@ -131,7 +186,7 @@ public:
 private:
     boost::mutex m_mutex;
     FiberMutex &m_fiberMutex;
-    std::list<std::pair<Scheduler *, boost::shared_ptr<Fiber> > > m_waiters;
+    FiberMutex::Waiter *m_head, *m_tail;
 };
 
 /// Scheduler based event variable for Fibers
@@ -165,6 +220,146 @@ private:
     std::list<std::pair<Scheduler *, boost::shared_ptr<Fiber> > > m_waiters;
 };
 
+/// Scheduler based reader-writer lock for Fibers
+
+/// Any number of Fibers can hold a FiberRWMutex shared, or a single Fiber
+/// can hold it exclusively; Fibers that can't acquire it immediately yield to
+/// their Scheduler.  Writers are preferred: once a writer is waiting, new
+/// readers queue behind it.  When a writer releases the mutex, all of the
+/// queued readers are released together (even if there are more writers
+/// waiting), so neither side can starve the other.
+struct FiberRWMutex : boost::noncopyable
+{
+public:
+    /// Type that will lock the mutex exclusively on construction, and unlock
+    /// on destruction
+    struct ScopedLock
+    {
+    public:
+        ScopedLock(FiberRWMutex &mutex)
+            : m_mutex(mutex)
+        {
+            m_mutex.lock();
+            m_locked = true;
+        }
+        ~ScopedLock()
+        { unlock(); }
+
+        void lock()
+        {
+            if (!m_locked) {
+                m_mutex.lock();
+                m_locked = true;
+            }
+        }
+
+        void unlock()
+        {
+            if (m_locked) {
+                m_mutex.unlock();
+                m_locked = false;
+            }
+        }
+
+    private:
+        FiberRWMutex &m_mutex;
+        bool m_locked;
+    };
+
+    /// Type that will lock the mutex shared on construction, and unlock on
+    /// destruction
+    struct SharedScopedLock
+    {
+    public:
+        SharedScopedLock(FiberRWMutex &mutex)
+            : m_mutex(mutex)
+        {
+            m_mutex.lockShared();
+            m_locked = true;
+        }
+        ~SharedScopedLock()
+        { unlock(); }
+
+        void lock()
+        {
+            if (!m_locked) {
+                m_mutex.lockShared();
+                m_locked = true;
+            }
+        }
+
+        void unlock()
+        {
+            if (m_locked) {
+                m_mutex.unlockShared();
+                m_locked = false;
+            }
+        }
+
+    private:
+        FiberRWMutex &m_mutex;
+        bool m_locked;
+    };
+
+public:
+    FiberRWMutex()
+        : m_readers(0),
+          m_writer(false),
+          m_readersHead(NULL),
+          m_readersTail(NULL),
+          m_writersHead(NULL),
+          m_writersTail(NULL)
+    {}
+    ~FiberRWMutex();
+
+    /// @brief Locks the mutex exclusively
+    /// @pre Scheduler::getThis() != NULL
+    /// @pre Fiber::getThis() does not hold this mutex
+    void lock();
+    /// @pre Fiber::getThis() holds this mutex exclusively
+    void unlock();
+
+    /// @brief Locks the mutex shared
+    /// @pre Scheduler::getThis() != NULL
+    /// @pre Fiber::getThis() does not hold this mutex
+    void lockShared();
+    /// @pre Fiber::getThis() holds this mutex shared
+    void unlockShared();
+
+private:
+    boost::mutex m_mutex;
+    size_t m_readers;
+    bool m_writer;
+    FiberMutex::Waiter *m_readersHead, *m_readersTail;
+    FiberMutex::Waiter *m_writersHead, *m_writersTail;
+};
+
+/// Scheduler based counting semaphore for Fibers
+
+/// Unlike Semaphore, a Fiber that has to wait yields to its Scheduler instead
+/// of blocking the thread.  Waiters are released FIFO within a priority.
+struct FiberSemaphore : boost::noncopyable
+{
+public:
+    FiberSemaphore(size_t count = 0)
+        : m_count(count),
+          m_head(NULL),
+          m_tail(NULL)
+    {}
+    ~FiberSemaphore();
+
+    /// @brief Wait for the count to be positive, and decrement it
+    /// @pre Scheduler::getThis() != NULL
+    void wait();
+    /// Increment the count (or release a waiting Fiber)
+    void notify();
+
+private:
+    boost::mutex m_mutex;
+    size_t m_count;
+    FiberMutex::Waiter *m_head, *m_tail;
+};
+
 }
 
 #endif
@@ -5,6 +5,7 @@
 #include "auth.h"
 #include "client.h"
 #include "mordor/atomic.h"
+#include "mordor/deadline.h"
 #include "mordor/fiber.h"
 #include "mordor/future.h"
 #include "mordor/iomanager.h"
@@ -735,6 +736,9 @@ RetryRequestBroker::request(Request &requestHeaders, bool forceNewConnection,
             const ExceptionSource *source = boost::get_error_info<errinfo_source>(ex);
             if (!source || (*source != HTTP && *source != CONNECTION))
                 throw;
+            // Don't keep retrying (or wait to retry) past the Deadline
+            if (Deadline::timeLeft() == 0)
+                throw;
             if (m_delayDg && !m_delayDg(atomicIncrement(*retries)))
                 throw;
             continue;
@@ -742,6 +746,8 @@ RetryRequestBroker::request(Request &requestHeaders, bool forceNewConnection,
             const ExceptionSource *source = boost::get_error_info<errinfo_source>(ex);
             if (!source || *source != HTTP)
                 throw;
+            if (Deadline::timeLeft() == 0)
+                throw;
             if (m_delayDg && !m_delayDg(*retries + 1))
                 throw;
             continue;
@@ -749,6 +755,8 @@ RetryRequestBroker::request(Request &requestHeaders, bool forceNewConnection,
             const ExceptionSource *source = boost::get_error_info<errinfo_source>(ex);
             if (!source || *source != HTTP)
                 throw;
+            if (Deadline::timeLeft() == 0)
+                throw;
             if (m_delayDg && !m_delayDg(atomicIncrement(*retries)))
                 throw;
             continue;
@@ -8,6 +8,7 @@
 
 #include "chunked.h"
 #include "mordor/assert.h"
+#include "mordor/deadline.h"
 #include "mordor/fiber.h"
 #include "mordor/log.h"
 #include "mordor/scheduler.h"
@@ -73,6 +74,9 @@ ClientConnection::~ClientConnection()
 ClientRequest::ptr
 ClientConnection::request(const Request &requestHeaders)
 {
+    // Don't even queue up if there's no time left; I/O on the connection
+    // honors the Deadline from here on
+    Deadline::throwIfReached();
     ClientRequest::ptr request(new ClientRequest(shared_from_this(), requestHeaders));
     request->waitForRequest();
     return request;
@@ -6,13 +6,68 @@
 
 #include "iomanager_epoll.h"
 
+#ifdef IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
 #include "assert.h"
+#include "config.h"
 #include "fiber.h"
+#include "statistics.h"
 
 namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:iomanager");
 
+static CountStatistic<unsigned long long> &g_statFdEvents =
+    Statistics::registerStatistic("iomanager.fdevents",
+    CountStatistic<unsigned long long>("events"),
+    "Readiness events epoll_wait returned for fds (not counting tickles or "
+    "io_uring completions)");
+
+#ifdef IO_URING
+static ConfigVar<bool>::ptr g_ioUring = Config::lookup(
+    "iomanager.iouring", true,
+    "Perform socket and stream I/O with io_uring if the kernel supports it");
+static ConfigVar<unsigned int>::ptr g_ioUringEntries =
+    Config::lookup("iomanager.iouringentries", 256u,
+    "Size of each IOManager's io_uring submission queue");
+
+struct IOManager::IoOperation
+{
+    AsyncState *state;
+    Event event;
+    Scheduler *scheduler;
+    Fiber::ptr fiber;
+    int result;
+    /// How many CQEs are still expected (the operation's, and its linked
+    /// timeout's)
+    int outstanding;
+    bool timedOut;
+    /// The fiber is (about to be) suspended, and needs to be scheduled
+    bool waiting;
+};
+
+struct IOManager::Ring
+{
+    int fd;
+    void *ring;
+    size_t ringSize;
+    unsigned int *sqHead, *sqTail, *sqArray;
+    unsigned int sqMask, sqEntries;
+    io_uring_sqe *sqes;
+    unsigned int *cqHead, *cqTail;
+    unsigned int cqMask;
+    io_uring_cqe *cqes;
+    boost::mutex sqMutex, cqMutex;
+};
+
+// Low bit of user_data distinguishes a linked timeout from its operation;
+// 0 is for fire-and-forget cancellations
+static const unsigned long long TIMEOUT_TAG = 1;
+#endif
+
 enum epoll_ctl_op_t
 {
     epoll_ctl_op_t_dummy = 0x7ffffff
@@ -85,8 +140,46 @@ static std::ostream &operator <<(std::ostream &os, EPOLL_EVENTS events)
     return os;
 }
 
-IOManager::IOManager(size_t threads, bool useCaller)
-    : Scheduler(threads, useCaller)
+IOManager::AsyncState::AsyncState(int fd)
+    : m_fd(fd),
+      m_events(0),
+      m_registered(false),
+      m_edgeTriggered(false),
+      m_ready(0)
+{}
+
+IOManager::AsyncState::EventContext &
+IOManager::AsyncState::contextForEvent(Event event)
+{
+    switch (event) {
+        case READ:
+            return m_in;
+        case WRITE:
+            return m_out;
+        case CLOSE:
+            return m_close;
+        default:
+            MORDOR_NOTREACHED();
+    }
+}
+
+void
+IOManager::AsyncState::triggerEvent(Event event)
+{
+    MORDOR_ASSERT(m_events & event);
+    m_events &= ~event;
+    EventContext &context = contextForEvent(event);
+    if (context.dg)
+        context.scheduler->schedule(context.dg);
+    else
+        context.scheduler->schedule(context.fiber);
+    context.scheduler = NULL;
+    context.dg = NULL;
+    context.fiber.reset();
+}
+
+IOManager::IOManager(size_t threads, bool useCaller, size_t firstThread)
+    : Scheduler(threads, useCaller, 1, firstThread)
 {
     m_epfd = epoll_create(5000);
     MORDOR_LOG_LEVEL(g_log, m_epfd <= 0 ? Log::ERROR : Log::TRACE) << this
@@ -105,7 +198,8 @@ IOManager::IOManager(size_t threads, bool useCaller)
     epoll_event event;
     memset(&event, 0, sizeof(epoll_event));
     event.events = EPOLLIN | EPOLLET;
-    event.data.fd = m_tickleFds[0];
+    // Every other fd has its AsyncState here
+    event.data.ptr = this;
     rc = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
     MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
         << " epoll_ctl(" << m_epfd << ", EPOLL_CTL_ADD, " << m_tickleFds[0]
@@ -116,6 +210,11 @@ IOManager::IOManager(size_t threads, bool useCaller)
         close(m_epfd);
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
     }
+#ifdef IO_URING
+    m_ring = NULL;
+    if (g_ioUring->val() && !setupRing())
+        MORDOR_LOG_INFO(g_log) << this << " io_uring unavailable; using epoll";
+#endif
     try {
         start();
     } catch (...) {
@@ -134,6 +233,17 @@ IOManager::~IOManager()
     close(m_tickleFds[0]);
     MORDOR_LOG_VERBOSE(g_log) << this << " close(" << m_tickleFds[0] << ")";
     close(m_tickleFds[1]);
+#ifdef IO_URING
+    if (m_ring) {
+        munmap(m_ring->sqes, m_ring->sqEntries * sizeof(io_uring_sqe));
+        munmap(m_ring->ring, m_ring->ringSize);
+        close(m_ring->fd);
+        MORDOR_LOG_VERBOSE(g_log) << this << " close(" << m_ring->fd << ")";
+        delete m_ring;
+    }
+#endif
+    for (size_t i = 0; i < m_pendingEvents.size(); ++i)
+        delete m_pendingEvents[i];
 }
 
 bool
@@ -143,6 +253,55 @@ IOManager::stopping()
     return stopping(timeout);
 }
 
+IOManager::AsyncState *
+IOManager::asyncState(int fd, bool create)
+{
+    {
+        boost::shared_lock<boost::shared_mutex> lock(m_mutex);
+        if ((size_t)fd < m_pendingEvents.size() && m_pendingEvents[fd])
+            return m_pendingEvents[fd];
+        if (!create)
+            return NULL;
+    }
+    boost::unique_lock<boost::shared_mutex> lock(m_mutex);
+    if ((size_t)fd >= m_pendingEvents.size())
+        m_pendingEvents.resize(std::max<size_t>(fd + 1,
+            m_pendingEvents.size() * 3 / 2), NULL);
+    AsyncState *&state = m_pendingEvents[fd];
+    if (!state)
+        state = new AsyncState(fd);
+    return state;
+}
+
+void
+IOManager::updateEpoll(AsyncState &state, uint32_t events)
+{
+    int op;
+    if (events == 0) {
+        if (!state.m_registered)
+            return;
+        op = EPOLL_CTL_DEL;
+    } else {
+        op = state.m_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    }
+    epoll_event event;
+    memset(&event, 0, sizeof(epoll_event));
+    event.events = events | EPOLLET;
+    event.data.ptr = &state;
+    int rc = epoll_ctl(m_epfd, op, state.m_fd, &event);
+    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
+        << state.m_fd << ", " << (EPOLL_EVENTS)event.events << "): " << rc
+        << " (" << errno << ")";
+    // Even if DEL failed, the fd is gone from the set (it was probably
+    // closed already)
+    if (op == EPOLL_CTL_DEL)
+        state.m_registered = false;
+    if (rc)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    state.m_registered = events != 0;
+}
+
 void
 IOManager::registerEvent(int fd, Event events, boost::function<void ()> dg)
 {
@@ -150,161 +309,453 @@ IOManager::registerEvent(int fd, Event events, boost::function<void ()> dg)
     MORDOR_ASSERT(Scheduler::getThis());
     MORDOR_ASSERT(Fiber::getThis());
 
-    int epollevents = ((int)events & (EPOLLIN | EPOLLOUT | EPOLLRDHUP)) | EPOLLET;
-    MORDOR_ASSERT(epollevents != 0);
-    boost::mutex::scoped_lock lock(m_mutex);
-    int op;
-    std::map<int, AsyncEvent>::iterator it = m_pendingEvents.find(fd);
-    AsyncEvent *event;
-    if (it == m_pendingEvents.end()) {
-        op = EPOLL_CTL_ADD;
-        event = &m_pendingEvents[fd];
-        event->event.data.fd = fd;
-        event->event.events = epollevents;
-    } else {
-        op = EPOLL_CTL_MOD;
-        event = &it->second;
-        // OR == XOR means that none of the same bits were set
-        MORDOR_ASSERT((event->event.events | (epollevents & ~EPOLLET))
-            == (event->event.events ^ (epollevents & ~EPOLLET)));
-        event->event.events |= epollevents;
-    }
-    if (epollevents & EPOLLIN) {
-        event->m_schedulerIn = Scheduler::getThis();
-        if (dg) {
-            event->m_dgIn = dg;
-            event->m_fiberIn.reset();
-        } else {
-            event->m_dgIn = NULL;
-            event->m_fiberIn = Fiber::getThis();
+    events = (Event)(events & (READ | WRITE | CLOSE));
+    MORDOR_ASSERT(events != 0);
+    AsyncState &state = *asyncState(fd, true);
+    boost::mutex::scoped_lock lock(state.m_mutex);
+    MORDOR_ASSERT(!(state.m_events & events));
+#ifdef IO_URING
+    MORDOR_ASSERT(!(events & READ) || !state.m_in.io);
+    MORDOR_ASSERT(!(events & WRITE) || !state.m_out.io);
+#endif
+    if (state.m_edgeTriggered) {
+        MORDOR_ASSERT(events == READ || events == WRITE || events == CLOSE);
+        if (state.m_ready & events) {
+            // Already happened; don't wait for it
+            state.m_ready &= ~events;
+            if (dg)
+                Scheduler::getThis()->schedule(dg);
+            else
+                Scheduler::getThis()->schedule(Fiber::getThis());
+            return;
         }
     }
-    if (epollevents & EPOLLOUT) {
-        event->m_schedulerOut = Scheduler::getThis();
-        if (dg) {
-            event->m_dgOut = dg;
-            event->m_fiberOut.reset();
-        } else {
-            event->m_dgOut = NULL;
-            event->m_fiberOut = Fiber::getThis();
-        }
+    static const Event all[] = { READ, WRITE, CLOSE };
+    size_t count = 0;
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); ++i) {
+        if (!(events & all[i]))
+            continue;
+        AsyncState::EventContext &context = state.contextForEvent(all[i]);
+        context.scheduler = Scheduler::getThis();
+        if (dg)
+            context.dg = dg;
+        else
+            context.fiber = Fiber::getThis();
+        ++count;
     }
-    if (epollevents & EPOLLRDHUP) {
-        event->m_schedulerClose = Scheduler::getThis();
-        if (dg) {
-            event->m_dgClose = dg;
-            event->m_fiberClose.reset();
-        } else {
-            event->m_dgClose = NULL;
-            event->m_fiberClose = Fiber::getThis();
+    state.m_events |= events;
+    m_pendingEventCount += count;
+    if (state.m_edgeTriggered && state.m_registered)
+        return;
+    try {
+        updateEpoll(state, state.m_edgeTriggered ?
+            (uint32_t)(READ | WRITE | CLOSE) : state.m_events);
+    } catch (...) {
+        for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); ++i) {
+            if (!(events & all[i]))
+                continue;
+            AsyncState::EventContext &context = state.contextForEvent(all[i]);
+            context.scheduler = NULL;
+            context.dg = NULL;
+            context.fiber.reset();
         }
+        state.m_events &= ~events;
+        m_pendingEventCount -= count;
+        throw;
     }
-    int rc = epoll_ctl(m_epfd, op, event->event.data.fd, &event->event);
-    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
-        << event->event.data.fd << ", " << (EPOLL_EVENTS)event->event.events << "): " << rc
-        << " (" << errno << ")";
-    if (rc)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
 }
 
 bool
 IOManager::unregisterEvent(int fd, Event events)
 {
-    boost::mutex::scoped_lock lock(m_mutex);
-    std::map<int, AsyncEvent>::iterator it = m_pendingEvents.find(fd);
-    if (it == m_pendingEvents.end())
+    AsyncState *state = asyncState(fd, false);
+    if (!state)
         return false;
+    boost::mutex::scoped_lock lock(state->m_mutex);
+    uint32_t registered = state->m_events & events;
     // Nothing matching
-    if (!(events & it->second.event.events))
+    if (!registered)
         return false;
-    bool result = false;
-    AsyncEvent &e = it->second;
-    if ((events & EPOLLIN) && (e.event.events & EPOLLIN)) {
-        e.m_dgIn = NULL;
-        e.m_fiberIn.reset();
-        result = true;
-    }
-    if ((events & EPOLLOUT) && (e.event.events & EPOLLOUT)) {
-        e.m_dgOut = NULL;
-        e.m_fiberOut.reset();
-        result = true;
-    }
-    if ((events & EPOLLRDHUP) && (e.event.events & EPOLLRDHUP)) {
-        e.m_dgClose = NULL;
-        e.m_fiberClose.reset();
-        result = true;
-    }
-    e.event.events &= ~events;
-    int op = e.event.events == (unsigned int)EPOLLET ?
-        EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    int rc = epoll_ctl(m_epfd, op, fd, &e.event);
-    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", " << fd
-        << ", " << (EPOLL_EVENTS)e.event.events << "): " << rc << " (" << errno << ")";
-    if (op == EPOLL_CTL_DEL)
-        m_pendingEvents.erase(it);
-    if (rc)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
-    return result;
+    static const Event all[] = { READ, WRITE, CLOSE };
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); ++i) {
+        if (!(registered & all[i]))
+            continue;
+        AsyncState::EventContext &context = state->contextForEvent(all[i]);
+        context.scheduler = NULL;
+        context.dg = NULL;
+        context.fiber.reset();
+        --m_pendingEventCount;
+    }
+    state->m_events &= ~registered;
+    if (!state->m_edgeTriggered)
+        updateEpoll(*state, state->m_events);
+    return true;
 }
 
 void
 IOManager::cancelEvent(int fd, Event events)
 {
-    boost::mutex::scoped_lock lock(m_mutex);
-    std::map<int, AsyncEvent>::iterator it = m_pendingEvents.find(fd);
-    if (it == m_pendingEvents.end())
+    AsyncState *state = asyncState(fd, false);
+    if (!state)
         return;
-    AsyncEvent &e = it->second;
-    if ((events & EPOLLIN) && (e.event.events & EPOLLIN)) {
-        if (e.m_dgIn)
-            e.m_schedulerIn->schedule(e.m_dgIn);
-        else
-            e.m_schedulerIn->schedule(e.m_fiberIn);
-        e.m_dgIn = NULL;
-        e.m_fiberIn.reset();
+    boost::mutex::scoped_lock lock(state->m_mutex);
+#ifdef IO_URING
+    if (m_ring) {
+        if ((events & READ) && state->m_in.io)
+            cancelIo(state->m_in.io);
+        if ((events & WRITE) && state->m_out.io)
+            cancelIo(state->m_out.io);
     }
-    if ((events & EPOLLOUT) && (e.event.events & EPOLLOUT)) {
-        if (e.m_dgOut)
-            e.m_schedulerOut->schedule(e.m_dgOut);
-        else
-            e.m_schedulerOut->schedule(e.m_fiberOut);
-        e.m_dgOut = NULL;
-        e.m_fiberOut.reset();
+#endif
+    uint32_t registered = state->m_events & events;
+    if (!registered)
+        return;
+    static const Event all[] = { READ, WRITE, CLOSE };
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); ++i) {
+        if (!(registered & all[i]))
+            continue;
+        state->triggerEvent(all[i]);
+        --m_pendingEventCount;
     }
-    if ((events & EPOLLRDHUP) && (e.event.events & EPOLLRDHUP)) {
-        if (e.m_dgClose)
-            e.m_schedulerClose->schedule(e.m_dgClose);
-        else
-            e.m_schedulerClose->schedule(e.m_fiberClose);
-        e.m_dgClose = NULL;
-        e.m_fiberClose.reset();
+    if (!state->m_edgeTriggered)
+        updateEpoll(*state, state->m_events);
+}
+
+void
+IOManager::registerFd(int fd)
+{
+    MORDOR_ASSERT(fd > 0);
+    AsyncState &state = *asyncState(fd, true);
+    boost::mutex::scoped_lock lock(state.m_mutex);
+    MORDOR_ASSERT(!state.m_events);
+    MORDOR_ASSERT(!state.m_registered);
+    state.m_edgeTriggered = true;
+    state.m_ready = 0;
+}
+
+void
+IOManager::unregisterFd(int fd)
+{
+    AsyncState *state = asyncState(fd, false);
+    if (!state)
+        return;
+    boost::mutex::scoped_lock lock(state->m_mutex);
+    MORDOR_ASSERT(!state->m_events);
+    if (!state->m_edgeTriggered)
+        return;
+    state->m_edgeTriggered = false;
+    state->m_ready = 0;
+    updateEpoll(*state, 0);
+}
+
+#ifdef IO_URING
+static int
+ioUringSetup(unsigned int entries, io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+ioUringEnter(int fd, unsigned int toSubmit)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, 0, 0, NULL, 0);
+}
+
+static int
+ioUringRegister(int fd, unsigned int opcode, void *arg, unsigned int count)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+bool
+IOManager::setupRing()
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(io_uring_params));
+    int fd = ioUringSetup(g_ioUringEntries->val(), &params);
+    MORDOR_LOG_VERBOSE(g_log) << this << " io_uring_setup("
+        << g_ioUringEntries->val() << "): " << fd << " (" << errno << ")";
+    if (fd < 0)
+        return false;
+    // Everything since 5.7 (most importantly, polling internally instead of
+    // punting to a thread when a socket isn't ready)
+    const unsigned int features = IORING_FEAT_SINGLE_MMAP |
+        IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS | IORING_FEAT_FAST_POLL;
+    if ((params.features & features) != features) {
+        MORDOR_LOG_VERBOSE(g_log) << this << " io_uring features "
+            << params.features << " missing " << (features & ~params.features);
+        close(fd);
+        return false;
+    }
+    static const unsigned char ops[] = { IORING_OP_READV, IORING_OP_WRITEV,
+        IORING_OP_SENDMSG, IORING_OP_RECVMSG, IORING_OP_ACCEPT,
+        IORING_OP_CONNECT, IORING_OP_ASYNC_CANCEL, IORING_OP_LINK_TIMEOUT };
+    std::vector<char> probeBuffer(sizeof(io_uring_probe) +
+        256 * sizeof(io_uring_probe_op));
+    io_uring_probe *probe = (io_uring_probe *)&probeBuffer[0];
+    int rc = ioUringRegister(fd, IORING_REGISTER_PROBE, probe, 256);
+    for (size_t i = 0; rc == 0 && i < sizeof(ops); ++i) {
+        if (ops[i] > probe->last_op ||
+            !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            MORDOR_LOG_VERBOSE(g_log) << this << " io_uring op "
+                << (int)ops[i] << " not supported";
+            rc = -1;
+        }
     }
-    e.event.events &= ~events;
-    int op = e.event.events == (unsigned int)EPOLLET ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
-    int rc = epoll_ctl(m_epfd, op, fd, &e.event);
+    if (rc) {
+        close(fd);
+        return false;
+    }
+
+    size_t ringSize = std::max<size_t>(
+        params.sq_off.array + params.sq_entries * sizeof(unsigned int),
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    void *ring = mmap(NULL, ringSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        MORDOR_LOG_ERROR(g_log) << this << " mmap(" << fd << ", "
+            << ringSize << "): (" << errno << ")";
+        close(fd);
+        return false;
+    }
+    void *sqes = mmap(NULL, params.sq_entries * sizeof(io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+        IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        MORDOR_LOG_ERROR(g_log) << this << " mmap(" << fd << ", "
+            << params.sq_entries * sizeof(io_uring_sqe) << "): (" << errno
+            << ")";
+        munmap(ring, ringSize);
+        close(fd);
+        return false;
+    }
+
+    Ring *result = new Ring();
+    result->fd = fd;
+    result->ring = ring;
+    result->ringSize = ringSize;
+    char *base = (char *)ring;
+    result->sqHead = (unsigned int *)(base + params.sq_off.head);
+    result->sqTail = (unsigned int *)(base + params.sq_off.tail);
+    result->sqArray = (unsigned int *)(base + params.sq_off.array);
+    result->sqMask = *(unsigned int *)(base + params.sq_off.ring_mask);
+    result->sqEntries = params.sq_entries;
+    result->sqes = (io_uring_sqe *)sqes;
+    result->cqHead = (unsigned int *)(base + params.cq_off.head);
+    result->cqTail = (unsigned int *)(base + params.cq_off.tail);
+    result->cqMask = *(unsigned int *)(base + params.cq_off.ring_mask);
+    result->cqes = (io_uring_cqe *)(base + params.cq_off.cqes);
+
+    // Completions wake up idle() through epoll, just like any other fd
+    epoll_event event;
+    memset(&event, 0, sizeof(epoll_event));
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = result;
+    rc = epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &event);
     MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", " << fd
-        << ", " << (EPOLL_EVENTS)e.event.events << "): " << rc << " ("
-        << errno << ")";
-    if (op == EPOLL_CTL_DEL)
-        m_pendingEvents.erase(it);
-    if (rc)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+        << " epoll_ctl(" << m_epfd << ", EPOLL_CTL_ADD, " << fd
+        << ", EPOLLIN | EPOLLET): " << rc << " (" << errno << ")";
+    if (rc) {
+        delete result;
+        munmap(sqes, params.sq_entries * sizeof(io_uring_sqe));
+        munmap(ring, ringSize);
+        close(fd);
+        return false;
+    }
+    m_ring = result;
+    return true;
+}
+
+unsigned int
+IOManager::submit(io_uring_sqe *sqes, unsigned int count, int &error)
+{
+    Ring &ring = *m_ring;
+    boost::mutex::scoped_lock lock(ring.sqMutex);
+    unsigned int tail = *ring.sqTail;
+    // Without SQPOLL, io_uring_enter consumes everything before returning,
+    // so the queue is always empty here
+    MORDOR_ASSERT(tail == __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE));
+    MORDOR_ASSERT(count <= ring.sqEntries);
+    for (unsigned int i = 0; i < count; ++i) {
+        unsigned int index = (tail + i) & ring.sqMask;
+        ring.sqes[index] = sqes[i];
+        ring.sqArray[index] = index;
+    }
+    __atomic_store_n(ring.sqTail, tail + count, __ATOMIC_RELEASE);
+    unsigned int submitted = 0;
+    while (submitted < count) {
+        int rc = ioUringEnter(ring.fd, count - submitted);
+        MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::VERBOSE) << this
+            << " io_uring_enter(" << ring.fd << ", " << count - submitted
+            << "): " << rc << " (" << errno << ")";
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc < 0) {
+            error = errno;
+            // The kernel already owns (and will complete) whatever it
+            // consumed; drop the rest so a later submit doesn't pick them up
+            __atomic_store_n(ring.sqTail, tail + submitted, __ATOMIC_RELEASE);
+            if (submitted == 0)
+                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "io_uring_enter");
+            return submitted;
+        }
+        submitted += rc;
+    }
+    return submitted;
 }
 
+void
+IOManager::reapCompletions()
+{
+    Ring &ring = *m_ring;
+    unsigned int head = *ring.cqHead;
+    while (true) {
+        unsigned int tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+            break;
+        for (; head != tail; ++head) {
+            const io_uring_cqe &cqe = ring.cqes[head & ring.cqMask];
+            completeIo(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    }
+}
+
+void
+IOManager::completeIo(unsigned long long userData, int result)
+{
+    if (userData == 0)
+        return;
+    IoOperation &op = *(IoOperation *)(uintptr_t)(userData & ~TIMEOUT_TAG);
+    MORDOR_LOG_TRACE(g_log) << this << " io_uring completion {" << &op
+        << (userData & TIMEOUT_TAG ? " (timeout)" : "") << ", " << result
+        << "}";
+    if (userData & TIMEOUT_TAG) {
+        if (result == -ETIME)
+            op.timedOut = true;
+    } else {
+        op.result = result;
+        boost::mutex::scoped_lock lock(op.state->m_mutex);
+        AsyncState::EventContext &context =
+            op.state->contextForEvent(op.event);
+        MORDOR_ASSERT(context.io == &op);
+        context.io = NULL;
+        --m_pendingEventCount;
+    }
+    if (--op.outstanding == 0 && op.waiting) {
+        // op lives on the fiber's stack; don't touch it once it's scheduled
+        Scheduler *scheduler = op.scheduler;
+        Fiber::ptr fiber;
+        fiber.swap(op.fiber);
+        scheduler->schedule(fiber);
+    }
+}
+
+void
+IOManager::cancelIo(IoOperation *op)
+{
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(io_uring_sqe));
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.fd = -1;
+    sqe.addr = (uintptr_t)op;
+    int error;
+    submit(&sqe, 1, error);
+}
+
+int
+IOManager::performIo(int fd, Event event, const io_uring_sqe &sqe,
+    unsigned long long timeout)
+{
+    MORDOR_ASSERT(m_ring);
+    MORDOR_ASSERT(event == READ || event == WRITE);
+    MORDOR_ASSERT(Scheduler::getThis());
+    MORDOR_ASSERT(Fiber::getThis());
+
+    IoOperation op;
+    op.state = asyncState(fd, true);
+    op.event = event;
+    op.scheduler = Scheduler::getThis();
+    op.fiber = Fiber::getThis();
+    op.result = 0;
+    op.outstanding = 1;
+    op.timedOut = false;
+    op.waiting = false;
+
+    io_uring_sqe sqes[2];
+    sqes[0] = sqe;
+    sqes[0].user_data = (uintptr_t)&op;
+    __kernel_timespec ts;
+    if (timeout != ~0ull) {
+        sqes[0].flags |= IOSQE_IO_LINK;
+        memset(&sqes[1], 0, sizeof(io_uring_sqe));
+        sqes[1].opcode = IORING_OP_LINK_TIMEOUT;
+        sqes[1].fd = -1;
+        ts.tv_sec = timeout / 1000000;
+        ts.tv_nsec = (timeout % 1000000) * 1000;
+        sqes[1].addr = (uintptr_t)&ts;
+        sqes[1].len = 1;
+        sqes[1].user_data = (uintptr_t)&op | TIMEOUT_TAG;
+        op.outstanding = 2;
+    }
+
+    {
+        boost::mutex::scoped_lock lock(op.state->m_mutex);
+        AsyncState::EventContext &context = op.state->contextForEvent(event);
+        MORDOR_ASSERT(!(op.state->m_events & event));
+        MORDOR_ASSERT(!context.io);
+        context.io = &op;
+        ++m_pendingEventCount;
+    }
+    int error = 0;
+    unsigned int submitted;
+    try {
+        submitted = submit(sqes, op.outstanding, error);
+    } catch (...) {
+        boost::mutex::scoped_lock lock(op.state->m_mutex);
+        op.state->contextForEvent(event).io = NULL;
+        --m_pendingEventCount;
+        throw;
+    }
+    if (submitted < (unsigned int)op.outstanding) {
+        // The operation is in flight, but its timeout isn't; it refers to
+        // op, so it has to be waited for before reporting the error
+        MORDOR_ASSERT(submitted == 1);
+        {
+            boost::mutex::scoped_lock lock(m_ring->cqMutex);
+            --op.outstanding;
+        }
+        try {
+            cancelIo(&op);
+        } catch (...) {
+            MORDOR_LOG_ERROR(g_log) << this << " unable to cancel " << &op
+                << ": " << boost::current_exception_diagnostic_information();
+        }
+    }
+    {
+        // If the fd was ready, the kernel already completed it inline
+        boost::mutex::scoped_lock lock(m_ring->cqMutex);
+        reapCompletions();
+        if (op.outstanding != 0)
+            op.waiting = true;
+    }
+    if (op.waiting)
+        Scheduler::yieldTo();
+    MORDOR_ASSERT(op.outstanding == 0);
+    if (error && op.result < 0)
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "io_uring_enter");
+    if (op.timedOut && op.result == -ECANCELED)
+        return -ETIMEDOUT;
+    return op.result;
+}
+#endif
+
 bool
 IOManager::stopping(unsigned long long &nextTimeout)
 {
     nextTimeout = nextTimer();
-    if (nextTimeout == ~0ull && Scheduler::stopping()) {
-        boost::mutex::scoped_lock lock(m_mutex);
-        if (m_pendingEvents.empty()) {
-            return true;
-        }
-    }
-    return false;
+    return nextTimeout == ~0ull && Scheduler::stopping() &&
+        m_pendingEventCount == 0;
 }
 
 void
@@ -336,66 +787,45 @@ IOManager::idle()
 
         for(int i = 0; i < rc; ++i) {
             epoll_event &event = events[i];
-            if (event.data.fd == m_tickleFds[0]) {
+#ifdef IO_URING
+            if (m_ring && event.data.ptr == m_ring) {
+                boost::mutex::scoped_lock lock(m_ring->cqMutex);
+                reapCompletions();
+                continue;
+            }
+#endif
+            if (event.data.ptr == this) {
                 unsigned char dummy;
                 int rc2 = read(m_tickleFds[0], &dummy, 1);
                 MORDOR_VERIFY(rc2 == 1);
                 MORDOR_LOG_VERBOSE(g_log) << this << " received tickle";
                 continue;
             }
-            bool err = event.events & (EPOLLERR | EPOLLHUP);
-            boost::mutex::scoped_lock lock(m_mutex);
-            std::map<int, AsyncEvent>::iterator it =
-m_pendingEvents.find(event.data.fd);
-            if (it == m_pendingEvents.end())
-                continue;
-            AsyncEvent &e = it->second;
-            MORDOR_LOG_TRACE(g_log) << " epoll_event {"
-                << (EPOLL_EVENTS)event.events << ", " << event.data.fd
-                << "}, registered for " << (EPOLL_EVENTS)e.event.events;
-
-            if ((event.events & EPOLLRDHUP) && (e.event.events & EPOLLRDHUP)) {
-                if (e.m_dgClose)
-                    e.m_schedulerClose->schedule(e.m_dgClose);
-                else
-                    e.m_schedulerClose->schedule(e.m_fiberClose);
-                e.m_dgClose = NULL;
-                e.m_fiberClose.reset();
-            }
+            g_statFdEvents.increment();
+            AsyncState &state = *(AsyncState *)event.data.ptr;
+            uint32_t fired = event.events & (READ | WRITE | CLOSE);
+            if (event.events & (EPOLLERR | EPOLLHUP))
+                fired |= READ | WRITE;
 
-            if (((event.events & EPOLLIN) ||
-                err) && (e.event.events & EPOLLIN)) {
-                if (e.m_dgIn)
-                    e.m_schedulerIn->schedule(e.m_dgIn);
-                else
-                    e.m_schedulerIn->schedule(e.m_fiberIn);
-                e.m_dgIn = NULL;
-                e.m_fiberIn.reset();
-                event.events |= EPOLLIN;
+            boost::mutex::scoped_lock lock(state.m_mutex);
+            MORDOR_LOG_TRACE(g_log) << " epoll_event {"
+                << (EPOLL_EVENTS)event.events << ", " << state.m_fd
+                << "}, registered for " << (EPOLL_EVENTS)state.m_events;
+            uint32_t triggered = fired & state.m_events;
+            static const Event all[] = { CLOSE, READ, WRITE };
+            for (size_t j = 0; j < sizeof(all) / sizeof(all[0]); ++j) {
+                if (!(triggered & all[j]))
+                    continue;
+                state.triggerEvent(all[j]);
+                --m_pendingEventCount;
             }
-            if (((event.events & EPOLLOUT) ||
-                err) && (e.event.events & EPOLLOUT)) {
-                if (e.m_dgOut)
-                    e.m_schedulerOut->schedule(e.m_dgOut);
-                else
-                    e.m_schedulerOut->schedule(e.m_fiberOut);
-                e.m_dgOut = NULL;
-                e.m_fiberOut.reset();
-                event.events |= EPOLLOUT;
+            if (state.m_edgeTriggered) {
+                // Nobody was waiting; remember it for whoever comes next
+                state.m_ready |= fired & ~triggered;
+                continue;
             }
-            e.event.events &= ~event.events;
-
-            int op = e.event.events == (unsigned int)EPOLLET ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
-            int rc2 = epoll_ctl(m_epfd, op, event.data.fd,
-                &e.event);
-            MORDOR_LOG_LEVEL(g_log, rc2 ? Log::ERROR : Log::VERBOSE) << this
-                << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
-                << event.data.fd << ", " << (EPOLL_EVENTS)e.event.events << "): " << rc2
-                << " (" << errno << ")";
-            if (rc2)
-                MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
-            if (op == EPOLL_CTL_DEL)
-                m_pendingEvents.erase(it);
+            if (triggered)
+                updateEpoll(state, state.m_events);
         }
         try {
             Fiber::yield();
@@ -4,6 +4,11 @@
 
 #include <sys/epoll.h>
 
+#include <vector>
+
+#include <boost/thread/shared_mutex.hpp>
+
+#include "atomic.h"
 #include "scheduler.h"
 #include "timer.h"
 #include "version.h"
@@ -17,6 +22,12 @@
 #define EPOLLRDHUP 0x2000
 #endif
 
+// Build with NO_IO_URING where the kernel headers predate io_uring
+#ifndef NO_IO_URING
+#include <linux/io_uring.h>
+#define IO_URING
+#endif
+
 namespace Mordor {
 
 class Fiber;
@@ -31,17 +42,57 @@ public:
     };
 
 private:
-    struct AsyncEvent
-    {
-        epoll_event event;
+#ifdef IO_URING
+    struct IoOperation;
+    struct Ring;
+#endif
 
-        Scheduler *m_schedulerIn, *m_schedulerOut, *m_schedulerClose;
-        boost::shared_ptr<Fiber> m_fiberIn, m_fiberOut, m_fiberClose;
-        boost::function<void ()> m_dgIn, m_dgOut, m_dgClose;
+    /// Everything about a single fd; indexed by fd in m_pendingEvents, and
+    /// pointed to by the fd's epoll_event, so that idle() doesn't need to
+    /// look anything up
+    struct AsyncState : boost::noncopyable
+    {
+        struct EventContext
+        {
+            EventContext()
+                : scheduler(NULL)
+#ifdef IO_URING
+                , io(NULL)
+#endif
+            {}
+
+            Scheduler *scheduler;
+            boost::shared_ptr<Fiber> fiber;
+            boost::function<void ()> dg;
+#ifdef IO_URING
+            /// An operation in flight in the io_uring (instead of waiting for
+            /// readiness)
+            IoOperation *io;
+#endif
+        };
+
+        AsyncState(int fd);
+
+        EventContext &contextForEvent(Event event);
+        /// Schedule whoever is waiting for event, and forget about them
+        /// @pre m_mutex is locked
+        void triggerEvent(Event event);
+
+        int m_fd;
+        EventContext m_in, m_out, m_close;
+        /// The events someone is waiting for
+        uint32_t m_events;
+        /// The fd is in the epoll set
+        bool m_registered;
+        /// The fd stays in the epoll set for all events until unregisterFd()
+        bool m_edgeTriggered;
+        /// (Edge-triggered only) events that fired while nobody was waiting
+        uint32_t m_ready;
+        boost::mutex m_mutex;
     };
-
 public:
-    IOManager(size_t threads = 1, bool useCaller = true);
+    IOManager(size_t threads = 1, bool useCaller = true,
+        size_t firstThread = 0);
     ~IOManager();
 
     bool stopping();
@@ -53,6 +104,47 @@ public:
     /// Will cause the event to fire
     void cancelEvent(int fd, Event events);
 
+    /// Switch fd to edge-triggered mode
+
+    /// Normally fd is added to and removed from the epoll set (or modified)
+    /// every time an event is registered or fires.  In edge-triggered mode,
+    /// the first registerEvent() adds it for all events, and it stays there
+    /// until unregisterFd(), so waiting costs no system calls at all.
+    /// Readiness that arrives while nobody is waiting is remembered, and the
+    /// next registerEvent() for it fires immediately; this means callers
+    /// must only wait after an operation fails with EAGAIN, and must retry
+    /// the operation (possibly getting EAGAIN again) after waking up.
+    /// @pre No events are registered for fd
+    void registerFd(int fd);
+    /// Take fd out of edge-triggered mode
+
+    /// This must be called before fd is closed.
+    /// @pre No events are registered for fd
+    void unregisterFd(int fd);
+
+#ifdef IO_URING
+    /// If performIo() can be used
+
+    /// The kernel has to support io_uring (with everything performIo() needs),
+    /// and iomanager.iouring has to be set when the IOManager is constructed
+    bool asyncIo() const { return m_ring != NULL; }
+    /// Submit an operation on fd to io_uring, and suspend the current Fiber
+    /// until it completes
+
+    /// The operation is tracked as event (READ or WRITE) for fd, so
+    /// cancelEvent() cancels it.  sqe.user_data and IOSQE_IO_LINK are used
+    /// internally.  Operations that complete immediately (i.e. the fd was
+    /// already ready) do not suspend at all.
+    /// @param timeout How long (in microseconds) before the operation is
+    /// cancelled, as a linked timeout in the io_uring
+    /// @return The result of the operation (-errno on failure, including
+    /// -ECANCELED and -ETIMEDOUT); -EAGAIN means fd is non-blocking and the
+    /// kernel gave up, so wait for it with registerEvent() instead
+    /// @pre asyncIo()
+    int performIo(int fd, Event event, const io_uring_sqe &sqe,
+        unsigned long long timeout = ~0ull);
+#endif
+
 protected:
     bool stopping(unsigned long long &nextTimeout);
     void idle();
@@ -60,11 +152,32 @@ protected:
 
     void onTimerInsertedAtFront() { tickle(); }
 
+private:
+    AsyncState *asyncState(int fd, bool create);
+    void updateEpoll(AsyncState &state, uint32_t events);
+#ifdef IO_URING
+    bool setupRing();
+    /// @return How many of sqes the kernel took; if that's fewer than count,
+    /// the rest were dropped, and error is why
+    /// @throws If it took none of them
+    unsigned int submit(io_uring_sqe *sqes, unsigned int count, int &error);
+    /// @pre m_ring->cqMutex is locked
+    void reapCompletions();
+    void completeIo(unsigned long long userData, int result);
+    void cancelIo(IoOperation *op);
+#endif
+
 private:
     int m_epfd;
     int m_tickleFds[2];
-    std::map<int, AsyncEvent> m_pendingEvents;
-    boost::mutex m_mutex;
+    // AsyncStates are never freed (until the IOManager is), so a pointer to
+    // one remains valid even after m_mutex is released
+    std::vector<AsyncState *> m_pendingEvents;
+    Atomic<size_t> m_pendingEventCount;
+    boost::shared_mutex m_mutex;
+#ifdef IO_URING
+    Ring *m_ring;
+#endif
 };
 
 }
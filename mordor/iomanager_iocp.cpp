@@ -211,8 +211,8 @@ IOManager::WaitBlock::removeEntry(int index)
     memmove(&m_recurring[index], &m_recurring[index + 1], (m_inUseCount - index) * sizeof(bool));
 }
 
-IOManager::IOManager(size_t threads, bool useCaller)
-    : Scheduler(threads, useCaller)
+IOManager::IOManager(size_t threads, bool useCaller, size_t firstThread)
+    : Scheduler(threads, useCaller, 1, firstThread)
 {
     m_pendingEventCount = 0;
     m_hCompletionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
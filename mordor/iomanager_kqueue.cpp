@@ -13,8 +13,8 @@ namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:iomanager");
 
-IOManager::IOManager(size_t threads, bool useCaller)
-    : Scheduler(threads, useCaller)
+IOManager::IOManager(size_t threads, bool useCaller, size_t firstThread)
+    : Scheduler(threads, useCaller, 1, firstThread)
 {
     m_kqfd = kqueue();
     MORDOR_LOG_LEVEL(g_log, m_kqfd <= 0 ? Log::ERROR : Log::TRACE) << this
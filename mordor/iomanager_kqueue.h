@@ -40,7 +40,8 @@ private:
     };
 
 public:
-    IOManager(size_t threads = 1, bool useCaller = true);
+    IOManager(size_t threads = 1, bool useCaller = true,
+        size_t firstThread = 0);
     ~IOManager();
 
     bool stopping();
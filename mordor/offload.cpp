@@ -0,0 +1,212 @@
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include "offload.h"
+
+#include <algorithm>
+
+#include "assert.h"
+#include "atomic.h"
+#include "config.h"
+#include "fibersynchronization.h"
+#include "log.h"
+#include "semaphore.h"
+#include "statistics.h"
+#include "thread.h"
+#include "timer.h"
+#include "workerpool.h"
+
+namespace Mordor {
+
+static Logger::ptr g_log = Log::lookup("mordor:offload");
+
+static ConfigVar<size_t>::ptr g_blockingThreads = Config::lookup<size_t>(
+    "offload.blocking.threads", 8u,
+    "Threads for running blocking system calls off of the caller's "
+    "Scheduler");
+static ConfigVar<size_t>::ptr g_blockingMaxQueue = Config::lookup<size_t>(
+    "offload.blocking.maxqueue", 1024u,
+    "Calls that may queue for a blocking offload thread; beyond that, callers "
+    "wait for room");
+static ConfigVar<size_t>::ptr g_cpuThreads = Config::lookup<size_t>(
+    "offload.cpu.threads", 0u,
+    "Threads for running CPU-heavy work off of the caller's Scheduler (0 for "
+    "one per processor)");
+static ConfigVar<size_t>::ptr g_cpuMaxQueue = Config::lookup<size_t>(
+    "offload.cpu.maxqueue", 1024u,
+    "Calls that may queue for a CPU offload thread; beyond that, callers wait "
+    "for room");
+
+namespace {
+struct PoolStatistics
+{
+    PoolStatistics(const std::string &prefix, const std::string &what)
+        : runs(Statistics::registerStatistic(prefix + ".runs",
+              CountStatistic<unsigned long long>("calls"),
+              "Calls run on the " + what + " offload pool")),
+          waits(Statistics::registerStatistic(prefix + ".waits",
+              CountStatistic<unsigned long long>("calls"),
+              "Calls that found the " + what + " offload queue full")),
+          maxPending(Statistics::registerStatistic(prefix + ".pending.max",
+              MaxStatistic<size_t>("calls"),
+              "Most calls running on or queued for the " + what +
+              " offload pool")),
+          latency(Statistics::registerStatistic(prefix + ".latency",
+              HistogramStatistic<unsigned long long>("us"),
+              "Time from offloading a call until it runs")),
+          busyTime(Statistics::registerStatistic(prefix + ".busytime",
+              SumStatistic<unsigned long long>("us"),
+              "Time spent running calls on the " + what + " offload pool"))
+    {}
+
+    CountStatistic<unsigned long long> &runs, &waits;
+    MaxStatistic<size_t> &maxPending;
+    HistogramStatistic<unsigned long long> &latency;
+    SumStatistic<unsigned long long> &busyTime;
+};
+}
+
+static PoolStatistics g_blockingStats("offload.blocking", "blocking");
+static PoolStatistics g_cpuStats("offload.cpu", "CPU");
+
+struct Offload::PoolState
+{
+    PoolState(size_t threads, size_t maxQueue, PoolStatistics &stats_)
+        : workers(threads, false),
+          limit(threads + maxQueue),
+          slots(limit),
+          pending(0),
+          stats(stats_)
+    {}
+
+    /// Wait for every call that's running, or waiting for a slot, to finish
+    void drain();
+
+    WorkerPool workers;
+    size_t limit;
+    FiberSemaphore slots;
+    volatile size_t pending;
+    PoolStatistics &stats;
+    /// Protects drained, and decrementing pending
+    boost::mutex mutex;
+    /// Called once pending drops to 0 (while drain() is waiting)
+    boost::function<void ()> drained;
+};
+
+void
+Offload::PoolState::drain()
+{
+    FiberSemaphore fiberDrained;
+    Semaphore threadDrained;
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        if (pending == 0)
+            return;
+        if (Scheduler::getThis())
+            drained = boost::bind(&FiberSemaphore::notify, &fiberDrained);
+        else
+            drained = boost::bind(&Semaphore::notify, &threadDrained);
+    }
+    if (Scheduler::getThis())
+        fiberDrained.wait();
+    else
+        threadDrained.wait();
+}
+
+Offload *Offload::s_offload;
+
+Offload::Offload(size_t blockingThreads, size_t cpuThreads)
+{
+    MORDOR_ASSERT(!s_offload);
+    if (blockingThreads == 0)
+        blockingThreads = std::max<size_t>(g_blockingThreads->val(), 1u);
+    if (cpuThreads == 0)
+        cpuThreads = g_cpuThreads->val();
+    if (cpuThreads == 0)
+        cpuThreads = processorCount();
+    m_pools[BLOCKING].reset(new PoolState(blockingThreads,
+        g_blockingMaxQueue->val(), g_blockingStats));
+    m_pools[CPU].reset(new PoolState(cpuThreads, g_cpuMaxQueue->val(),
+        g_cpuStats));
+    s_offload = this;
+}
+
+Offload::~Offload()
+{
+    MORDOR_ASSERT(s_offload == this);
+    s_offload = NULL;
+    // Fibers still waiting for a slot get one as running calls finish, and
+    // then switch to the pool; they have to be done before it goes away
+    m_pools[CPU]->drain();
+    m_pools[BLOCKING]->drain();
+    m_pools[CPU].reset();
+    m_pools[BLOCKING].reset();
+}
+
+void
+Offload::run(Pool pool, const boost::function<void ()> &dg)
+{
+    Offload *offload = s_offload;
+    if (!offload || !Scheduler::getThis()) {
+        dg();
+        return;
+    }
+    offload->runOn(pool, dg);
+}
+
+size_t
+Offload::pending(Pool pool) const
+{
+    return m_pools[pool]->pending;
+}
+
+void
+Offload::runOn(Pool pool, const boost::function<void ()> &dg)
+{
+    PoolState &state = *m_pools[pool];
+    // Already on the pool (i.e. offloaded work offloading more); waiting for
+    // a slot could deadlock
+    if (Scheduler::getThis() == &state.workers) {
+        dg();
+        return;
+    }
+    unsigned long long start = TimerManager::now();
+    size_t pending = atomicIncrement(state.pending);
+    state.stats.maxPending.update(pending);
+    if (pending > state.limit) {
+        MORDOR_LOG_DEBUG(g_log) << "offload " << (pool == CPU ? "cpu" :
+            "blocking") << " queue full; waiting";
+        state.stats.waits.increment();
+    }
+    state.slots.wait();
+    SchedulerSwitcher switcher(&state.workers);
+    // Account for the call and give its slot back, however dg finishes
+    struct Finish : boost::noncopyable
+    {
+        Finish(PoolState &state_)
+            : state(state_),
+              started(TimerManager::now())
+        {}
+        ~Finish()
+        {
+            state.stats.runs.increment();
+            state.stats.busyTime.add(TimerManager::now() - started);
+            state.slots.notify();
+            boost::function<void ()> drained;
+            {
+                boost::mutex::scoped_lock lock(state.mutex);
+                if (atomicDecrement(state.pending) == 0)
+                    drained.swap(state.drained);
+            }
+            // ~Offload may destroy state as soon as this is called
+            if (drained)
+                drained();
+        }
+
+        PoolState &state;
+        unsigned long long started;
+    } finish(state);
+    state.stats.latency.update(finish.started - start);
+    dg();
+}
+
+}
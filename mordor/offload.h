@@ -0,0 +1,88 @@
+#ifndef __MORDOR_OFFLOAD_H__
+#define __MORDOR_OFFLOAD_H__
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+
+namespace Mordor {
+
+/// Runs blocking calls and CPU-heavy work away from the caller's Scheduler
+
+/// An IOManager's threads must never block: a getaddrinfo(), an fsync(), or
+/// deflating at level 9 stalls every other Fiber on that thread.  While an
+/// Offload exists, Offload::run() switches the calling Fiber to one of two
+/// helper WorkerPools (via Scheduler::switchTo()), runs the work there, and
+/// switches back, so that only the calling Fiber waits, and it resumes on its
+/// own Scheduler.  Blocking I/O and CPU work get separate pools, so a burst of
+/// slow filesystem calls can't starve compression, and vice versa.
+///
+/// Each pool admits at most as many Fibers as it has threads, plus
+/// offload.<pool>.maxqueue; beyond that, callers wait their turn (again
+/// without blocking their thread).
+///
+/// Without an Offload, or from a thread with no Scheduler, the work is simply
+/// run inline.
+/// @code
+/// Offload offload;
+/// ...
+/// Offload::run(Offload::BLOCKING, boost::bind(&fsync, fd));
+/// int result = Offload::run<int>(Offload::CPU, boost::bind(&compress, ...));
+/// @endcode
+class Offload : boost::noncopyable
+{
+public:
+    enum Pool
+    {
+        /// System calls that block; sized by offload.blocking.threads
+        BLOCKING,
+        /// Computation; sized by offload.cpu.threads (0 for one thread per
+        /// processor)
+        CPU
+    };
+
+private:
+    struct PoolState;
+
+public:
+    /// @param blockingThreads 0 for offload.blocking.threads
+    /// @param cpuThreads 0 for offload.cpu.threads
+    /// @pre There isn't already an Offload
+    Offload(size_t blockingThreads = 0, size_t cpuThreads = 0);
+    ~Offload();
+
+    /// Run dg on pool, suspending the current Fiber until it's done
+    /// @note Exceptions thrown by dg are propagated
+    static void run(Pool pool, const boost::function<void ()> &dg);
+    /// @return The result of dg
+    template <class R>
+    static R run(Pool pool, const boost::function<R ()> &dg)
+    {
+        R result;
+        run(pool, boost::bind(&assign<R>, boost::ref(result), boost::cref(dg)));
+        return result;
+    }
+
+    /// @return The Offload currently in effect, or NULL
+    static Offload *get() { return s_offload; }
+
+    /// @return How many Fibers are running on or waiting for pool
+    size_t pending(Pool pool) const;
+
+private:
+    template <class R>
+    static void assign(R &result, const boost::function<R ()> &dg)
+    { result = dg(); }
+
+    void runOn(Pool pool, const boost::function<void ()> &dg);
+
+private:
+    boost::scoped_ptr<PoolState> m_pools[2];
+    static Offload *s_offload;
+};
+
+}
+
+#endif
@@ -2,11 +2,16 @@
 
 #include "parallel.h"
 
+#include <boost/bind.hpp>
+
 #include "assert.h"
 #include "atomic.h"
+#include "log.h"
 
 namespace Mordor {
 
+static Logger::ptr g_log = Log::lookup("mordor:parallel");
+
 static
 void
 parallel_do_impl(boost::function<void ()> dg, size_t &completed,
@@ -97,4 +102,168 @@ parallel_do(const std::vector<boost::function<void ()> > &dgs,
     }
 }
 
+
+TaskGroup::TaskGroup(size_t parallelism, Scheduler *scheduler,
+    bool cancelOnError)
+    : m_scheduler(scheduler ? scheduler : Scheduler::getThis()),
+      m_parallelism(parallelism),
+      m_cancelOnError(cancelOnError),
+      m_work(m_mutex),
+      m_completion(m_mutex),
+      m_nextId(0),
+      m_outstanding(0),
+      m_workers(0),
+      m_idleWorkers(0),
+      m_stopping(false)
+{
+    MORDOR_ASSERT(m_scheduler);
+    MORDOR_ASSERT(m_parallelism > 0);
+}
+
+TaskGroup::~TaskGroup()
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    if (m_outstanding > 0)
+        cancelLocked();
+    m_stopping = true;
+    m_work.broadcast();
+    while (m_workers > 0)
+        m_completion.wait();
+}
+
+size_t
+TaskGroup::run(boost::function<void ()> dg)
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    MORDOR_ASSERT(!m_stopping);
+    if (m_outstanding == 0)
+        startBatch();
+    // Already cancelled (or out of time); the task would never run, or be
+    // reported by next()
+    m_deadline->check();
+    Task task;
+    task.id = m_nextId++;
+    task.dg = dg;
+    m_queue.push_back(task);
+    ++m_outstanding;
+    if (m_idleWorkers > 0) {
+        --m_idleWorkers;
+        m_work.signal();
+    } else if (m_workers < m_parallelism) {
+        ++m_workers;
+        MORDOR_LOG_DEBUG(g_log) << this << " starting worker " << m_workers;
+        m_scheduler->schedule(Fiber::ptr(new Fiber(boost::bind(
+            &TaskGroup::worker, this))));
+    }
+    return task.id;
+}
+
+bool
+TaskGroup::next(size_t &id)
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    while (m_completed.empty()) {
+        if (m_outstanding == 0)
+            return false;
+        m_completion.wait();
+    }
+    std::pair<size_t, boost::exception_ptr> completed = m_completed.front();
+    m_completed.pop_front();
+    --m_outstanding;
+    lock.unlock();
+    id = completed.first;
+    if (completed.second)
+        Mordor::rethrow_exception(completed.second);
+    return true;
+}
+
+void
+TaskGroup::wait()
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    // Everything left is either queued, running, or completed
+    while (m_outstanding > m_completed.size())
+        m_completion.wait();
+    m_completed.clear();
+    m_outstanding = 0;
+    boost::exception_ptr exception = m_exception;
+    lock.unlock();
+    if (exception)
+        Mordor::rethrow_exception(exception);
+}
+
+void
+TaskGroup::cancel()
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    if (m_deadline)
+        cancelLocked();
+}
+
+void
+TaskGroup::startBatch()
+{
+    MORDOR_ASSERT(m_completed.empty());
+    m_nextId = 0;
+    m_exception = boost::exception_ptr();
+    // Inherit the budget of whoever is fanning out
+    Deadline *parent = Deadline::getThis();
+    m_deadline.reset(new Deadline(~0ull,
+        parent ? parent->shared_from_this() : Deadline::ptr()));
+}
+
+void
+TaskGroup::cancelLocked()
+{
+    MORDOR_LOG_DEBUG(g_log) << this << " cancelling " << m_queue.size()
+        << " queued task(s)";
+    m_outstanding -= m_queue.size();
+    m_queue.clear();
+    m_deadline->cancel();
+    // There may be nothing left to wait for
+    m_completion.broadcast();
+}
+
+void
+TaskGroup::worker()
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    while (true) {
+        if (m_queue.empty()) {
+            if (m_stopping)
+                break;
+            ++m_idleWorkers;
+            m_work.wait();
+            continue;
+        }
+        Task task = m_queue.front();
+        m_queue.pop_front();
+        Deadline::ptr deadline = m_deadline;
+        lock.unlock();
+        boost::exception_ptr exception;
+        try {
+            DeadlineScope scope(deadline);
+            task.dg();
+        } catch (boost::exception &ex) {
+            removeTopFrames(ex);
+            exception = boost::current_exception();
+        } catch (...) {
+            exception = boost::current_exception();
+        }
+        // Release whatever the task bound before taking the lock
+        task.dg = NULL;
+        deadline.reset();
+        lock.lock();
+        if (exception && !m_exception) {
+            m_exception = exception;
+            if (m_cancelOnError)
+                cancelLocked();
+        }
+        m_completed.push_back(std::make_pair(task.id, exception));
+        m_completion.broadcast();
+    }
+    --m_workers;
+    m_completion.broadcast();
+}
+
 }
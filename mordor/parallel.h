@@ -2,12 +2,15 @@
 #define __MORDOR_PARALLEL_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <deque>
 #include <vector>
 
 #include <boost/noncopyable.hpp>
 #include <boost/function.hpp>
 
+#include "deadline.h"
 #include "fiber.h"
+#include "fibersynchronization.h"
 #include "scheduler.h"
 
 namespace Mordor {
@@ -167,6 +170,87 @@ parallel_foreach(Iterator begin, Iterator end, Functor functor,
     return true;
 }
 
+/// A reusable set of Fibers for fanning work out, and back in
+
+/// @ingroup parallel_do
+/// Unlike parallel_do and parallel_foreach, a TaskGroup keeps its Fibers
+/// between calls: up to parallelism worker Fibers are created as needed, and
+/// then park until more tasks are run, so fanning out to hundreds of backends
+/// per request doesn't allocate hundreds of Fibers per request.  Tasks beyond
+/// parallelism are queued (without a Fiber) until a worker is free.
+///
+/// Results are streamed back with next() as each task completes, or
+/// collected all at once with wait().  If a task throws, the rest of the
+/// group is cancelled (unless cancelOnError is false): queued tasks are
+/// dropped, and running tasks are interrupted through the group's Deadline,
+/// which is a child of the Deadline of whoever started the batch.
+/// @code
+/// TaskGroup group(16);
+/// for (size_t i = 0; i < backends.size(); ++i)
+///     group.run(boost::bind(&query, backends[i], boost::ref(results[i])));
+/// size_t completed;
+/// while (group.next(completed))
+///     process(results[completed]);
+/// @endcode
+class TaskGroup : boost::noncopyable
+{
+public:
+    /// @param parallelism The maximum number of tasks running at once
+    /// @param scheduler Where to run tasks; defaults to Scheduler::getThis()
+    /// @param cancelOnError If the first exception cancels the rest of the
+    /// group
+    TaskGroup(size_t parallelism = 4, Scheduler *scheduler = NULL,
+        bool cancelOnError = true);
+    /// Cancels anything still outstanding, and waits for the workers to exit
+    ~TaskGroup();
+
+    /// Run dg on the next available worker
+    /// @return An id (sequential, starting at 0 with each batch) for matching
+    /// up with next()
+    /// @throws OperationAbortedException or TimedOutException if the current
+    /// batch has been cancelled or run out of time
+    size_t run(boost::function<void ()> dg);
+
+    /// Suspend until another task completes
+    /// @param id Set to the id of the completed task
+    /// @return false if there are no outstanding tasks left
+    /// @throws Whatever exception the completed task threw, if any
+    bool next(size_t &id);
+    /// Suspend until all outstanding tasks complete
+    /// @throws The first exception any of the tasks threw, if any
+    void wait();
+
+    /// Drop queued tasks, and interrupt running ones
+    void cancel();
+
+    /// @return The Deadline tasks are run under
+    Deadline::ptr deadline() const { return m_deadline; }
+
+private:
+    struct Task
+    {
+        size_t id;
+        boost::function<void ()> dg;
+    };
+
+    void startBatch();
+    void cancelLocked();
+    void worker();
+
+private:
+    Scheduler *m_scheduler;
+    size_t m_parallelism;
+    bool m_cancelOnError;
+    FiberMutex m_mutex;
+    FiberCondition m_work, m_completion;
+    std::deque<Task> m_queue;
+    std::deque<std::pair<size_t, boost::exception_ptr> > m_completed;
+    size_t m_nextId, m_outstanding, m_workers, m_idleWorkers;
+    bool m_stopping;
+    boost::exception_ptr m_exception;
+    Deadline::ptr m_deadline;
+};
+
 }
 
 #endif
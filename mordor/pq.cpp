@@ -2,7 +2,10 @@
 
 #include "pq.h"
 
+#include <boost/bind.hpp>
+
 #include "assert.h"
+#include "deadline.h"
 #include "endian.h"
 #include "iomanager.h"
 #include "log.h"
@@ -29,6 +32,19 @@ static Logger::ptr g_log = Log::lookup("mordor:pq");
 
 namespace PQ {
 
+#ifndef WINDOWS
+// Honors the current Fiber's Deadline, like FDStream and Socket
+static void waitFor(SchedulerType *scheduler, int fd,
+    SchedulerType::Event event)
+{
+    scheduler->registerEvent(fd, event);
+    Deadline::Registration deadline(boost::bind(&SchedulerType::cancelEvent,
+        scheduler, fd, event), scheduler);
+    Scheduler::yieldTo();
+    deadline.check();
+}
+#endif
+
 static void throwException(PGconn *conn)
 {
     const char *error = PQerrorMessage(conn);
@@ -337,12 +353,10 @@ Connection::connect()
                 << whatToPoll;
             switch (whatToPoll) {
                 case PGRES_POLLING_READING:
-                    m_scheduler->registerEvent(fd, SchedulerType::READ);
-                    Scheduler::yieldTo();
+                    waitFor(m_scheduler, fd, SchedulerType::READ);
                     break;
                 case PGRES_POLLING_WRITING:
-                    m_scheduler->registerEvent(fd, SchedulerType::WRITE);
-                    Scheduler::yieldTo();
+                    waitFor(m_scheduler, fd, SchedulerType::WRITE);
                     break;
                 case PGRES_POLLING_FAILED:
                     throwException(m_conn.get());
@@ -383,12 +397,10 @@ Connection::reset()
                 << whatToPoll;
             switch (whatToPoll) {
                 case PGRES_POLLING_READING:
-                    m_scheduler->registerEvent(fd, SchedulerType::READ);
-                    Scheduler::yieldTo();
+                    waitFor(m_scheduler, fd, SchedulerType::READ);
                     break;
                 case PGRES_POLLING_WRITING:
-                    m_scheduler->registerEvent(fd, SchedulerType::WRITE);
-                    Scheduler::yieldTo();
+                    waitFor(m_scheduler, fd, SchedulerType::WRITE);
                     break;
                 case PGRES_POLLING_FAILED:
                     throwException(m_conn.get());
@@ -465,8 +477,7 @@ static void flush(PGconn *conn, SchedulerType *scheduler)
             case -1:
                 throwException(conn);
             case 1:
-                scheduler->registerEvent(PQsocket(conn), SchedulerType::WRITE);
-                Scheduler::yieldTo();
+                waitFor(scheduler, PQsocket(conn), SchedulerType::WRITE);
                 continue;
             default:
                 MORDOR_NOTREACHED();
@@ -481,8 +492,7 @@ static PGresult *nextResult(PGconn *conn, SchedulerType *scheduler)
             throwException(conn);
         if (PQisBusy(conn)) {
             MORDOR_LOG_DEBUG(g_log) << conn << " PQisBusy()";
-            scheduler->registerEvent(PQsocket(conn), SchedulerType::READ);
-            Scheduler::yieldTo();
+            waitFor(scheduler, PQsocket(conn), SchedulerType::READ);
             continue;
         }
         MORDOR_LOG_DEBUG(g_log) << conn << " PQconsumeInput()";
@@ -686,9 +696,7 @@ public:
 #ifndef WINDOWS
                 case 0:
                     MORDOR_ASSERT(m_scheduler);
-                    m_scheduler->registerEvent(PQsocket(conn),
-                        SchedulerType::WRITE);
-                    Scheduler::yieldTo();
+                    waitFor(m_scheduler, PQsocket(conn), SchedulerType::WRITE);
                     break;
 #endif
                 default:
@@ -714,9 +722,7 @@ private:
 #ifndef WINDOWS
                 case 0:
                     MORDOR_ASSERT(m_scheduler);
-                    m_scheduler->registerEvent(PQsocket(conn),
-                        SchedulerType::WRITE);
-                    Scheduler::yieldTo();
+                    waitFor(m_scheduler, PQsocket(conn), SchedulerType::WRITE);
                     break;
 #endif
                 default:
@@ -797,9 +803,7 @@ public:
                     MORDOR_NOTREACHED();
 #else
                     MORDOR_ASSERT(m_scheduler);
-                    m_scheduler->registerEvent(PQsocket(conn),
-                        SchedulerType::READ);
-                    Scheduler::yieldTo();
+                    waitFor(m_scheduler, PQsocket(conn), SchedulerType::READ);
                     continue;
 #endif
                 case -1:
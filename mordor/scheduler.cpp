@@ -2,23 +2,97 @@
 
 #include "scheduler.h"
 
+#include <ostream>
+
 #include <boost/bind.hpp>
 
 #include "assert.h"
+#include "config.h"
 #include "fiber.h"
+#include "statistics.h"
 
 namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:scheduler");
 
+static ConfigVar<size_t>::ptr g_taskCacheSize = Config::lookup<size_t>(
+    "scheduler.taskcachesize", 1024u,
+    "Maximum number of free task nodes to keep around per Scheduler thread");
+static ConfigVar<size_t>::ptr g_runnerCacheSize = Config::lookup<size_t>(
+    "scheduler.runnercachesize", 8u,
+    "Maximum number of idle Fibers for running scheduled delegates to keep "
+    "around per Scheduler thread");
+
+static ConfigVar<std::string>::ptr g_affinity =
+    Config::lookup<std::string>("scheduler.affinity", "",
+    "Pin the threads a Scheduler spawns to a processor (cpu) or to a NUMA "
+    "node (node)");
+
+static ConfigVar<size_t>::ptr g_starvationLimit = Config::lookup<size_t>(
+    "scheduler.starvationlimit", 16u,
+    "Number of higher priority fibers/delegates a Scheduler thread will run "
+    "ahead of lower priority ones before running one of the lowest priority");
+
+static ConfigVar<bool>::ptr g_instrument = Config::lookup(
+    "scheduler.instrument", true,
+    "Time how long scheduled work waits to run, and how long each Scheduler "
+    "thread is busy and idle");
+
+static CountStatistic<size_t> &g_statTaskAllocs =
+    Statistics::registerStatistic("scheduler.taskallocs",
+    CountStatistic<size_t>("tasks"),
+    "Task nodes allocated from the heap (i.e. not reused)");
+static CountStatistic<size_t> &g_statRunnerAllocs =
+    Statistics::registerStatistic("scheduler.runnerallocs",
+    CountStatistic<size_t>("fibers"),
+    "Fibers allocated to run scheduled delegates on (i.e. not reused)");
+static CountStatistic<unsigned long long> &g_statRuns =
+    Statistics::registerStatistic("scheduler.runs",
+    CountStatistic<unsigned long long>("tasks"),
+    "Fibers and delegates run");
+static AverageStatistic<unsigned long long> &g_statQueueDepth =
+    Statistics::registerStatistic("scheduler.queuedepth",
+    AverageStatistic<unsigned long long>("tasks", "samples"),
+    "Depth of a thread's run queue when it takes work from it");
+static MaxStatistic<size_t> &g_statMaxQueueDepth =
+    Statistics::registerStatistic("scheduler.queuedepth.max",
+    MaxStatistic<size_t>("tasks"));
+static HistogramStatistic<unsigned long long> &g_statLatency =
+    Statistics::registerStatistic("scheduler.latency",
+    HistogramStatistic<unsigned long long>("us"),
+    "Time from being scheduled until running");
+static MaxStatistic<unsigned long long> &g_statMaxLatency =
+    Statistics::registerStatistic("scheduler.latency.max",
+    MaxStatistic<unsigned long long>("us"));
+static SumStatistic<unsigned long long> &g_statBusyTime =
+    Statistics::registerStatistic("scheduler.busytime",
+    SumStatistic<unsigned long long>("us"),
+    "Time Scheduler threads spent running work");
+static SumStatistic<unsigned long long> &g_statIdleTime =
+    Statistics::registerStatistic("scheduler.idletime",
+    SumStatistic<unsigned long long>("us"),
+    "Time Scheduler threads spent idle");
+static SumStatistic<unsigned long long> &g_statFiberCpuTime =
+    Statistics::registerStatistic("scheduler.fibercputime",
+    SumStatistic<unsigned long long>("us"),
+    "CPU time used by Fibers that finished (with fiber.cputime enabled)");
+
+// How many runs between reports from a thread that never goes idle
+static const unsigned long long REPORT_INTERVAL = 1024;
+
 ThreadLocalStorage<Scheduler *> Scheduler::t_scheduler;
 ThreadLocalStorage<Fiber *> Scheduler::t_fiber;
+ThreadLocalStorage<Scheduler::WorkQueue *> Scheduler::t_workQueue;
 
-Scheduler::Scheduler(size_t threads, bool useCaller, size_t batchSize)
-    : m_activeThreadCount(0),
+Scheduler::Scheduler(size_t threads, bool useCaller, size_t batchSize,
+    size_t firstThread)
+    : m_nextVictim(0),
+      m_activeThreadCount(0),
+      m_idleThreadCount(0),
       m_stopping(true),
       m_autoStop(false),
-      m_batchSize(batchSize)
+      m_batchSize(batchSize),
+      m_firstThread(firstThread)
 {
     MORDOR_ASSERT(threads >= 1);
     if (useCaller) {
@@ -29,6 +103,7 @@ Scheduler::Scheduler(size_t threads, bool useCaller, size_t batchSize)
         t_scheduler = this;
         t_fiber = m_rootFiber.get();
         m_rootThread = gettid();
+        t_workQueue = addWorkQueue(m_rootThread);
     } else {
         m_rootThread = emptytid();
     }
@@ -40,6 +115,51 @@ Scheduler::~Scheduler()
     MORDOR_ASSERT(m_stopping);
     if (getThis() == this) {
         t_scheduler = NULL;
+        t_workQueue = NULL;
+    }
+    m_fibers.clear();
+}
+
+void
+Scheduler::TaskList::clear()
+{
+    while (head) {
+        Task *task = head;
+        head = head->next;
+        delete task;
+    }
+    tail = NULL;
+    for (size_t i = 0; i < PRIORITIES; ++i)
+        tails[i] = NULL;
+    size = 0;
+    bypassed = 0;
+}
+
+Scheduler::ThreadStatistics::ThreadStatistics()
+    : thread(emptytid()),
+      runs(0),
+      queueDepth(0),
+      maxQueueDepth(0),
+      busyTime(0),
+      idleTime(0),
+      latency(0),
+      maxLatency(0),
+      fiberCpuTime(0),
+      queueDepthSum(0),
+      queueDepthSamples(0)
+{
+    for (size_t i = 0; i < HistogramStatistic<unsigned long long>::BUCKETS;
+        ++i)
+        latencyHistogram[i] = 0;
+}
+
+Scheduler::WorkQueue::~WorkQueue()
+{
+    fibers.clear();
+    while (freeTasks) {
+        Task *task = freeTasks;
+        freeTasks = freeTasks->next;
+        delete task;
     }
 }
 
@@ -66,7 +186,8 @@ Scheduler::start()
     m_threads.resize(m_threadCount);
     for (size_t i = 0; i < m_threadCount; ++i) {
         m_threads[i] = boost::shared_ptr<Thread>(new Thread(
-            boost::bind(&Scheduler::run, this)));
+            boost::bind(&Scheduler::threadMain, this, i)));
+        addWorkQueue(m_threads[i]->tid());
     }
 }
 
@@ -74,7 +195,58 @@ bool
 Scheduler::hasWorkToDo()
 {
     boost::mutex::scoped_lock lock(m_mutex);
-    return !m_fibers.empty();
+    return hasWorkToDoNoLock();
+}
+
+bool
+Scheduler::hasWorkToDoNoLock()
+{
+    if (!m_fibers.empty())
+        return true;
+    for (std::vector<boost::shared_ptr<WorkQueue> >::const_iterator it =
+        m_workQueues.begin(); it != m_workQueues.end(); ++it) {
+        boost::mutex::scoped_lock lock((*it)->mutex);
+        if (!(*it)->fibers.empty())
+            return true;
+    }
+    return false;
+}
+
+Scheduler::WorkQueue *
+Scheduler::addWorkQueue(tid_t thread)
+{
+    MORDOR_ASSERT(!workQueue(thread));
+    boost::shared_ptr<WorkQueue> queue(new WorkQueue(this, thread));
+    m_workQueues.push_back(queue);
+    return queue.get();
+}
+
+Scheduler::WorkQueue *
+Scheduler::workQueue(tid_t thread)
+{
+    for (std::vector<boost::shared_ptr<WorkQueue> >::const_iterator it =
+        m_workQueues.begin(); it != m_workQueues.end(); ++it) {
+        if ((*it)->thread == thread)
+            return it->get();
+    }
+    return NULL;
+}
+
+void
+Scheduler::removeWorkQueue(WorkQueue *queue)
+{
+    for (std::vector<boost::shared_ptr<WorkQueue> >::iterator it =
+        m_workQueues.begin(); it != m_workQueues.end(); ++it) {
+        if (it->get() == queue) {
+            // Anything left over goes back on the shared queue
+            boost::mutex::scoped_lock lock(queue->mutex);
+            m_fibers.splice(queue->fibers);
+            lock.unlock();
+            m_workQueues.erase(it);
+            return;
+        }
+    }
+    MORDOR_NOTREACHED();
 }
 
 void
@@ -105,7 +277,10 @@ Scheduler::stop()
                 << " switching to root thread to stop";
             switchTo(m_rootThread);
         }
-        if (!m_callingFiber)
+        // Nobody has yielded to the scheduler yet; if we're on the root
+        // thread we have to wait ourselves, otherwise whoever eventually
+        // yields to it (or destroys it) will
+        if (!m_callingFiber && gettid() == m_rootThread)
             exitOnThisFiber = true;
     } else {
         // A spawned-threads only scheduler cannot be stopped from within
@@ -150,31 +325,57 @@ bool
 Scheduler::stopping()
 {
     boost::mutex::scoped_lock lock(m_mutex);
-    return m_stopping && m_fibers.empty() && m_activeThreadCount == 0;
+    return m_stopping && !hasWorkToDoNoLock() && m_activeThreadCount == 0u;
 }
 
 void
 Scheduler::schedule(Fiber::ptr f, tid_t thread)
 {
-    bool tickleMe;
-    {
-        boost::mutex::scoped_lock lock(m_mutex);
-        tickleMe = scheduleNoLock(f, thread);
-    }
-    if (tickleMe && Scheduler::getThis() != this)
-        tickle();
+    MORDOR_LOG_DEBUG(g_log) << this << " scheduling " << f << " on thread "
+        << thread;
+    MORDOR_ASSERT(f);
+    MORDOR_ASSERT(f->priority() >= HIGH && f->priority() <= LOW);
+    Task *task = allocTask();
+    task->priority = (Priority)f->priority();
+    task->fiber.swap(f);
+    task->thread = thread;
+    enqueue(task);
 }
 
 void
 Scheduler::schedule(boost::function<void ()> dg, tid_t thread)
 {
-    bool tickleMe;
-    {
-        boost::mutex::scoped_lock lock(m_mutex);
-        tickleMe = scheduleNoLock(dg, thread);
-    }
-    if (tickleMe && Scheduler::getThis() != this)
-        tickle();
+    schedule(dg, thread, priority());
+}
+
+void
+Scheduler::schedule(boost::function<void ()> dg, tid_t thread,
+    Priority priority)
+{
+    MORDOR_LOG_DEBUG(g_log) << this << " scheduling " << dg << " on thread "
+        << thread << " at priority " << priority;
+    MORDOR_ASSERT(dg);
+    MORDOR_ASSERT(priority >= HIGH && priority <= LOW);
+    Task *task = allocTask();
+    task->dg.swap(dg);
+    task->thread = thread;
+    task->priority = priority;
+    enqueue(task);
+}
+
+Scheduler::Priority
+Scheduler::priority()
+{
+    // Don't create a Fiber for the thread just to ask
+    Fiber *fiber = Fiber::t_fiber.get();
+    return fiber ? (Priority)fiber->priority() : NORMAL;
+}
+
+void
+Scheduler::priority(Priority priority)
+{
+    MORDOR_ASSERT(priority >= HIGH && priority <= LOW);
+    Fiber::getThis()->priority(priority);
 }
 
 #ifdef DEBUG
@@ -189,34 +390,252 @@ static bool contains(const std::vector<boost::shared_ptr<Thread> >
 }
 #endif
 
+Scheduler::Task *
+Scheduler::allocTask()
+{
+    WorkQueue *queue = t_workQueue.get();
+    if (queue && queue->freeTasks) {
+        Task *task = queue->freeTasks;
+        queue->freeTasks = task->next;
+        --queue->freeTaskCount;
+        return task;
+    }
+    g_statTaskAllocs.increment();
+    return new Task();
+}
+
+void
+Scheduler::freeTask(Task *task)
+{
+    MORDOR_ASSERT(!task->fiber);
+    MORDOR_ASSERT(!task->dg);
+    // Tasks go back on the free list of whichever thread ran them
+    WorkQueue *queue = t_workQueue.get();
+    if (queue && queue->freeTaskCount < g_taskCacheSize->val()) {
+        task->next = queue->freeTasks;
+        queue->freeTasks = task;
+        ++queue->freeTaskCount;
+    } else {
+        delete task;
+    }
+}
+
+Fiber::ptr
+Scheduler::allocRunner(WorkQueue *queue)
+{
+    Fiber::ptr runner;
+    if (!queue->runners.empty()) {
+        runner.swap(queue->runners.back());
+        queue->runners.pop_back();
+        return runner;
+    }
+    g_statRunnerAllocs.increment();
+    runner.reset(new Fiber(&Scheduler::runDelegate));
+    return runner;
+}
+
+void
+Scheduler::freeRunner(WorkQueue *queue, Fiber::ptr &runner)
+{
+    MORDOR_ASSERT(runner->state() == Fiber::TERM);
+    if (queue->runners.size() < g_runnerCacheSize->val()) {
+        runner->reset();
+        queue->runners.push_back(Fiber::ptr());
+        queue->runners.back().swap(runner);
+    } else {
+        runner.reset();
+    }
+}
+
+void
+Scheduler::runDelegate()
+{
+    boost::function<void ()> dg;
+    dg.swap(t_workQueue->delegate);
+    MORDOR_ASSERT(dg);
+    dg();
+    // The delegate may have switched us to a different thread (or even
+    // Scheduler); let whoever is running us know that we're reusable
+    WorkQueue *queue = t_workQueue.get();
+    if (queue)
+        queue->finishedRunner = Fiber::getThis().get();
+}
+
+void
+Scheduler::enqueue(Task *task)
+{
+    task->scheduled = g_instrument->val() ? TimerManager::now() : 0;
+    WorkQueue *queue = t_workQueue.get();
+    if (queue && queue->scheduler == this &&
+        (task->thread == emptytid() || task->thread == queue->thread)) {
+        // Scheduled from one of our own threads; keep it on this thread's
+        // queue.  This thread will notice the work on its next trip through
+        // run(), but if some other thread is idle, wake it up so it can
+        // steal the work in case this thread is busy for a while
+        bool tickleMe;
+        {
+            boost::mutex::scoped_lock lock(queue->mutex);
+            tickleMe = queue->fibers.empty() &&
+                m_idleThreadCount > (queue->idle ? 1u : 0u);
+            queue->fibers.push_back(task);
+        }
+        if (tickleMe)
+            tickle();
+        return;
+    }
+    bool tickleMe;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        // Not thread-targeted, or this scheduler owns the targetted thread
+        MORDOR_ASSERT(task->thread == emptytid() ||
+            task->thread == m_rootThread || contains(m_threads, task->thread));
+        queue = task->thread == emptytid() ? NULL : workQueue(task->thread);
+        if (queue) {
+            boost::mutex::scoped_lock lock2(queue->mutex);
+            queue->fibers.push_back(task);
+            // The target thread won't notice unless it's woken up; tickle()
+            // doesn't target a thread, so any other thread that wakes up
+            // will keep tickling until the target thread is awake
+            if (queue->idle) {
+                lock2.unlock();
+                lock.unlock();
+                tickle();
+            }
+            return;
+        }
+        tickleMe = m_fibers.empty();
+        m_fibers.push_back(task);
+    }
+    if (tickleMe && Scheduler::getThis() != this)
+        tickle();
+}
+
 bool
-Scheduler::scheduleNoLock(Fiber::ptr f, tid_t thread)
+Scheduler::takeWork(TaskList &queue, std::vector<Task *> &batch,
+    tid_t owner, bool &dontIdle)
 {
-    MORDOR_LOG_DEBUG(g_log) << this << " scheduling " << f << " on thread "
-        << thread;
-    MORDOR_ASSERT(f);
-    // Not thread-targeted, or this scheduler owns the targetted thread
-    MORDOR_ASSERT(thread == emptytid() || thread == m_rootThread ||
-        contains(m_threads, thread));
-    FiberAndThread ft = {f, NULL, thread };
-    bool tickleMe = m_fibers.empty();
-    m_fibers.push_back(ft);
-    return tickleMe;
+    if (queue.bypassed >= g_starvationLimit->val() && !queue.empty() &&
+        queue.head->priority != queue.tail->priority) {
+        // The lowest priority work has waited long enough; give it a turn
+        queue.bypassed = 0;
+        Task *prev = queue.beforeLowest();
+        MORDOR_LOG_DEBUG(g_log) << this << " running starved priority "
+            << queue.tail->priority << " work";
+        if (takeWork(queue, prev, prev->next, batch, owner, dontIdle))
+            return true;
+    }
+    return takeWork(queue, NULL, queue.head, batch, owner, dontIdle);
 }
 
 bool
-Scheduler::scheduleNoLock(boost::function<void ()> dg, tid_t thread)
+Scheduler::takeWork(TaskList &queue, Task *prev, Task *task,
+    std::vector<Task *> &batch, tid_t owner, bool &dontIdle)
 {
-    MORDOR_LOG_DEBUG(g_log) << this << " scheduling " << dg << " on thread "
-        << thread;
-    MORDOR_ASSERT(dg);
-    // Not thread-targeted, or this scheduler owns the targetted thread
-    MORDOR_ASSERT(thread == emptytid() || thread == m_rootThread ||
-        contains(m_threads, thread));
-    FiberAndThread ft = {Fiber::ptr(), dg, thread };
-    bool tickleMe = m_fibers.empty();
-    m_fibers.push_back(ft);
-    return tickleMe;
+    while (task) {
+        if (task->thread != emptytid() && task->thread != owner) {
+            // Belongs to a specific thread, and it's not us
+            prev = task;
+            task = task->next;
+            continue;
+        }
+        MORDOR_ASSERT(task->fiber || task->dg);
+        // This fiber is still executing; probably just some race
+        // race condition that it needs to yield on one thread
+        // before running on another thread
+        if (task->fiber && task->fiber->state() == Fiber::EXEC) {
+            MORDOR_LOG_DEBUG(g_log) << this
+                << " skipping executing fiber " << task->fiber;
+            prev = task;
+            task = task->next;
+            dontIdle = true;
+            continue;
+        }
+        // We were just checking if there is more work; there is, so
+        // don't actually take this piece of work
+        if (batch.size() == m_batchSize)
+            return true;
+        batch.push_back(task);
+        bool bypassing = task->priority < queue.tail->priority;
+        task = queue.erase(prev, task);
+        if (bypassing)
+            ++queue.bypassed;
+        else
+            queue.bypassed = 0;
+    }
+    return false;
+}
+
+void
+Scheduler::reportStatistics(WorkQueue *queue)
+{
+    const ThreadStatistics &stats = queue->stats;
+    ThreadStatistics &reported = queue->reported;
+    if (stats.runs == reported.runs && stats.idleTime == reported.idleTime)
+        return;
+    g_statRuns.add(stats.runs - reported.runs);
+    g_statQueueDepth.count.add(stats.queueDepthSamples -
+        reported.queueDepthSamples);
+    g_statQueueDepth.sum.add(stats.queueDepthSum - reported.queueDepthSum);
+    g_statMaxQueueDepth.update(stats.maxQueueDepth);
+    for (size_t i = 0; i < HistogramStatistic<unsigned long long>::BUCKETS;
+        ++i)
+        g_statLatency.add(i, stats.latencyHistogram[i] -
+            reported.latencyHistogram[i]);
+    g_statMaxLatency.update(stats.maxLatency);
+    g_statBusyTime.add(stats.busyTime - reported.busyTime);
+    g_statIdleTime.add(stats.idleTime - reported.idleTime);
+    g_statFiberCpuTime.add(stats.fiberCpuTime - reported.fiberCpuTime);
+    reported = stats;
+}
+
+std::vector<Scheduler::ThreadStatistics>
+Scheduler::statistics()
+{
+    std::vector<ThreadStatistics> result;
+    boost::mutex::scoped_lock lock(m_mutex);
+    result.reserve(m_workQueues.size());
+    for (std::vector<boost::shared_ptr<WorkQueue> >::const_iterator it =
+        m_workQueues.begin(); it != m_workQueues.end(); ++it) {
+        result.push_back((*it)->stats);
+        result.back().thread = (*it)->thread;
+        boost::mutex::scoped_lock lock2((*it)->mutex);
+        result.back().queueDepth = (*it)->fibers.size;
+    }
+    return result;
+}
+
+std::ostream &
+Scheduler::dumpStatistics(std::ostream &os)
+{
+    std::vector<ThreadStatistics> stats = statistics();
+    for (std::vector<ThreadStatistics>::const_iterator it = stats.begin();
+        it != stats.end(); ++it) {
+        os << "thread " << it->thread << ": runs=" << it->runs
+            << " queue=" << it->queueDepth << " (avg "
+            << (it->queueDepthSamples ?
+                it->queueDepthSum / it->queueDepthSamples : 0)
+            << ", max " << it->maxQueueDepth << ") busy=" << it->busyTime
+            << "us idle=" << it->idleTime << "us latency=(avg "
+            << (it->runs ? it->latency / it->runs : 0) << "us, max "
+            << it->maxLatency << "us)";
+        if (it->fiberCpuTime)
+            os << " fibercpu=" << it->fiberCpuTime << "us";
+        os << std::endl;
+    }
+    return os;
+}
+
+void
+Scheduler::threadMain(size_t index)
+{
+    std::string affinity = g_affinity->val();
+    if (affinity == "cpu" || affinity == "node") {
+        pinThread(m_firstThread + index, affinity == "cpu");
+    } else if (!affinity.empty()) {
+        MORDOR_LOG_WARNING(g_log) << "unknown scheduler.affinity "
+            << affinity;
+    }
+    run();
 }
 
 void
@@ -278,9 +697,11 @@ Scheduler::threadCount(size_t threads)
         return;
     } else if (threads > m_threadCount) {
         m_threads.resize(threads);
-        for (size_t i = m_threadCount; i < threads; ++i)
+        for (size_t i = m_threadCount; i < threads; ++i) {
             m_threads[i] = boost::shared_ptr<Thread>(new Thread(
-            boost::bind(&Scheduler::run, this)));
+            boost::bind(&Scheduler::threadMain, this, i)));
+            addWorkQueue(m_threads[i]->tid());
+        }
     }
     m_threadCount = threads;
 }
@@ -310,23 +731,54 @@ Scheduler::run()
         // Hijacked a thread
         MORDOR_ASSERT(t_fiber.get() == Fiber::getThis().get());
     }
+    WorkQueue *queue;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        queue = workQueue(gettid());
+        if (queue)
+            queue->node = currentNumaNode();
+    }
+    MORDOR_ASSERT(queue);
+    t_workQueue = queue;
     Fiber::ptr idleFiber(new Fiber(boost::bind(&Scheduler::idle, this)));
     MORDOR_LOG_VERBOSE(g_log) << this << " starting thread with idle fiber " << idleFiber;
-    Fiber::ptr dgFiber;
+    ThreadStatistics &stats = queue->stats;
     // use a vector for O(1) .size()
-    std::vector<FiberAndThread> batch(m_batchSize);
+    std::vector<Task *> batch(m_batchSize);
     bool isActive = false;
     while (true) {
         batch.clear();
         bool dontIdle = false;
         bool tickleMe = false;
+        // Our own queue first; nobody else can take work scheduled
+        // specifically for this thread
+        // (We count ourselves active *before* removing anything from a
+        // queue, so that stopping() can't observe the work as being gone
+        // before it's observed as running)
         {
+            boost::mutex::scoped_lock lock(queue->mutex);
+            if (!queue->fibers.empty() && !isActive) {
+                ++m_activeThreadCount;
+                isActive = true;
+            }
+            size_t depth = queue->fibers.size;
+            tickleMe = takeWork(queue->fibers, batch, queue->thread,
+                dontIdle);
+            if (!batch.empty()) {
+                stats.queueDepthSum += depth;
+                ++stats.queueDepthSamples;
+                if (depth > stats.maxQueueDepth)
+                    stats.maxQueueDepth = depth;
+            }
+        }
+        if (batch.empty()) {
             boost::mutex::scoped_lock lock(m_mutex);
             // Kill ourselves off if needed
             if (m_threads.size() > m_threadCount && gettid() != m_rootThread) {
                 // Accounting
                 if (isActive)
                     --m_activeThreadCount;
+                reportStatistics(queue);
                 // Kill off the idle fiber
                 try {
                     throw boost::enable_current_exception(
@@ -334,6 +786,8 @@ Scheduler::run()
                 } catch(...) {
                     idleFiber->inject(boost::current_exception());
                 }
+                t_workQueue = NULL;
+                removeWorkQueue(queue);
                 // Detach our thread
                 for (std::vector<boost::shared_ptr<Thread> >
                     ::iterator it = m_threads.begin();
@@ -341,110 +795,168 @@ Scheduler::run()
                     ++it)
                     if ((*it)->tid() == gettid()) {
                         m_threads.erase(it);
-                        if (m_threads.size() > m_threadCount)
+                        if (m_threads.size() > m_threadCount ||
+                            !m_fibers.empty())
                             tickle();
                         return;
                     }
                 MORDOR_NOTREACHED();
             }
 
-            std::list<FiberAndThread>::iterator it(m_fibers.begin());
-            while (it != m_fibers.end()) {
-                // If we've met our batch size, and we're not checking to see
-                // if we need to tickle another thread, then break
-                if ( (tickleMe || m_activeThreadCount == threadCount()) &&
-                    batch.size() == m_batchSize)
-                    break;
-
-                if (it->thread != emptytid() && it->thread != gettid()) {
-                    MORDOR_LOG_DEBUG(g_log) << this
-                        << " skipping item scheduled for thread "
-                        << it->thread;
-
-                    // Wake up another thread to hopefully service this
-                    tickleMe = true;
-                    dontIdle = true;
-                    ++it;
+            // Then anything scheduled from outside the Scheduler
+            if (!m_fibers.empty() && !isActive) {
+                ++m_activeThreadCount;
+                isActive = true;
+            }
+            tickleMe = takeWork(m_fibers, batch, queue->thread, dontIdle);
+
+            // Then try to steal from the other threads, starting with those
+            // on our own NUMA node
+            for (size_t i = 0;
+                batch.empty() && i < 2 * m_workQueues.size();
+                ++i) {
+                WorkQueue *victim =
+                    m_workQueues[(m_nextVictim + i) % m_workQueues.size()]
+                    .get();
+                if (victim == queue ||
+                    (victim->node == queue->node) != (i < m_workQueues.size()))
                     continue;
-                }
-                MORDOR_ASSERT(it->fiber || it->dg);
-                // This fiber is still executing; probably just some race
-                // race condition that it needs to yield on one thread
-                // before running on another thread
-                if (it->fiber && it->fiber->state() == Fiber::EXEC) {
-                    MORDOR_LOG_DEBUG(g_log) << this
-                        << " skipping executing fiber " << it->fiber;
-                    ++it;
-                    dontIdle = true;
+                boost::mutex::scoped_lock lock2(victim->mutex);
+                if (victim->fibers.empty())
                     continue;
-                }
-                // We were just checking if there is more work; there is, so
-                // set the flag and don't actually take this piece of work
-                if (batch.size() == m_batchSize) {
-                    tickleMe = true;
-                    break;
-                }
-                batch.push_back(*it);
-                it = m_fibers.erase(it);
                 if (!isActive) {
                     ++m_activeThreadCount;
                     isActive = true;
                 }
+                tickleMe = takeWork(victim->fibers, batch, queue->thread,
+                    dontIdle) || tickleMe;
+                if (batch.empty() && victim->idle) {
+                    // Only the victim can run what's left, and it's
+                    // asleep; keep waking threads up until it notices
+                    MORDOR_LOG_DEBUG(g_log) << this
+                        << " skipping items scheduled for thread "
+                        << victim->thread;
+                    tickleMe = true;
+                    dontIdle = true;
+                }
+                if (!batch.empty())
+                    MORDOR_LOG_DEBUG(g_log) << this << " stole "
+                        << batch.size() << " fiber/dgs from thread "
+                        << victim->thread;
             }
-            if (batch.empty() && isActive) {
-                --m_activeThreadCount;
-                isActive = false;
-            }
+            ++m_nextVictim;
         }
-        if (tickleMe)
+        if (batch.empty() && isActive) {
+            --m_activeThreadCount;
+            isActive = false;
+        }
+        // Only bother waking another thread if there is one that isn't busy
+        if (tickleMe && (dontIdle || m_activeThreadCount < threadCount()))
             tickle();
         MORDOR_LOG_DEBUG(g_log) << this
             << " got " << batch.size() << " fiber/dgs to process (max: "
             << m_batchSize << ", active: " << isActive << ")";
         MORDOR_ASSERT(isActive == !batch.empty());
         if (!batch.empty()) {
-            std::vector<FiberAndThread>::iterator it;
+            unsigned long long batchStart = 0;
+            std::vector<Task *>::iterator it;
             for (it = batch.begin(); it != batch.end(); ++it) {
-                Fiber::ptr f = it->fiber;
-                boost::function<void ()> dg = it->dg;
+                Task *task = *it;
+                Fiber::ptr f;
+                f.swap(task->fiber);
+
+                ++stats.runs;
+                if (task->scheduled) {
+                    unsigned long long now = TimerManager::now();
+                    if (!batchStart)
+                        batchStart = now;
+                    unsigned long long latency =
+                        now > task->scheduled ? now - task->scheduled : 0;
+                    stats.latency += latency;
+                    if (latency > stats.maxLatency)
+                        stats.maxLatency = latency;
+                    ++stats.latencyHistogram[HistogramStatistic<
+                        unsigned long long>::bucket(latency)];
+                }
 
                 try {
                     if (f && f->state() != Fiber::TERM) {
                         MORDOR_LOG_DEBUG(g_log) << this << " running " << f;
+                        queue->finishedRunner = NULL;
+                        f->yieldTo();
+                        // A delegate that blocked has finished; if nobody
+                        // else cares about its Fiber, run something else on
+                        // it
+                        if (f->state() == Fiber::TERM ||
+                            f->state() == Fiber::EXCEPT)
+                            stats.fiberCpuTime += f->cpuTime();
+                        if (queue->finishedRunner == f.get() &&
+                            f->state() == Fiber::TERM && f.unique())
+                            freeRunner(queue, f);
+                    } else if (task->dg) {
+                        MORDOR_LOG_DEBUG(g_log) << this << " running "
+                            << task->dg;
+                        f = allocRunner(queue);
+                        f->priority(task->priority);
+                        queue->delegate.swap(task->dg);
                         f->yieldTo();
-                    } else if (dg) {
-                        if (!dgFiber)
-                            dgFiber.reset(new Fiber(dg));
-                        dgFiber->reset(dg);
-                        MORDOR_LOG_DEBUG(g_log) << this << " running " << dg;
-                        dgFiber->yieldTo();
-                        if (dgFiber->state() != Fiber::TERM)
-                            dgFiber.reset();
-                        else
-                            dgFiber->reset(NULL);
+                        // Otherwise it blocked; it will come back through
+                        // here as a plain Fiber when it's rescheduled
+                        if (f->state() == Fiber::TERM) {
+                            stats.fiberCpuTime += f->cpuTime();
+                            freeRunner(queue, f);
+                        }
                     }
                 } catch (...) {
                     MORDOR_LOG_FATAL(Log::root())
                         << boost::current_exception_diagnostic_information();
                     throw;
                 }
+                f.reset();
+                freeTask(task);
             }
+            if (batchStart)
+                stats.busyTime += TimerManager::now() - batchStart;
+            if (stats.runs - queue->reported.runs >= REPORT_INTERVAL)
+                reportStatistics(queue);
             continue;
         }
         if (dontIdle)
             continue;
 
+        reportStatistics(queue);
         if (idleFiber->state() == Fiber::TERM) {
             MORDOR_LOG_DEBUG(g_log) << this << " idle fiber terminated";
-            if (gettid() == m_rootThread)
+            if (gettid() == m_rootThread) {
                 m_callingFiber.reset();
+            } else {
+                boost::mutex::scoped_lock lock(m_mutex);
+                t_workQueue = NULL;
+                removeWorkQueue(queue);
+            }
             // Unblock the next thread
             if (threadCount() > 1)
                 tickle();
             return;
         }
+        {
+            // Last chance for someone to schedule something specifically for
+            // this thread before it goes to sleep; after this they'll tickle
+            boost::mutex::scoped_lock lock(queue->mutex);
+            if (!queue->fibers.empty())
+                continue;
+            queue->idle = true;
+            ++m_idleThreadCount;
+        }
         MORDOR_LOG_DEBUG(g_log) << this << " idling";
+        unsigned long long idleStart = g_instrument->val() ?
+            TimerManager::now() : 0;
         idleFiber->call();
+        if (idleStart)
+            stats.idleTime += TimerManager::now() - idleStart;
+        boost::mutex::scoped_lock lock(queue->mutex);
+        queue->idle = false;
+        --m_idleThreadCount;
     }
 }
 
@@ -3,12 +3,15 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
 #include <list>
+#include <vector>
 
 #include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
 
+#include "atomic.h"
+#include "statistics.h"
 #include "thread.h"
 #include "thread_local_storage.h"
 
@@ -28,9 +31,54 @@ class Fiber;
 /// there are no more Fibers scheduled, and return from yieldTo() or
 /// dispatch(). Hybrid and spawned Schedulers must be explicitly stopped via
 /// stop(). stop() will return only after there are no more Fibers scheduled.
+///
+/// Each thread of a Scheduler has its own run queue.  Work scheduled from
+/// one of the Scheduler's own threads goes on that thread's queue; work
+/// scheduled from outside the Scheduler goes on a shared queue.  Threads that
+/// run out of work steal from the shared queue and then from each other,
+/// except for work that was explicitly scheduled for a particular thread.
+///
+/// Scheduling from one of the Scheduler's own threads does not allocate in
+/// the steady state: queue entries are recycled per-thread, and delegates are
+/// run on a per-thread cache of Fibers (see the scheduler.taskallocs and
+/// scheduler.runnerallocs statistics).  Delegates that fit in
+/// boost::function's small object buffer are never copied to the heap.
+///
+/// With scheduler.affinity set, the threads a Scheduler spawns are pinned
+/// round-robin across NUMA nodes, either to a single processor ("cpu") or to
+/// all of a node's processors ("node").  Idle threads then prefer to steal
+/// work from threads on their own node, so Fibers (and their stacks) tend to
+/// stay on the node that created them.  The hijacked thread, if any, is
+/// never pinned.
+///
+/// Each thread keeps its own counters of how much work it has run, how deep
+/// its run queue got, how long work waited between schedule() and running,
+/// and how long it spent busy and idle (see statistics()).  They are only
+/// written by the owning thread, and are folded into the scheduler.*
+/// Statistics whenever the thread goes idle (or every so often if it
+/// doesn't), so they can be left on in production; scheduler.instrument
+/// turns off the timing, which is the only part that isn't free.
+///
+/// Work is run in priority order (HIGH, then NORMAL, then LOW), and in FIFO
+/// order within a priority.  A Fiber is always scheduled at its own
+/// Fiber::priority(), so it keeps its priority when it is woken up by a
+/// FiberMutex, an IOManager event, etc.; a delegate runs at the priority of
+/// whoever scheduled it, unless one is given explicitly.  To keep a steady
+/// stream of higher priority work from starving lower priority work, once
+/// scheduler.starvationlimit Tasks have been taken from a queue ahead of
+/// lower priority work, the oldest of the lowest priority work is run next.
 class Scheduler : public boost::noncopyable
 {
 public:
+    enum Priority
+    {
+        /// Latency sensitive work, such as health checks
+        HIGH = -1,
+        NORMAL = 0,
+        /// Bulk work, such as large transfers
+        LOW = 1
+    };
+
     /// Default constructor
 
     /// By default, a single-threaded hijacking Scheduler is constructed.
@@ -42,8 +90,11 @@ public:
     /// executing thread
     /// @param batchSize Number of operations to pull off the scheduler queue
     /// on every iteration
+    /// @param firstThread Where the spawned threads start in the
+    /// scheduler.affinity round-robin, so several Schedulers can share it
     /// @pre if (useCaller == true) Scheduler::getThis() == NULL
-    Scheduler(size_t threads = 1, bool useCaller = true, size_t batchSize = 1);
+    Scheduler(size_t threads = 1, bool useCaller = true, size_t batchSize = 1,
+        size_t firstThread = 0);
     /// Destroys the scheduler, implicitly calling stop()
     virtual ~Scheduler();
 
@@ -84,6 +135,15 @@ public:
     /// @param thread Optionally provide a specific thread for the functor to
     /// run on
     void schedule(boost::function<void ()> dg, tid_t thread = emptytid());
+    /// Schedule a generic functor to be executed on the Scheduler, at a
+    /// particular priority
+
+    /// @param dg The functor to schedule
+    /// @param thread A specific thread for the functor to run on, or
+    /// emptytid()
+    /// @param priority The priority the functor's Fiber runs at
+    void schedule(boost::function<void ()> dg, tid_t thread,
+        Priority priority);
 
     /// Schedule multiple items to be executed at once
 
@@ -92,16 +152,10 @@ public:
     template <class InputIterator>
     void schedule(InputIterator begin, InputIterator end)
     {
-        bool tickleMe = false;
-        {
-            boost::mutex::scoped_lock lock(m_mutex);
-            while (begin != end) {
-                tickleMe = scheduleNoLock(*begin) || tickleMe;
-                ++begin;
-            }
+        while (begin != end) {
+            schedule(*begin);
+            ++begin;
         }
-        if (tickleMe && Scheduler::getThis() != this)
-            tickle();
     }
 
     /// Change the currently executing Fiber to be running on this Scheduler
@@ -130,6 +184,13 @@ public:
     /// @pre Scheduler::getThis() != NULL
     static void yield();
 
+    /// @return The priority of the currently executing Fiber
+    static Priority priority();
+    /// Change the priority of the currently executing Fiber
+
+    /// Takes effect the next time it is scheduled (including being woken up)
+    static void priority(Priority priority);
+
     /// Force a hijacking Scheduler to process scheduled work
 
     /// Calls yieldTo(), and yields back to the currently executing Fiber
@@ -144,6 +205,41 @@ public:
     /// Change the number of threads in this scheduler
     void threadCount(size_t threads);
 
+    /// Counters for a single thread of a Scheduler
+    struct ThreadStatistics
+    {
+        ThreadStatistics();
+
+        tid_t thread;
+        /// Fibers and delegates run
+        unsigned long long runs;
+        /// Work waiting in this thread's run queue
+        size_t queueDepth;
+        /// The deepest this thread's run queue has been when it took work
+        size_t maxQueueDepth;
+        /// Time spent running work, and in the idle Fiber (us)
+        unsigned long long busyTime, idleTime;
+        /// Total and worst time from schedule() until running (us)
+        unsigned long long latency, maxLatency;
+        /// Count of latencies, by HistogramStatistic bucket
+        size_t latencyHistogram[HistogramStatistic<unsigned long long>
+            ::BUCKETS];
+        /// CPU time used by Fibers that finished on this thread, if
+        /// fiber.cputime is enabled (us)
+        unsigned long long fiberCpuTime;
+
+        /// Depth samples, for the average queue depth
+        unsigned long long queueDepthSum, queueDepthSamples;
+    };
+
+    /// Snapshot the counters of each of this Scheduler's threads
+
+    /// The counters of threads other than the calling one may be slightly
+    /// out of date.
+    std::vector<ThreadStatistics> statistics();
+    /// Write statistics() in a human readable form
+    std::ostream &dumpStatistics(std::ostream &os);
+
 protected:
     /// Derived classes can query stopping() to see if the Scheduler is trying
     /// to stop, and should return from the idle Fiber as soon as possible.
@@ -167,32 +263,203 @@ protected:
     bool hasWorkToDo();
 
 private:
-    void yieldTo(bool yieldToCallerOnTerminate);
-    void run();
-
-    bool scheduleNoLock(boost::shared_ptr<Fiber> fiber,
-        tid_t thread = emptytid());
-    bool scheduleNoLock(boost::function<void ()> dg,
-        tid_t thread = emptytid());
-
-private:
-    struct FiberAndThread {
+    /// A unit of scheduled work
+    ///
+    /// Tasks are linked intrusively into run queues, and recycled through a
+    /// per-thread free list, so that scheduling from one of the Scheduler's
+    /// own threads doesn't need to allocate
+    struct Task
+    {
         boost::shared_ptr<Fiber> fiber;
         boost::function<void ()> dg;
         tid_t thread;
+        /// When this was scheduled, if scheduler.instrument is enabled
+        unsigned long long scheduled;
+        Priority priority;
+        Task *next;
     };
+
+    enum { PRIORITIES = LOW - HIGH + 1 };
+
+    /// Intrusive list of Tasks, in priority order, and FIFO within a
+    /// priority
+    struct TaskList
+    {
+        TaskList()
+            : head(NULL),
+              tail(NULL),
+              size(0),
+              bypassed(0)
+        {
+            for (size_t i = 0; i < PRIORITIES; ++i)
+                tails[i] = NULL;
+        }
+
+        bool empty() const { return head == NULL; }
+
+        /// Add task after the rest of the Tasks of its priority
+        void push_back(Task *task)
+        {
+            int index = task->priority - HIGH;
+            Task *prev = NULL;
+            for (int i = index; i >= 0 && !prev; --i)
+                prev = tails[i];
+            if (prev) {
+                task->next = prev->next;
+                prev->next = task;
+            } else {
+                task->next = head;
+                head = task;
+            }
+            if (!task->next)
+                tail = task;
+            tails[index] = task;
+            ++size;
+        }
+
+        /// Unlink task (which follows prev, or is the head if prev is NULL)
+        /// @return The Task that followed task
+        Task *erase(Task *prev, Task *task)
+        {
+            Task *next = task->next;
+            if (prev)
+                prev->next = next;
+            else
+                head = next;
+            if (tail == task)
+                tail = prev;
+            int index = task->priority - HIGH;
+            if (tails[index] == task)
+                tails[index] = prev && prev->priority == task->priority ?
+                    prev : NULL;
+            --size;
+            return next;
+        }
+
+        /// Move all of other's Tasks to this list
+        void splice(TaskList &other)
+        {
+            while (other.head) {
+                Task *task = other.head;
+                other.erase(NULL, task);
+                push_back(task);
+            }
+        }
+
+        /// The Task before the first one of the lowest priority present
+        /// @pre !empty()
+        Task *beforeLowest() const
+        {
+            for (int i = tail->priority - HIGH - 1; i >= 0; --i)
+                if (tails[i])
+                    return tails[i];
+            return NULL;
+        }
+
+        /// Delete all Tasks in the list
+        void clear();
+
+        Task *head, *tail;
+        /// The last Task of each priority
+        Task *tails[PRIORITIES];
+        size_t size;
+        /// How many Tasks have been taken ahead of lower priority Tasks
+        /// since a Task of the lowest priority present was last taken
+        size_t bypassed;
+    };
+
+    /// Per-thread run queue; owned by m_workQueues
+    struct WorkQueue : boost::noncopyable
+    {
+        WorkQueue(Scheduler *scheduler_, tid_t thread_)
+            : scheduler(scheduler_),
+              thread(thread_),
+              idle(false),
+              freeTasks(NULL),
+              freeTaskCount(0),
+              finishedRunner(NULL),
+              node(0)
+        {}
+        ~WorkQueue();
+
+        Scheduler *scheduler;
+        tid_t thread;
+        boost::mutex mutex;
+        TaskList fibers;
+        /// The owning thread is (about to be) in the idle Fiber
+        bool idle;
+
+        // The rest is only ever touched by the owning thread, so it isn't
+        // protected by mutex
+        Task *freeTasks;
+        size_t freeTaskCount;
+        /// Spare Fibers for running delegates on
+        std::vector<boost::shared_ptr<Fiber> > runners;
+        /// The delegate that the next runner Fiber to start should run
+        boost::function<void ()> delegate;
+        /// The runner Fiber that most recently finished on this thread
+        Fiber *finishedRunner;
+        /// The NUMA node the owning thread (last) ran on
+        size_t node;
+        ThreadStatistics stats;
+        /// stats as of the last time they were added to the Statistics
+        ThreadStatistics reported;
+    };
+
+private:
+    void yieldTo(bool yieldToCallerOnTerminate);
+    void run();
+    /// Entry point of the index'th thread spawned by this Scheduler
+    void threadMain(size_t index);
+
+    static Task *allocTask();
+    static void freeTask(Task *task);
+    static boost::shared_ptr<Fiber> allocRunner(WorkQueue *queue);
+    static void freeRunner(WorkQueue *queue, boost::shared_ptr<Fiber> &runner);
+    static void runDelegate();
+    /// Add what queue's counters have accumulated since last time to the
+    /// global Statistics
+    static void reportStatistics(WorkQueue *queue);
+
+    void enqueue(Task *task);
+    /// @pre m_mutex is locked
+    WorkQueue *addWorkQueue(tid_t thread);
+    /// @pre m_mutex is locked
+    WorkQueue *workQueue(tid_t thread);
+    /// @pre m_mutex is locked
+    void removeWorkQueue(WorkQueue *queue);
+    /// @pre m_mutex is locked
+    bool hasWorkToDoNoLock();
+    /// Move up to m_batchSize runnable items from the front of queue (or from
+    /// the lowest priority work, if it's starving) to batch
+    /// @return If there is still runnable work left in queue
+    bool takeWork(TaskList &queue, std::vector<Task *> &batch, tid_t owner,
+        bool &dontIdle);
+    /// Move up to m_batchSize runnable items, starting with task (which
+    /// follows prev, or is the head if prev is NULL), to batch
+    /// @return If there is still runnable work left in queue
+    bool takeWork(TaskList &queue, Task *prev, Task *task,
+        std::vector<Task *> &batch, tid_t owner, bool &dontIdle);
+
+private:
     static ThreadLocalStorage<Scheduler *> t_scheduler;
     static ThreadLocalStorage<Fiber *> t_fiber;
+    static ThreadLocalStorage<WorkQueue *> t_workQueue;
     boost::mutex m_mutex;
-    std::list<FiberAndThread> m_fibers;
+    // Work scheduled from outside of this Scheduler's threads
+    TaskList m_fibers;
+    std::vector<boost::shared_ptr<WorkQueue> > m_workQueues;
+    size_t m_nextVictim;
     tid_t m_rootThread;
     boost::shared_ptr<Fiber> m_rootFiber;
     boost::shared_ptr<Fiber> m_callingFiber;
     std::vector<boost::shared_ptr<Thread> > m_threads;
-    size_t m_threadCount, m_activeThreadCount;
+    size_t m_threadCount;
+    Atomic<size_t> m_activeThreadCount, m_idleThreadCount;
     bool m_stopping;
     bool m_autoStop;
     size_t m_batchSize;
+    size_t m_firstThread;
 };
 
 /// Automatic Scheduler switcher
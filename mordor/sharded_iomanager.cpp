@@ -0,0 +1,74 @@
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include "sharded_iomanager.h"
+
+#include "log.h"
+#include "thread.h"
+
+namespace Mordor {
+
+static Logger::ptr g_log = Log::lookup("mordor:iomanager:sharded");
+
+ShardedIOManager::ShardedIOManager(size_t shards)
+{
+    if (shards == 0)
+        shards = processorCount();
+    m_shards.resize(shards);
+    // Each shard's only thread would otherwise be pinned as the first thread
+    // of its own Scheduler
+    for (size_t i = 0; i < shards; ++i)
+        m_shards[i].reset(new IOManager(1, false, i));
+    MORDOR_LOG_VERBOSE(g_log) << this << " started " << shards << " shards";
+}
+
+ShardedIOManager::~ShardedIOManager()
+{
+    stop();
+}
+
+IOManager &
+ShardedIOManager::local()
+{
+    Scheduler *scheduler = Scheduler::getThis();
+    for (size_t i = 0; i < m_shards.size(); ++i)
+        if (m_shards[i].get() == scheduler)
+            return *m_shards[i];
+    return next();
+}
+
+IOManager &
+ShardedIOManager::next()
+{
+    return *m_shards[m_next++ % m_shards.size()];
+}
+
+std::vector<Socket::ptr>
+ShardedIOManager::listen(Address::ptr address, int backlog)
+{
+    std::vector<Socket::ptr> result;
+#ifdef SO_REUSEPORT
+    size_t count = m_shards.size();
+#else
+    size_t count = 1;
+#endif
+    for (size_t i = 0; i < count; ++i) {
+        Socket::ptr socket = address->createSocket(*m_shards[i]);
+        socket->setOption(SOL_SOCKET, SO_REUSEADDR, 1);
+#ifdef SO_REUSEPORT
+        socket->setOption(SOL_SOCKET, SO_REUSEPORT, 1);
+#endif
+        socket->bind(address);
+        socket->listen(backlog);
+        result.push_back(socket);
+    }
+    return result;
+}
+
+void
+ShardedIOManager::stop()
+{
+    for (size_t i = 0; i < m_shards.size(); ++i)
+        m_shards[i]->stop();
+}
+
+}
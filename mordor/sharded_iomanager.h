@@ -0,0 +1,62 @@
+#ifndef __MORDOR_SHARDED_IOMANAGER_H__
+#define __MORDOR_SHARDED_IOMANAGER_H__
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "atomic.h"
+#include "iomanager.h"
+#include "socket.h"
+
+namespace Mordor {
+
+/// A set of independent single-threaded IOManagers
+
+/// A multi-threaded IOManager shares one event loop (and its bookkeeping)
+/// among all of its threads.  A ShardedIOManager instead runs a separate
+/// IOManager, with its own event loop and thread, per shard, so the shards
+/// never contend with each other.  A Socket (and anything scheduled on its
+/// behalf) stays on the shard it was created on.
+///
+/// If scheduler.affinity is set, shards are pinned round-robin across NUMA
+/// nodes in the same way as the threads of a single Scheduler.
+class ShardedIOManager : boost::noncopyable
+{
+public:
+    /// @param shards Number of shards; 0 means one per processor
+    ShardedIOManager(size_t shards = 0);
+    /// Implicitly calls stop()
+    ~ShardedIOManager();
+
+    size_t shards() const { return m_shards.size(); }
+    IOManager &shard(size_t index) { return *m_shards[index]; }
+    /// @return The shard the calling Fiber is running on, or the next() one
+    /// if it isn't running on any of them
+    IOManager &local();
+    /// @return Each of the shards in turn
+    IOManager &next();
+
+    /// Create a listening Socket on each shard, all bound to address
+    /// @details
+    /// The sockets are bound with SO_REUSEPORT, so the kernel spreads incoming
+    /// connections across them, and Sockets accepted from each stay on its
+    /// shard.  Where SO_REUSEPORT is not available, a single Socket is
+    /// returned, bound on the first shard.
+    /// @return The listening Sockets; the i'th belongs to shard(i)
+    std::vector<Socket::ptr> listen(Address::ptr address,
+        int backlog = SOMAXCONN);
+
+    /// Stop every shard
+    void stop();
+
+private:
+    std::vector<boost::shared_ptr<IOManager> > m_shards;
+    Atomic<size_t> m_next;
+};
+
+}
+
+#endif
@@ -5,8 +5,10 @@
 #include <boost/bind.hpp>
 
 #include "assert.h"
+#include "deadline.h"
 #include "fiber.h"
 #include "iomanager.h"
+#include "offload.h"
 #include "string.h"
 #include "version.h"
 
@@ -161,6 +163,14 @@ static struct IOSInitializer {
 } g_iosInit;
 }
 
+// A timer of the operation's own is only needed if it would fire before the
+// current Fiber's Deadline (which has a single timer for every operation)
+static bool
+needTimer(unsigned long long timeout)
+{
+    return timeout != ~0ull && timeout < Deadline::timeLeft();
+}
+
 Socket::Socket(IOManager *ioManager, int family, int type, int protocol, int initialize)
 : m_sock(-1),
   m_family(family),
@@ -259,6 +269,15 @@ Socket::Socket(IOManager &ioManager, int family, int type, int protocol)
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("setsockopt");
     }
 #endif
+#ifdef LINUX
+    // We always retry after EAGAIN, so we can stay in the epoll set; but with
+    // io_uring, staying there would wake epoll for every arrival that already
+    // completes through the ring, so only wait for readiness when asked to
+#ifdef IO_URING
+    if (!m_ioManager->asyncIo())
+#endif
+        m_ioManager->registerFd(m_sock);
+#endif
 }
 
 Socket::~Socket()
@@ -274,6 +293,10 @@ Socket::~Socket()
 #else
     if (m_isRegisteredForRemoteClose)
         m_ioManager->unregisterEvent(m_sock, IOManager::CLOSE);
+#endif
+#ifdef LINUX
+    if (m_ioManager && m_sock != -1)
+        m_ioManager->unregisterFd(m_sock);
 #endif
     if (m_sock != -1) {
         int rc = ::closesocket(m_sock);
@@ -384,9 +407,12 @@ Socket::connect(const Address &to)
                     MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledSend, "ConnectEx");
                 }
                 Timer::ptr timeout;
-                if (m_sendTimeout != ~0ull)
+                if (needTimer(m_sendTimeout))
                     timeout = m_ioManager->registerTimer(m_sendTimeout, boost::bind(
                         &IOManager::cancelEvent, m_ioManager, (HANDLE)m_sock, &m_sendEvent));
+                Deadline::Registration deadline(boost::bind(
+                    &IOManager::cancelEvent, m_ioManager, (HANDLE)m_sock,
+                    &m_sendEvent), m_ioManager);
                 Scheduler::yieldTo();
                 if (timeout)
                     timeout->cancel();
@@ -431,10 +457,12 @@ suckylsp:
                     MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledSend, "connect");
                 }
                 Timer::ptr timeout;
-                if (m_sendTimeout != ~0ull)
+                if (needTimer(m_sendTimeout))
                     timeout = m_ioManager->registerTimer(m_sendTimeout,
                         boost::bind(&Socket::cancelIo, this,
                             boost::ref(m_cancelledSend), WSAETIMEDOUT));
+                Deadline::Registration deadline(boost::bind(&Socket::cancelIo,
+                    this, boost::ref(m_cancelledSend), _1), m_ioManager);
                 Scheduler::yieldTo();
                 m_fiber.reset();
                 m_scheduler = NULL;
@@ -470,13 +498,41 @@ suckylsp:
             }
         }
 #else
-        if (!::connect(m_sock, to.name(), to.nameLen())) {
+        int rc;
+#ifdef IO_URING
+        if (m_ioManager->asyncIo()) {
+            io_uring_sqe sqe;
+            memset(&sqe, 0, sizeof(io_uring_sqe));
+            sqe.opcode = IORING_OP_CONNECT;
+            sqe.fd = m_sock;
+            sqe.addr = (uintptr_t)to.name();
+            sqe.off = to.nameLen();
+            Deadline::Registration deadline(boost::bind(&Socket::cancelIo,
+                this, IOManager::WRITE, boost::ref(m_cancelledSend), _1));
+            rc = m_ioManager->performIo(m_sock, IOManager::WRITE, sqe,
+                std::min(m_sendTimeout, Deadline::timeLeft()));
+            if (rc == -ETIMEDOUT && !m_cancelledSend)
+                m_cancelledSend = ETIMEDOUT;
+            // A cancel that lost the race with completion doesn't undo it
+            if (rc == -ECANCELED || rc == -ETIMEDOUT) {
+                error_t error = m_cancelledSend ? m_cancelledSend : -rc;
+                MORDOR_LOG_ERROR(g_log) << this << " connect(" << m_sock << ", " << to
+                    << "): (" << error << ")";
+                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "connect");
+            }
+            if (rc < 0) {
+                errno = -rc;
+                rc = -1;
+            }
+        } else
+#endif
+        rc = ::connect(m_sock, to.name(), to.nameLen());
+        if (!rc) {
+            // Worked first time
             MORDOR_LOG_INFO(g_log) << this << " connect(" << m_sock << ", " << to
                 << ")";
-            // Worked first time
-            return;
-        }
-        if (errno == EINPROGRESS) {
+        } else if (errno == EINPROGRESS || errno == EAGAIN) {
+            // (io_uring can give back either, depending on the kernel)
             m_ioManager->registerEvent(m_sock, IOManager::WRITE);
             if (m_cancelledSend) {
                 MORDOR_LOG_ERROR(g_log) << this << " connect(" << m_sock << ", " << to
@@ -486,10 +542,13 @@ suckylsp:
                 MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledSend, "connect");
             }
             Timer::ptr timeout;
-            if (m_sendTimeout != ~0ull)
+            if (needTimer(m_sendTimeout))
                 timeout = m_ioManager->registerTimer(m_sendTimeout, boost::bind(
                     &Socket::cancelIo, this, IOManager::WRITE,
                     boost::ref(m_cancelledSend), ETIMEDOUT));
+            Deadline::Registration deadline(boost::bind(&Socket::cancelIo,
+                this, IOManager::WRITE, boost::ref(m_cancelledSend), _1),
+                m_ioManager);
             Scheduler::yieldTo();
             if (timeout)
                 timeout->cancel();
@@ -594,9 +653,12 @@ Socket::accept(Socket &target)
                     MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledReceive, "AcceptEx");
                 }
                 Timer::ptr timeout;
-                if (m_receiveTimeout != ~0ull)
+                if (needTimer(m_receiveTimeout))
                     timeout = m_ioManager->registerTimer(m_receiveTimeout, boost::bind(
                         &IOManager::cancelEvent, m_ioManager, (HANDLE)m_sock, &m_receiveEvent));
+                Deadline::Registration deadline(boost::bind(
+                    &IOManager::cancelEvent, m_ioManager, (HANDLE)m_sock,
+                    &m_receiveEvent), m_ioManager);
                 Scheduler::yieldTo();
                 if (timeout)
                     timeout->cancel();
@@ -659,10 +721,12 @@ suckylsp:
                 }
                 m_unregistered = false;
                 Timer::ptr timeout;
-                if (m_receiveTimeout != ~0ull)
+                if (needTimer(m_receiveTimeout))
                     timeout = m_ioManager->registerTimer(m_sendTimeout,
                         boost::bind(&Socket::cancelIo, this,
                         boost::ref(m_cancelledReceive), WSAETIMEDOUT));
+                Deadline::Registration deadline(boost::bind(&Socket::cancelIo,
+                    this, boost::ref(m_cancelledReceive), _1), m_ioManager);
                 Scheduler::yieldTo();
                 m_fiber.reset();
                 m_scheduler = NULL;
@@ -703,7 +767,35 @@ suckylsp:
                     FILE_SKIP_SET_EVENT_ON_HANDLE);
         }
 #else
-        int newsock = ::accept(m_sock, NULL, NULL);
+        int newsock;
+#ifdef IO_URING
+        if (m_ioManager->asyncIo()) {
+            io_uring_sqe sqe;
+            memset(&sqe, 0, sizeof(io_uring_sqe));
+            sqe.opcode = IORING_OP_ACCEPT;
+            sqe.fd = m_sock;
+            Deadline::Registration deadline(boost::bind(&Socket::cancelIo,
+                this, IOManager::READ, boost::ref(m_cancelledReceive), _1));
+            newsock = m_ioManager->performIo(m_sock, IOManager::READ, sqe,
+                std::min(m_receiveTimeout, Deadline::timeLeft()));
+            if (newsock == -ETIMEDOUT && !m_cancelledReceive)
+                m_cancelledReceive = ETIMEDOUT;
+            // A cancel that lost the race with completion doesn't undo it;
+            // the new socket is still ours to adopt (or close)
+            if (newsock == -ECANCELED || newsock == -ETIMEDOUT) {
+                error_t error = m_cancelledReceive ? m_cancelledReceive :
+                    -newsock;
+                MORDOR_LOG_ERROR(g_log) << this << " accept(" << m_sock
+                    << "): (" << error << ")";
+                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "accept");
+            }
+            if (newsock < 0) {
+                errno = -newsock;
+                newsock = -1;
+            }
+        } else
+#endif
+        newsock = ::accept(m_sock, NULL, NULL);
         while (newsock == -1 && errno == EAGAIN) {
             m_ioManager->registerEvent(m_sock, IOManager::READ);
             if (m_cancelledReceive) {
@@ -714,10 +806,13 @@ suckylsp:
                 MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledReceive, "accept");
             }
             Timer::ptr timeout;
-            if (m_receiveTimeout != ~0ull)
+            if (needTimer(m_receiveTimeout))
                 timeout = m_ioManager->registerTimer(m_receiveTimeout, boost::bind(
                     &Socket::cancelIo, this, IOManager::READ,
                     boost::ref(m_cancelledReceive), ETIMEDOUT));
+            Deadline::Registration deadline(boost::bind(&Socket::cancelIo,
+                this, IOManager::READ, boost::ref(m_cancelledReceive), _1),
+                m_ioManager);
             Scheduler::yieldTo();
             if (timeout)
                 timeout->cancel();
@@ -739,6 +834,14 @@ suckylsp:
             MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("fcntl");
         }
         target.m_sock = newsock;
+#ifdef LINUX
+        if (target.m_ioManager
+#ifdef IO_URING
+            && !target.m_ioManager->asyncIo()
+#endif
+            )
+            target.m_ioManager->registerFd(newsock);
+#endif
 #endif
         target.m_isConnected = true;
         if (!target.m_onRemoteClose.empty())
@@ -868,10 +971,13 @@ Socket::doIO(iovec *buffers, size_t length, int &flags, Address *address)
             m_ioManager->unregisterEvent(&event);
         } else {
             Timer::ptr timer;
-            if (timeout != ~0ull)
+            if (needTimer(timeout))
                 timer = m_ioManager->registerTimer(timeout, boost::bind(
                     &IOManager::cancelEvent, m_ioManager, (HANDLE)m_sock,
                     &event));
+            Deadline::Registration deadline(boost::bind(
+                &IOManager::cancelEvent, m_ioManager, (HANDLE)m_sock, &event),
+                m_ioManager);
             Scheduler::yieldTo();
             if (timer)
                 timer->cancel();
@@ -907,14 +1013,46 @@ Socket::doIO(iovec *buffers, size_t length, int &flags, Address *address)
             MORDOR_THROW_EXCEPTION_FROM_ERROR_API(cancelled, api);
         }
     }
-    int rc = isSend ? sendmsg(m_sock, &msg, flags) : recvmsg(m_sock, &msg, flags);
+    int rc;
+#ifdef IO_URING
+    if (m_ioManager && m_ioManager->asyncIo()) {
+        // One trip into the kernel, instead of waiting for readiness first
+        io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(io_uring_sqe));
+        sqe.opcode = isSend ? IORING_OP_SENDMSG : IORING_OP_RECVMSG;
+        sqe.fd = m_sock;
+        sqe.addr = (uintptr_t)&msg;
+        sqe.len = 1;
+        sqe.msg_flags = flags;
+        Deadline::Registration deadline(boost::bind(&Socket::cancelIo, this,
+            event, boost::ref(cancelled), _1));
+        rc = m_ioManager->performIo(m_sock, event, sqe,
+            std::min(timeout, Deadline::timeLeft()));
+        if (rc == -ETIMEDOUT && !cancelled)
+            cancelled = ETIMEDOUT;
+        // A cancel that lost the race with completion doesn't undo it; the
+        // bytes were already transferred
+        if (rc == -ECANCELED || rc == -ETIMEDOUT) {
+            error_t error = cancelled ? cancelled : -rc;
+            MORDOR_SOCKET_LOG(-1, error);
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, api);
+        }
+        if (rc < 0) {
+            errno = -rc;
+            rc = -1;
+        }
+    } else
+#endif
+    rc = isSend ? sendmsg(m_sock, &msg, flags) : recvmsg(m_sock, &msg, flags);
     while (m_ioManager && rc == -1 && errno == EAGAIN) {
         m_ioManager->registerEvent(m_sock, event);
         Timer::ptr timer;
-        if (timeout != ~0ull)
+        if (needTimer(timeout))
             timer = m_ioManager->registerTimer(timeout, boost::bind(
                 &Socket::cancelIo, this, event, boost::ref(cancelled),
                 ETIMEDOUT));
+        Deadline::Registration deadline(boost::bind(&Socket::cancelIo, this,
+            event, boost::ref(cancelled), _1), m_ioManager);
         Scheduler::yieldTo();
         if (timer)
             timer->cancel();
@@ -1291,7 +1429,10 @@ Address::lookup(const std::string &host, int family, int type, int protocol)
     }
     error = pGetAddrInfoW(toUtf16(node).c_str(), serviceW, &hints, &results);
 #else
-    error = getaddrinfo(node.c_str(), service, &hints, &results);
+    // getaddrinfo() blocks; keep it off of the caller's Scheduler if there is
+    // an Offload
+    error = Offload::run<int>(Offload::BLOCKING, boost::bind(&getaddrinfo,
+        node.c_str(), service, &hints, &results));
 #endif
     if (error)
         MORDOR_LOG_ERROR(g_log) << "getaddrinfo(" << host << ", "
@@ -0,0 +1,101 @@
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include "stackless.h"
+
+#include <boost/bind.hpp>
+
+#include "assert.h"
+#include "exception.h"
+#include "log.h"
+#include "scheduler.h"
+#include "timer.h"
+
+namespace Mordor {
+
+static Logger::ptr g_log = Log::lookup("mordor:stackless");
+
+StacklessTask::StacklessTask()
+    : m_line(0),
+      m_scheduler(NULL),
+      m_done(false),
+      m_finished(false)
+{}
+
+void
+StacklessTask::start(Scheduler *scheduler)
+{
+    MORDOR_ASSERT(!m_scheduler);
+    m_scheduler = scheduler ? scheduler : Scheduler::getThis();
+    MORDOR_ASSERT(m_scheduler);
+    resume();
+}
+
+void
+StacklessTask::resume()
+{
+    MORDOR_ASSERT(m_scheduler);
+    MORDOR_ASSERT(!m_done);
+    m_scheduler->schedule(boost::bind(&StacklessTask::run,
+        shared_from_this()));
+}
+
+void
+StacklessTask::run()
+{
+    MORDOR_ASSERT(!m_done);
+    MORDOR_LOG_DEBUG(g_log) << this << " resuming at " << m_line;
+    try {
+        step();
+    } catch (...) {
+        MORDOR_LOG_DEBUG(g_log) << this << " failed: "
+            << boost::current_exception_diagnostic_information();
+        m_exception = boost::current_exception();
+        finish();
+    }
+}
+
+void
+StacklessTask::finish()
+{
+    MORDOR_ASSERT(!m_done);
+    MORDOR_LOG_DEBUG(g_log) << this << " finished";
+    m_done = true;
+    m_finished.set();
+}
+
+void
+StacklessTask::join()
+{
+    m_finished.wait();
+    if (m_exception)
+        Mordor::rethrow_exception(m_exception);
+}
+
+void
+StacklessTask::awaitTimer(TimerManager &timerManager, unsigned long long us)
+{
+    // An IOManager schedules expired timers' callbacks on itself
+    if (dynamic_cast<TimerManager *>(m_scheduler) == &timerManager)
+        timerManager.registerTimer(us, boost::bind(&StacklessTask::run,
+            shared_from_this()));
+    else
+        timerManager.registerTimer(us, boost::bind(&StacklessTask::resume,
+            shared_from_this()));
+}
+
+#ifndef WINDOWS
+void
+StacklessTask::awaitEvent(IOManager &ioManager, int fd,
+    IOManager::Event event)
+{
+    // The IOManager already schedules the callback on itself
+    if (&ioManager == m_scheduler)
+        ioManager.registerEvent(fd, event, boost::bind(&StacklessTask::run,
+            shared_from_this()));
+    else
+        ioManager.registerEvent(fd, event, boost::bind(
+            &StacklessTask::resume, shared_from_this()));
+}
+#endif
+
+}
@@ -0,0 +1,127 @@
+#ifndef __MORDOR_STACKLESS_H__
+#define __MORDOR_STACKLESS_H__
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/exception_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "fibersynchronization.h"
+#include "iomanager.h"
+
+namespace Mordor {
+
+class Scheduler;
+class TimerManager;
+
+/// A concurrent activity that doesn't need a stack of its own
+
+/// A StacklessTask is a resumable function: step() is called each time the
+/// task is resumed, and returns after arranging to be resumed again (by
+/// awaiting an IOManager event, a timer, a Future, etc.), instead of
+/// blocking.  Each step runs on one of the Scheduler's cached Fibers for
+/// running delegates, so a suspended task costs only the task object itself
+/// (a couple hundred bytes, plus whatever state the derived class keeps)
+/// instead of a Fiber stack.  This makes it suitable for high fan-out work
+/// such as thousands of outstanding queries or per-connection timers.
+///
+/// Local variables do not survive across an await; anything needed after
+/// resuming must be a member.  The MORDOR_STACKLESS_* macros let step() be
+/// written as straight-line code:
+/// @code
+/// void step()
+/// {
+///     MORDOR_STACKLESS_BEGIN
+///     while (m_remaining-- > 0)
+///         MORDOR_STACKLESS_AWAIT(awaitTimer(m_ioManager, 1000));
+///     MORDOR_STACKLESS_END
+/// }
+/// @endcode
+///
+/// A step may still call fiber-based (blocking) APIs; it simply keeps the
+/// Fiber it's running on until the step returns.  A Fiber can wait for a
+/// task to complete with join().
+class StacklessTask : public boost::enable_shared_from_this<StacklessTask>,
+    boost::noncopyable
+{
+public:
+    typedef boost::shared_ptr<StacklessTask> ptr;
+
+public:
+    StacklessTask();
+    virtual ~StacklessTask() {}
+
+    /// Schedule the first step()
+    /// @param scheduler The Scheduler to run steps on; defaults to
+    /// Scheduler::getThis()
+    /// @pre This task is owned by a boost::shared_ptr
+    void start(Scheduler *scheduler = NULL);
+
+    /// Schedule the next step()
+
+    /// Can be called from any thread; suitable as a completion callback.  To
+    /// await a Future, construct it with
+    /// boost::bind(&StacklessTask::resume, task).
+    void resume();
+
+    /// @return If the task has finished
+    bool done() const { return m_done; }
+
+    /// Suspend the calling Fiber until the task finishes
+    /// @throws Whatever exception ended the task, if any
+    void join();
+
+protected:
+    /// Do the next chunk of work
+
+    /// Before returning, step() must either await something (which will
+    /// resume it later) or call finish().  An exception thrown out of step()
+    /// finishes the task, and is rethrown by join().
+    virtual void step() = 0;
+
+    /// Mark the task as done, and wake any Fibers in join()
+    void finish();
+
+    /// Resume after everything else currently runnable has had a turn
+    void yield() { resume(); }
+    /// Resume after us microseconds
+    void awaitTimer(TimerManager &timerManager, unsigned long long us);
+#ifndef WINDOWS
+    /// Resume when event fires for fd (or is cancelled)
+    void awaitEvent(IOManager &ioManager, int fd, IOManager::Event event);
+#endif
+
+    Scheduler *scheduler() const { return m_scheduler; }
+
+protected:
+    /// Where to pick up in step(); used by the MORDOR_STACKLESS_* macros
+    int m_line;
+
+private:
+    void run();
+
+private:
+    Scheduler *m_scheduler;
+    bool m_done;
+    boost::exception_ptr m_exception;
+    FiberEvent m_finished;
+};
+
+/// Begin the body of StacklessTask::step()
+#define MORDOR_STACKLESS_BEGIN switch (m_line) { case 0:
+/// Await something (e.g. awaitTimer(...)) and continue from here when resumed
+#define MORDOR_STACKLESS_AWAIT(await)                                         \
+    do {                                                                      \
+        m_line = __LINE__;                                                    \
+        await;                                                                \
+        return;                                                               \
+        case __LINE__:;                                                       \
+    } while (0)
+/// End the body of StacklessTask::step(), finishing the task
+#define MORDOR_STACKLESS_END } finish();
+
+}
+
+#endif
@@ -211,6 +211,66 @@ struct AverageMinMaxStatistic : AverageStatistic<T>
     }
 };
 
+/// Counts values in power-of-two sized buckets
+
+/// Bucket 0 counts zeroes, and bucket b counts values in [2^(b-1), 2^b); the
+/// last bucket also counts everything larger.
+template <class T>
+struct HistogramStatistic : Statistic
+{
+    typedef T value_type;
+    enum { BUCKETS = 32 };
+
+    HistogramStatistic(const char *units = NULL)
+        : Statistic(units)
+    { reset(); }
+
+    volatile size_t buckets[BUCKETS];
+
+    void reset()
+    {
+        for (size_t i = 0; i < BUCKETS; ++i)
+            buckets[i] = 0;
+    }
+
+    static size_t bucket(value_type value)
+    {
+        size_t result = 0;
+        while (value && result < BUCKETS - 1) {
+            value >>= 1;
+            ++result;
+        }
+        return result;
+    }
+
+    void update(value_type value) { atomicIncrement(buckets[bucket(value)]); }
+    void add(size_t bucket, size_t count)
+    {
+        MORDOR_ASSERT(bucket < BUCKETS);
+        if (count)
+            atomicAdd(buckets[bucket], count);
+    }
+
+    std::ostream &serialize(std::ostream &os) const
+    {
+        bool first = true;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            size_t count = buckets[i];
+            if (!count)
+                continue;
+            if (!first)
+                os << " ";
+            first = false;
+            if (i == BUCKETS - 1)
+                os << ">=" << (1ull << (i - 1));
+            else
+                os << "<" << (1ull << i);
+            os << ":" << count;
+        }
+        return os;
+    }
+};
+
 template <class T, class U>
 struct ThroughputStatistic : Statistic
 {
@@ -4,9 +4,33 @@
 
 #include <string.h>
 #include <algorithm>
+#ifndef WINDOWS
+#include <limits.h>
+#endif
+
+#include <boost/thread/tss.hpp>
 
 #include "mordor/assert.h"
-#include "mordor/util.h"
+#include "mordor/config.h"
+#include "mordor/statistics.h"
+
+// SSE2 is part of x86-64, so it can be used unconditionally; AVX2 has to be
+// detected at runtime (and needs a compiler that can target it per function)
+#if defined(X86_64) && (defined(MSVC) || defined(GCC))
+#define BUFFER_SSE2
+#include <emmintrin.h>
+#if defined(MSVC) || defined(__clang__) || __GNUC__ > 4 ||                   \
+    (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#define BUFFER_AVX2
+#include <immintrin.h>
+#ifdef MSVC
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+#endif
 
 #ifdef WINDOWS
 static u_long iovLength(size_t length)
@@ -22,7 +46,273 @@ static size_t iovLength(size_t length)
 
 namespace Mordor {
 
+static ConfigVar<size_t>::ptr g_slabCacheSize = Config::lookup<size_t>(
+    "buffer.slabcachesize", 1048576u,
+    "Bytes of free Buffer slabs of each size to keep around per thread");
+
+static ConfigVar<bool>::ptr g_simd = Config::lookup(
+    "buffer.simd", true,
+    "Search Buffers with SSE2 or AVX2 (if the processor supports them)");
+
+static CountStatistic<unsigned long long> &g_statSlabAllocs =
+    Statistics::registerStatistic("buffer.slaballocs",
+    CountStatistic<unsigned long long>("slabs"),
+    "Buffer slabs allocated from the heap (i.e. not reused)");
+static CountStatistic<unsigned long long> &g_statSlabReuses =
+    Statistics::registerStatistic("buffer.slabreuses",
+    CountStatistic<unsigned long long>("slabs"),
+    "Buffer slabs reused from a thread's pool");
+
+// Pooled slab sizes; anything smaller than MIN_POOLED is allocated exactly,
+// since rounding it up would mostly waste memory
+static const size_t SLAB_SIZES[] = { 4096, 16384, 65536 };
+static const size_t SIZE_CLASSES = sizeof(SLAB_SIZES) / sizeof(SLAB_SIZES[0]);
+static const size_t MIN_POOLED = 1024;
+static const size_t MAX_POOLED = 65536;
+// Block kinds that aren't size classes
+static const size_t HEAP = SIZE_CLASSES;
+static const size_t ADOPTED = SIZE_CLASSES + 1;
+
+namespace {
+
+// Free slabs; the first word of a free slab's data links to the next one
+struct SlabCache
+{
+    SlabCache()
+    {
+        for (size_t i = 0; i < SIZE_CLASSES; ++i) {
+            free[i] = NULL;
+            count[i] = 0;
+        }
+    }
+    ~SlabCache();
+
+    void *free[SIZE_CLASSES];
+    size_t count[SIZE_CLASSES];
+};
+
+}
+
+// Intentionally leaked; Buffers may still be freed during static destruction
+static boost::thread_specific_ptr<SlabCache> &t_slabCache()
+{
+    static boost::thread_specific_ptr<SlabCache> *cache =
+        new boost::thread_specific_ptr<SlabCache>();
+    return *cache;
+}
+
+static size_t
+sizeClass(size_t length)
+{
+    if (length < MIN_POOLED || length > MAX_POOLED)
+        return HEAP;
+    size_t result = 0;
+    while (SLAB_SIZES[result] < length)
+        ++result;
+    return result;
+}
+
+// How much to actually allocate for a Segment of at least length bytes
+static size_t
+slabSize(size_t length)
+{
+    size_t kind = sizeClass(length);
+    return kind == HEAP ? length : SLAB_SIZES[kind];
+}
+
+static unsigned char *
+blockData(void *block)
+{
+    return (unsigned char *)block + sizeof(size_t) * 2;
+}
+
+SlabCache::~SlabCache()
+{
+    for (size_t i = 0; i < SIZE_CLASSES; ++i) {
+        while (free[i]) {
+            void *block = free[i];
+            free[i] = *(void **)blockData(block);
+            ::operator delete(block);
+        }
+    }
+}
+
+// Search kernels for find(); each returns the offset of the first match in
+// [p, p + length), or NOT_FOUND.  A pair is c0 at i and c1 at i + gap (the
+// first and last bytes of a delimiter, which are a much better filter than the
+// first two for things like "\r\n\r\n"); both have to be in range.
+static const size_t NOT_FOUND = ~(size_t)0;
+
+typedef size_t (*FindByteKernel)(const unsigned char *p, size_t length,
+    unsigned char c);
+typedef size_t (*FindPairKernel)(const unsigned char *p, size_t length,
+    unsigned char c0, unsigned char c1, size_t gap);
+
+static size_t
+findByteScalar(const unsigned char *p, size_t length, unsigned char c)
+{
+    const void *point = memchr(p, c, length);
+    return point ? (const unsigned char *)point - p : NOT_FOUND;
+}
+
+static size_t
+findPairScalar(const unsigned char *p, size_t length, unsigned char c0,
+    unsigned char c1, size_t gap)
+{
+    size_t i = 0;
+    while (i + gap < length) {
+        const unsigned char *point =
+            (const unsigned char *)memchr(p + i, c0, length - gap - i);
+        if (!point)
+            return NOT_FOUND;
+        i = point - p;
+        if (p[i + gap] == c1)
+            return i;
+        ++i;
+    }
+    return NOT_FOUND;
+}
+
+#ifdef BUFFER_SSE2
+static inline unsigned int
+lowestBit(unsigned int mask)
+{
+#ifdef MSVC
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Finish off whatever didn't fill a whole vector
+static inline size_t
+tail(size_t offset, size_t found)
+{
+    return found == NOT_FOUND ? NOT_FOUND : offset + found;
+}
+
+static size_t
+findByteSse2(const unsigned char *p, size_t length, unsigned char c)
+{
+    const __m128i needle = _mm_set1_epi8((char)c);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (mask)
+            return i + lowestBit(mask);
+    }
+    return tail(i, findByteScalar(p + i, length - i, c));
+}
+
+static size_t
+findPairSse2(const unsigned char *p, size_t length, unsigned char c0,
+    unsigned char c1, size_t gap)
+{
+    const __m128i first = _mm_set1_epi8((char)c0);
+    const __m128i second = _mm_set1_epi8((char)c1);
+    size_t i = 0;
+    // The second load covers [i + gap, i + gap + 16)
+    for (; i + gap + 16 <= length; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + i + gap));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, second)));
+        if (mask)
+            return i + lowestBit(mask);
+    }
+    return tail(i, findPairScalar(p + i, length - i, c0, c1, gap));
+}
+#endif
+
+#ifdef BUFFER_AVX2
+TARGET_AVX2 static size_t
+findByteAvx2(const unsigned char *p, size_t length, unsigned char c)
+{
+    const __m256i needle = _mm256_set1_epi8((char)c);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(block, needle));
+        if (mask)
+            return i + lowestBit(mask);
+    }
+    return tail(i, findByteSse2(p + i, length - i, c));
+}
+
+TARGET_AVX2 static size_t
+findPairAvx2(const unsigned char *p, size_t length, unsigned char c0,
+    unsigned char c1, size_t gap)
+{
+    const __m256i first = _mm256_set1_epi8((char)c0);
+    const __m256i second = _mm256_set1_epi8((char)c1);
+    size_t i = 0;
+    for (; i + gap + 32 <= length; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + i + gap));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                _mm256_cmpeq_epi8(b, second)));
+        if (mask)
+            return i + lowestBit(mask);
+    }
+    return tail(i, findPairSse2(p + i, length - i, c0, c1, gap));
+}
+
+static bool
+cpuHasAvx2()
+{
+#ifdef MSVC
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    // The OS has to save the YMM registers, too
+    __cpuid(info, 1);
+    const int osxsaveAndAvx = (1 << 27) | (1 << 28);
+    if ((info[2] & osxsaveAndAvx) != osxsaveAndAvx || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+#endif
+
+namespace {
+struct FindKernels
+{
+    FindKernels()
+        : findByte(&findByteScalar),
+          findPair(&findPairScalar)
+    {
+#ifdef BUFFER_SSE2
+        findByte = &findByteSse2;
+        findPair = &findPairSse2;
+#endif
+#ifdef BUFFER_AVX2
+        if (cpuHasAvx2()) {
+            findByte = &findByteAvx2;
+            findPair = &findPairAvx2;
+        }
+#endif
+    }
+
+    FindByteKernel findByte;
+    FindPairKernel findPair;
+};
+}
+
+// Chosen once, according to the processor
+static const FindKernels g_kernels;
+
 Buffer::SegmentData::SegmentData()
+    : m_block(NULL)
 {
     start(NULL);
     length(0);
@@ -30,18 +320,76 @@ Buffer::SegmentData::SegmentData()
 
 Buffer::SegmentData::SegmentData(size_t length)
 {
-    m_array.reset(new unsigned char[length]);
-    start(m_array.get());
+    size_t kind = sizeClass(length);
+    if (kind == HEAP) {
+        m_block = (Block *)::operator new(sizeof(Block) + length);
+    } else {
+        SlabCache *cache = t_slabCache().get();
+        if (cache && cache->free[kind]) {
+            m_block = (Block *)cache->free[kind];
+            cache->free[kind] = *(void **)blockData(m_block);
+            --cache->count[kind];
+            g_statSlabReuses.increment();
+        } else {
+            m_block = (Block *)::operator new(sizeof(Block) +
+                SLAB_SIZES[kind]);
+            g_statSlabAllocs.increment();
+        }
+    }
+    MORDOR_ASSERT(blockData(m_block) == (unsigned char *)(m_block + 1));
+    m_block->refs = 1;
+    m_block->kind = kind;
+    start(m_block + 1);
     this->length(length);
 }
 
-Buffer::SegmentData::SegmentData(void *buffer, size_t length)
+struct Buffer::SegmentData::AdoptedBlock : public Buffer::SegmentData::Block
+{
+    boost::function<void ()> release;
+};
+
+Buffer::SegmentData::SegmentData(void *buffer, size_t length,
+    const boost::function<void ()> &release)
 {
-    m_array.reset((unsigned char *)buffer, &nop<unsigned char *>);
-    start(m_array.get());
+    AdoptedBlock *block = new AdoptedBlock();
+    block->refs = 1;
+    block->kind = ADOPTED;
+    block->release = release;
+    m_block = block;
+    start(buffer);
     this->length(length);
 }
 
+void
+Buffer::SegmentData::freeBlock(Block *block)
+{
+    size_t kind = block->kind;
+    if (kind == ADOPTED) {
+        AdoptedBlock *adopted = static_cast<AdoptedBlock *>(block);
+        boost::function<void ()> release;
+        release.swap(adopted->release);
+        delete adopted;
+        if (release)
+            release();
+        return;
+    }
+    if (kind != HEAP) {
+        SlabCache *cache = t_slabCache().get();
+        if (!cache) {
+            cache = new SlabCache();
+            t_slabCache().reset(cache);
+        }
+        if ((cache->count[kind] + 1) * SLAB_SIZES[kind] <=
+            g_slabCacheSize->val()) {
+            *(void **)blockData(block) = cache->free[kind];
+            cache->free[kind] = block;
+            ++cache->count[kind];
+            return;
+        }
+    }
+    ::operator delete(block);
+}
+
 Buffer::SegmentData
 Buffer::SegmentData::slice(size_t start, size_t length)
 {
@@ -49,8 +397,7 @@ Buffer::SegmentData::slice(size_t start, size_t length)
         length = this->length() - start;
     MORDOR_ASSERT(start <= this->length());
     MORDOR_ASSERT(length + start <= this->length());
-    SegmentData result;
-    result.m_array = m_array;
+    SegmentData result(*this);
     result.start((unsigned char*)this->start() + start);
     result.length(length);
     return result;
@@ -63,8 +410,7 @@ Buffer::SegmentData::slice(size_t start, size_t length) const
         length = this->length() - start;
     MORDOR_ASSERT(start <= this->length());
     MORDOR_ASSERT(length + start <= this->length());
-    SegmentData result;
-    result.m_array = m_array;
+    SegmentData result(*this);
     result.start((unsigned char*)this->start() + start);
     result.length(length);
     return result;
@@ -255,12 +601,36 @@ Buffer::adopt(void *buffer, size_t length)
     invariant();
 }
 
+void
+Buffer::adopt(const void *data, size_t length,
+    const boost::function<void ()> &release)
+{
+    // The data is only ever read, but SegmentData doesn't distinguish.  It
+    // owns the data from here on, so even an empty one gets released.
+    SegmentData segmentData((void *)data, length, release);
+    if (length == 0)
+        return;
+    invariant();
+    // Split any mixed read/write bufs
+    if (m_writeIt != m_segments.end() && m_writeIt->readAvailable() != 0) {
+        m_segments.insert(m_writeIt, Segment(m_writeIt->readBuffer()));
+        m_writeIt->consume(m_writeIt->readAvailable());
+    }
+    m_segments.insert(m_writeIt, Segment(segmentData));
+    m_readAvailable += length;
+    invariant();
+}
+
 void
 Buffer::reserve(size_t length)
 {
     if (writeAvailable() < length) {
-        // over-reserve to avoid fragmentation
-        Segment newSegment(length * 2 - writeAvailable());
+        // over-reserve to avoid fragmentation, but not past the largest
+        // pooled slab if what's needed fits in one
+        size_t size = length * 2 - writeAvailable();
+        if (length - writeAvailable() <= MAX_POOLED)
+            size = std::min(size, MAX_POOLED);
+        Segment newSegment(slabSize(size));
         if (readAvailable() == 0) {
             // put the new buffer at the front if possible to avoid
             // fragmentation
@@ -414,6 +784,36 @@ Buffer::readBuffers(size_t length) const
     return result;
 }
 
+size_t
+Buffer::readBuffers(iovec *iovs, size_t count, size_t length) const
+{
+    if (length == (size_t)~0)
+        length = readAvailable();
+    MORDOR_ASSERT(length <= readAvailable());
+#ifdef IOV_MAX
+    count = std::min<size_t>(count, IOV_MAX);
+#endif
+    size_t result = 0;
+    // Use the segments directly; slicing them would churn their refcounts
+    std::list<Segment>::const_iterator it = m_segments.begin();
+    while (length > 0 && result < count) {
+        MORDOR_ASSERT(it != m_segments.end());
+        unsigned char *start = (unsigned char *)it->m_data.start();
+        size_t todo = std::min(it->readAvailable(), length);
+        length -= todo;
+        while (todo > 0 && result < count) {
+            iovs[result].iov_base = start;
+            iovs[result].iov_len = iovLength(todo);
+            start += iovs[result].iov_len;
+            todo -= iovs[result].iov_len;
+            ++result;
+        }
+        ++it;
+    }
+    invariant();
+    return result;
+}
+
 const iovec
 Buffer::readBuffer(size_t length, bool coalesce) const
 {
@@ -509,6 +909,36 @@ Buffer::writeBuffers(size_t length)
     return result;
 }
 
+size_t
+Buffer::writeBuffers(iovec *iovs, size_t count, size_t length)
+{
+    if (length == (size_t)~0)
+        length = writeAvailable();
+    reserve(length);
+#ifdef IOV_MAX
+    count = std::min<size_t>(count, IOV_MAX);
+#endif
+    size_t result = 0;
+    std::list<Segment>::iterator it = m_writeIt;
+    while (length > 0 && result < count) {
+        MORDOR_ASSERT(it != m_segments.end());
+        unsigned char *start = (unsigned char *)it->m_data.start() +
+            it->m_writeIndex;
+        size_t todo = std::min(it->writeAvailable(), length);
+        length -= todo;
+        while (todo > 0 && result < count) {
+            iovs[result].iov_base = start;
+            iovs[result].iov_len = iovLength(todo);
+            start += iovs[result].iov_len;
+            todo -= iovs[result].iov_len;
+            ++result;
+        }
+        ++it;
+    }
+    invariant();
+    return result;
+}
+
 iovec
 Buffer::writeBuffer(size_t length, bool coalesce)
 {
@@ -578,7 +1008,7 @@ Buffer::copyIn(const Buffer &buffer, size_t length)
             --previousIt;
             if ((unsigned char *)previousIt->readBuffer().start() +
                 previousIt->readBuffer().length() == it->readBuffer().start() &&
-                previousIt->m_data.m_array.get() == it->m_data.m_array.get()) {
+                previousIt->m_data.m_block == it->m_data.m_block) {
                 MORDOR_ASSERT(previousIt->writeAvailable() == 0);
                 previousIt->extend(toConsume);
                 m_readAvailable += toConsume;
@@ -599,6 +1029,74 @@ Buffer::copyIn(const Buffer &buffer, size_t length)
     MORDOR_ASSERT(readAvailable() >= length);
 }
 
+void
+Buffer::splice(Buffer &buffer, size_t length)
+{
+    if (length == (size_t)~0)
+        length = buffer.readAvailable();
+    MORDOR_ASSERT(buffer.readAvailable() >= length);
+    MORDOR_ASSERT(&buffer != this);
+    invariant();
+
+    // Split any mixed read/write bufs
+    if (m_writeIt != m_segments.end() && m_writeIt->readAvailable() != 0) {
+        m_segments.insert(m_writeIt, Segment(m_writeIt->readBuffer()));
+        m_writeIt->consume(m_writeIt->readAvailable());
+    }
+
+    while (length > 0) {
+        std::list<Segment>::iterator it = buffer.m_segments.begin();
+        size_t toMove = std::min(it->readAvailable(), length);
+        // A moved segment can't be merged with our last one, so let copyIn
+        // deal with that
+        bool contiguous = false;
+        if (m_readAvailable != 0) {
+            std::list<Segment>::iterator previousIt = m_writeIt;
+            --previousIt;
+            contiguous = (unsigned char *)previousIt->readBuffer().start() +
+                previousIt->readAvailable() == it->readBuffer().start() &&
+                previousIt->m_data.m_block == it->m_data.m_block;
+        }
+        if (toMove == it->readAvailable() && it->writeAvailable() == 0 &&
+            !contiguous) {
+            m_segments.splice(m_writeIt, buffer.m_segments, it);
+            m_readAvailable += toMove;
+            buffer.m_readAvailable -= toMove;
+        } else {
+            copyIn(buffer, toMove);
+            buffer.consume(toMove);
+        }
+        length -= toMove;
+    }
+    invariant();
+    buffer.invariant();
+}
+
+Buffer
+Buffer::slice(size_t offset, size_t length) const
+{
+    if (length == (size_t)~0)
+        length = readAvailable() - offset;
+    MORDOR_ASSERT(offset + length <= readAvailable());
+    Buffer result;
+    std::list<Segment>::const_iterator it;
+    for (it = m_segments.begin(); it != m_segments.end() && length > 0; ++it) {
+        size_t available = it->readAvailable();
+        if (offset >= available) {
+            offset -= available;
+            continue;
+        }
+        size_t toSlice = std::min(available - offset, length);
+        result.m_segments.push_back(Segment(
+            it->readBuffer().slice(offset, toSlice)));
+        result.m_readAvailable += toSlice;
+        length -= toSlice;
+        offset = 0;
+    }
+    result.invariant();
+    return result;
+}
+
 void
 Buffer::copyIn(const void *data, size_t length)
 {
@@ -657,27 +1155,21 @@ Buffer::find(char delimiter, size_t length) const
     if (length == (size_t)~0)
         length = readAvailable();
     MORDOR_ASSERT(length <= readAvailable());
+    FindByteKernel findByte = g_simd->val() ? g_kernels.findByte :
+        &findByteScalar;
 
-    size_t totalLength = 0;
-    bool success = false;
-
+    size_t offset = 0;
     std::list<Segment>::const_iterator it;
-    for (it = m_segments.begin(); it != m_segments.end(); ++it) {
-        const void *start = it->readBuffer().start();
+    for (it = m_segments.begin(); it != m_segments.end() && length > 0; ++it) {
+        const unsigned char *start =
+            (const unsigned char *)it->m_data.start();
         size_t toscan = std::min(length, it->readAvailable());
-        const void *point = memchr(start, delimiter, toscan);
-        if (point != NULL) {
-            success = true;
-            totalLength += (unsigned char*)point - (unsigned char*)start;
-            break;
-        }
-        totalLength += toscan;
+        size_t found = findByte(start, toscan, (unsigned char)delimiter);
+        if (found != NOT_FOUND)
+            return offset + found;
+        offset += toscan;
         length -= toscan;
-        if (length == 0)
-            break;
     }
-    if (success)
-        return totalLength;
     return -1;
 }
 
@@ -688,52 +1180,61 @@ Buffer::find(const std::string &string, size_t length) const
         length = readAvailable();
     MORDOR_ASSERT(length <= readAvailable());
     MORDOR_ASSERT(!string.empty());
+    if (string.size() == 1)
+        return find(string[0], length);
+    FindPairKernel findPair = g_simd->val() ? g_kernels.findPair :
+        &findPairScalar;
+    const unsigned char *delimiter = (const unsigned char *)string.c_str();
+    size_t size = string.size();
 
-    size_t totalLength = 0;
-    size_t foundSoFar = 0;
-
+    size_t offset = 0;
     std::list<Segment>::const_iterator it;
-    for (it = m_segments.begin(); it != m_segments.end(); ++it) {
-        const void *start = it->readBuffer().start();
+    for (it = m_segments.begin(); it != m_segments.end() && length >= size;
+        ++it) {
+        const unsigned char *start =
+            (const unsigned char *)it->m_data.start();
         size_t toscan = std::min(length, it->readAvailable());
-        while (toscan > 0) {
-            if (foundSoFar == 0) {
-                const void *point = memchr(start, string[0], toscan);
-                if (point != NULL) {
-                    foundSoFar = 1;
-                    size_t found = (unsigned char*)point -
-                        (unsigned char*)start;
-                    toscan -= found + 1;
-                    length -= found + 1;
-                    totalLength += found;
-                    start = (unsigned char*)point + 1;
-                } else {
-                    totalLength += toscan;
-                    length -= toscan;
-                    toscan = 0;
-                    continue;
-                }
+        // Matches entirely within this segment: find the first and last
+        // bytes, and then check the ones in between
+        if (toscan >= size) {
+            size_t i = 0;
+            while (i + size <= toscan) {
+                size_t found = findPair(start + i, toscan - i, delimiter[0],
+                    delimiter[size - 1], size - 1);
+                if (found == NOT_FOUND)
+                    break;
+                i += found;
+                if (memcmp(start + i + 1, delimiter + 1, size - 2) == 0)
+                    return offset + i;
+                ++i;
             }
-            MORDOR_ASSERT(foundSoFar != 0);
-            size_t tocompare = std::min(toscan, string.size() - foundSoFar);
-            if (memcmp(start, string.c_str() + foundSoFar, tocompare) == 0) {
-                foundSoFar += tocompare;
-                toscan -= tocompare;
-                length -= tocompare;
-                if (foundSoFar == string.size())
+        }
+        // Matches that start in this segment, and finish in later ones
+        for (size_t i = toscan >= size ? toscan - size + 1 : 0;
+            i < toscan && i + size <= length;
+            ++i) {
+            if (start[i] != delimiter[0])
+                continue;
+            std::list<Segment>::const_iterator next = it;
+            const unsigned char *p = start + i;
+            size_t available = toscan - i;
+            size_t matched = 0;
+            while (true) {
+                size_t tocompare = std::min(available, size - matched);
+                if (memcmp(p, delimiter + matched, tocompare) != 0)
                     break;
-            } else {
-                totalLength += foundSoFar;
-                foundSoFar = 0;
+                matched += tocompare;
+                if (matched == size)
+                    return offset + i;
+                ++next;
+                MORDOR_ASSERT(next != m_segments.end());
+                p = (const unsigned char *)next->m_data.start();
+                available = next->readAvailable();
             }
         }
-        if (foundSoFar == string.size())
-            break;
-        if (length == 0)
-            break;
+        offset += toscan;
+        length -= toscan;
     }
-    if (foundSoFar == string.size())
-        return totalLength;
     return -1;
 }
 
@@ -927,12 +1428,12 @@ Buffer::invariant() const
                 next.readAvailable() != 0) {
                 MORDOR_ASSERT((const unsigned char*)segment.readBuffer().start() +
                     segment.readAvailable() != next.readBuffer().start() ||
-                    segment.m_data.m_array.get() != next.m_data.m_array.get());
+                    segment.m_data.m_block != next.m_data.m_block);
             } else if (segment.writeAvailable() != 0 &&
                 next.readAvailable() == 0) {
                 MORDOR_ASSERT((const unsigned char*)segment.writeBuffer().start() +
                     segment.writeAvailable() != next.writeBuffer().start() ||
-                    segment.m_data.m_array.get() != next.m_data.m_array.get());
+                    segment.m_data.m_block != next.m_data.m_block);
             }
         }
     }
@@ -4,9 +4,9 @@
 #include <list>
 #include <vector>
 
-#include <boost/shared_array.hpp>
 #include <boost/function.hpp>
 
+#include "mordor/atomic.h"
 #include "mordor/socket.h"
 
 namespace Mordor {
@@ -20,7 +20,25 @@ private:
     public:
         SegmentData();
         SegmentData(size_t length);
-        SegmentData(void *buffer, size_t length);
+        SegmentData(void *buffer, size_t length,
+            const boost::function<void ()> &release =
+                boost::function<void ()>());
+        SegmentData(const SegmentData &copy)
+            : m_start(copy.m_start),
+              m_length(copy.m_length),
+              m_block(copy.m_block)
+        { addRef(); }
+        ~SegmentData() { release(); }
+
+        SegmentData &operator =(const SegmentData &copy)
+        {
+            copy.addRef();
+            release();
+            m_start = copy.m_start;
+            m_length = copy.m_length;
+            m_block = copy.m_block;
+            return *this;
+        }
 
         SegmentData slice(size_t start, size_t length = ~0);
         const SegmentData slice(size_t start, size_t length = ~0) const;
@@ -36,8 +54,35 @@ private:
         void length(size_t l) { m_length = l; }
         void *m_start;
         size_t m_length;
+
     private:
-        boost::shared_array<unsigned char> m_array;
+        /// Reference counted storage, shared by every slice of it
+
+        /// The header and the data are a single allocation (except for
+        /// adopted buffers).  4K, 16K and 64K blocks are recycled through a
+        /// per-thread pool instead of going back to the heap.
+        struct Block
+        {
+            volatile size_t refs;
+            /// A pool size class, or HEAP or ADOPTED
+            size_t kind;
+        };
+        /// An ADOPTED Block, which remembers how to give the memory back
+        struct AdoptedBlock;
+
+        void addRef() const
+        {
+            if (m_block)
+                atomicIncrement(m_block->refs);
+        }
+        void release()
+        {
+            if (m_block && atomicDecrement(m_block->refs) == 0)
+                freeBlock(m_block);
+        }
+        static void freeBlock(Block *block);
+
+        Block *m_block;
     };
 
     struct Segment
@@ -66,6 +111,11 @@ private:
         void invariant() const;
     };
 
+public:
+    /// A good size for a stack array of iovecs for readBuffers() or
+    /// writeBuffers() to fill
+    enum { STACK_IOVECS = 64 };
+
 public:
     Buffer();
     Buffer(const Buffer &copy);
@@ -79,6 +129,13 @@ public:
     size_t segments() const;
 
     void adopt(void *buffer, size_t length);
+    /// Take ownership of length bytes of data that are already filled in,
+    /// appending them without copying
+
+    /// release is called (from whichever thread drops the last reference)
+    /// once no Buffer refers to any of the data any more
+    void adopt(const void *data, size_t length,
+        const boost::function<void ()> &release);
     void reserve(size_t length);
     void compact();
     void clear(bool clearWriteAvailableAsWell = true);
@@ -87,8 +144,18 @@ public:
     void truncate(size_t length);
 
     const std::vector<iovec> readBuffers(size_t length = ~0) const;
+    /// Fill a caller-provided array instead of allocating a vector
+    /// @param count The size of iovs; it's also capped at IOV_MAX
+    /// @return How many iovecs were filled; if length spans more segments
+    /// than that, they cover less than length
+    size_t readBuffers(iovec *iovs, size_t count, size_t length = ~0) const;
     const iovec readBuffer(size_t length, bool reallocate) const;
     std::vector<iovec> writeBuffers(size_t length = ~0);
+    /// Fill a caller-provided array instead of allocating a vector
+    /// @param count The size of iovs; it's also capped at IOV_MAX
+    /// @return How many iovecs were filled; if length spans more segments
+    /// than that, they cover less than length
+    size_t writeBuffers(iovec *iovs, size_t count, size_t length = ~0);
     iovec writeBuffer(size_t length, bool reallocate);
 
     void copyIn(const Buffer& buf, size_t length = ~0);
@@ -99,6 +166,18 @@ public:
     { buffer.copyIn(*this, length); }
     void copyOut(void* buffer, size_t length) const;
 
+    /// Move the first length bytes of buffer to the end of this one
+
+    /// Whole segments are moved as they are; only a segment that is split by
+    /// length (or that still has write space) is shared instead.  Equivalent
+    /// to copyIn(buffer, length); buffer.consume(length);
+    void splice(Buffer &buffer, size_t length = ~0);
+    /// A Buffer sharing length bytes of this one's data, starting at offset
+
+    /// The result has no write space of its own, so nothing written to it
+    /// can touch the shared data
+    Buffer slice(size_t offset, size_t length = ~0) const;
+
     ptrdiff_t find(char delimiter, size_t length = ~0) const;
     ptrdiff_t find(const std::string &string, size_t length = ~0) const;
     std::string getDelimited(char delimiter, bool eofIsDelimiter = true,
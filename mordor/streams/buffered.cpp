@@ -62,6 +62,18 @@ static void advance(void *&buffer, size_t amount)
     (unsigned char *&)buffer += amount;
 }
 
+// A Buffer can just take over the buffered segments
+static void take(Buffer &readBuffer, Buffer &buffer, size_t amount)
+{
+    buffer.splice(readBuffer, amount);
+}
+
+static void take(Buffer &readBuffer, void *buffer, size_t amount)
+{
+    readBuffer.copyOut(buffer, amount);
+    readBuffer.consume(amount);
+}
+
 template <class T>
 size_t
 BufferedStream::readInternal(T &buffer, size_t length)
@@ -71,8 +83,7 @@ BufferedStream::readInternal(T &buffer, size_t length)
     size_t remaining = length;
 
     size_t buffered = std::min(m_readBuffer.readAvailable(), remaining);
-    m_readBuffer.copyOut(buffer, buffered);
-    m_readBuffer.consume(buffered);
+    take(m_readBuffer, buffer, buffered);
     remaining -= buffered;
 
     MORDOR_LOG_VERBOSE(g_log) << this << " read(" << length << "): "
@@ -105,8 +116,7 @@ BufferedStream::readInternal(T &buffer, size_t length)
             }
 
             buffered = std::min(m_readBuffer.readAvailable(), remaining);
-            m_readBuffer.copyOut(buffer, buffered);
-            m_readBuffer.consume(buffered);
+            take(m_readBuffer, buffer, buffered);
             advance(buffer, buffered);
             remaining -= buffered;
         } while (remaining > 0 && !m_allowPartialReads && result != 0);
@@ -162,10 +172,10 @@ BufferedStream::flushWrite(size_t length)
             if (m_writeBuffer.readAvailable() >= length) {
                 MORDOR_LOG_VERBOSE(g_log) << this << " forwarding exception";
                 Buffer tempBuffer;
-                tempBuffer.copyIn(m_writeBuffer, m_writeBuffer.readAvailable()
+                tempBuffer.splice(m_writeBuffer, m_writeBuffer.readAvailable()
                     - length);
                 m_writeBuffer.clear();
-                m_writeBuffer.copyIn(tempBuffer);
+                m_writeBuffer.splice(tempBuffer);
                 throw;
             } else {
                 // Otherwise we have to say we succeeded,
@@ -353,9 +363,9 @@ BufferedStream::unread(const Buffer &b, size_t len)
     MORDOR_ASSERT(supportsUnread());
     Buffer tempBuffer;
     tempBuffer.copyIn(b, len);
-    tempBuffer.copyIn(m_readBuffer);
+    tempBuffer.splice(m_readBuffer);
     m_readBuffer.clear();
-    m_readBuffer.copyIn(tempBuffer);
+    m_readBuffer.splice(tempBuffer);
 }
 
 }
@@ -8,13 +8,42 @@
 #include <sys/stat.h>
 #include <sys/uio.h>
 
+#include <boost/bind.hpp>
+
 #include "buffer.h"
 #include "mordor/assert.h"
+#include "mordor/deadline.h"
 
 namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:streams:fd");
 
+#ifdef IO_URING
+static int
+performIo(IOManager *ioManager, int fd, unsigned char opcode,
+    const iovec *iovs, size_t count)
+{
+    io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(io_uring_sqe));
+    sqe.opcode = opcode;
+    sqe.fd = fd;
+    sqe.addr = (uintptr_t)iovs;
+    sqe.len = (__u32)count;
+    // Current file position, like readv/writev
+    sqe.off = (__u64)-1;
+    IOManager::Event event = opcode == IORING_OP_READV ?
+        IOManager::READ : IOManager::WRITE;
+    Deadline::Registration deadline(boost::bind(&IOManager::cancelEvent,
+        ioManager, fd, event));
+    int rc = ioManager->performIo(fd, event, sqe, Deadline::timeLeft());
+    if (rc < 0) {
+        errno = -rc;
+        rc = -1;
+    }
+    return rc;
+}
+#endif
+
 FDStream::FDStream()
 : m_ioManager(NULL),
   m_scheduler(NULL),
@@ -30,6 +59,12 @@ FDStream::init(int fd, IOManager *ioManager, Scheduler *scheduler, bool own)
     m_scheduler = scheduler;
     m_fd = fd;
     m_own = own;
+#ifdef IO_URING
+    // io_uring waits for readiness itself (or uses a thread for regular
+    // files), but only if the fd is blocking
+    if (m_ioManager && m_ioManager->asyncIo())
+        return;
+#endif
     if (m_ioManager) {
         if (fcntl(m_fd, F_SETFL, O_NONBLOCK)) {
             int error = errno;
@@ -75,14 +110,24 @@ FDStream::read(Buffer &buffer, size_t length)
     MORDOR_ASSERT(m_fd >= 0);
     if (length > 0xfffffffe)
         length = 0xfffffffe;
-    std::vector<iovec> iovs = buffer.writeBuffers(length);
-    int rc = readv(m_fd, &iovs[0], iovs.size());
+    iovec iovs[Buffer::STACK_IOVECS];
+    size_t count = buffer.writeBuffers(iovs, Buffer::STACK_IOVECS, length);
+    int rc;
+#ifdef IO_URING
+    if (useIoUring())
+        rc = performIo(m_ioManager, m_fd, IORING_OP_READV, iovs, count);
+    else
+#endif
+    rc = readv(m_fd, iovs, count);
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " readv(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
         m_ioManager->registerEvent(m_fd, IOManager::READ);
+        Deadline::Registration deadline(boost::bind(&IOManager::cancelEvent,
+            m_ioManager, m_fd, IOManager::READ), m_ioManager);
         Scheduler::yieldTo();
-        rc = readv(m_fd, &iovs[0], iovs.size());
+        deadline.check();
+        rc = readv(m_fd, iovs, count);
     }
     int error = errno;
     MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::DEBUG) << this
@@ -101,12 +146,24 @@ FDStream::read(void *buffer, size_t length)
     MORDOR_ASSERT(m_fd >= 0);
     if (length > 0xfffffffe)
         length = 0xfffffffe;
-    int rc = ::read(m_fd, buffer, length);
+    int rc;
+#ifdef IO_URING
+    if (useIoUring()) {
+        iovec iov;
+        iov.iov_base = buffer;
+        iov.iov_len = length;
+        rc = performIo(m_ioManager, m_fd, IORING_OP_READV, &iov, 1);
+    } else
+#endif
+    rc = ::read(m_fd, buffer, length);
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " read(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
         m_ioManager->registerEvent(m_fd, IOManager::READ);
+        Deadline::Registration deadline(boost::bind(&IOManager::cancelEvent,
+            m_ioManager, m_fd, IOManager::READ), m_ioManager);
         Scheduler::yieldTo();
+        deadline.check();
         rc = ::read(m_fd, buffer, length);
     }
     int error = errno;
@@ -125,14 +182,24 @@ FDStream::write(const Buffer &buffer, size_t length)
     MORDOR_ASSERT(m_fd >= 0);
     if (length > 0xfffffffe)
         length = 0xfffffffe;
-    const std::vector<iovec> iovs = buffer.readBuffers(length);
-    int rc = writev(m_fd, &iovs[0], iovs.size());
+    iovec iovs[Buffer::STACK_IOVECS];
+    size_t count = buffer.readBuffers(iovs, Buffer::STACK_IOVECS, length);
+    int rc;
+#ifdef IO_URING
+    if (useIoUring())
+        rc = performIo(m_ioManager, m_fd, IORING_OP_WRITEV, iovs, count);
+    else
+#endif
+    rc = writev(m_fd, iovs, count);
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " writev(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
         m_ioManager->registerEvent(m_fd, IOManager::WRITE);
+        Deadline::Registration deadline(boost::bind(&IOManager::cancelEvent,
+            m_ioManager, m_fd, IOManager::WRITE), m_ioManager);
         Scheduler::yieldTo();
-        rc = writev(m_fd, &iovs[0], iovs.size());
+        deadline.check();
+        rc = writev(m_fd, iovs, count);
     }
     int error = errno;
     MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::DEBUG) << this
@@ -152,12 +219,24 @@ FDStream::write(const void *buffer, size_t length)
     MORDOR_ASSERT(m_fd >= 0);
     if (length > 0xfffffffe)
         length = 0xfffffffe;
-    int rc = ::write(m_fd, buffer, length);
+    int rc;
+#ifdef IO_URING
+    if (useIoUring()) {
+        iovec iov;
+        iov.iov_base = (void *)buffer;
+        iov.iov_len = length;
+        rc = performIo(m_ioManager, m_fd, IORING_OP_WRITEV, &iov, 1);
+    } else
+#endif
+    rc = ::write(m_fd, buffer, length);
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " write(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
         m_ioManager->registerEvent(m_fd, IOManager::WRITE);
+        Deadline::Registration deadline(boost::bind(&IOManager::cancelEvent,
+            m_ioManager, m_fd, IOManager::WRITE), m_ioManager);
         Scheduler::yieldTo();
+        deadline.check();
         rc = ::write(m_fd, buffer, length);
     }
     int error = errno;
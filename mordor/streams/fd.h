@@ -41,6 +41,11 @@ public:
     int fd() { return m_fd; }
 
 private:
+#ifdef IO_URING
+    bool useIoUring() const
+    { return m_ioManager && m_ioManager->asyncIo() && Scheduler::getThis(); }
+#endif
+
     IOManager *m_ioManager;
     Scheduler *m_scheduler;
     int m_fd;
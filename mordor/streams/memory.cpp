@@ -30,13 +30,25 @@ MemoryStream::read(void *buffer, size_t length)
     return readInternal(buffer, length);
 }
 
+// A Buffer can just take over m_read's segments (which are still shared with
+// m_original)
+static void take(Buffer &read, Buffer &buffer, size_t amount)
+{
+    buffer.splice(read, amount);
+}
+
+static void take(Buffer &read, void *buffer, size_t amount)
+{
+    read.copyOut(buffer, amount);
+    read.consume(amount);
+}
+
 template <class T>
 size_t
 MemoryStream::readInternal(T &buffer, size_t length)
 {
     size_t todo = std::min(length, m_read.readAvailable());
-    m_read.copyOut(buffer, todo);
-    m_read.consume(todo);
+    take(m_read, buffer, todo);
     m_offset += todo;
     return todo;
 }
@@ -81,7 +93,7 @@ MemoryStream::writeInternal(const T &buffer, size_t length)
             m_original.copyIn(original);
             // Reset our read buffer to the current stream pos
             m_read.clear();
-            m_read.copyIn(original);
+            m_read.splice(original);
         }
     }
     return length;
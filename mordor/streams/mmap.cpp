@@ -0,0 +1,222 @@
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include "mordor/pch.h"
+
+#include "mmap.h"
+
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+
+#include "mordor/assert.h"
+#include "mordor/config.h"
+#include "mordor/log.h"
+
+namespace Mordor {
+
+static Logger::ptr g_log = Log::lookup("mordor:streams:mmap");
+
+static ConfigVar<size_t>::ptr g_windowSize = Config::lookup<size_t>(
+    "mmapstream.windowsize", 16 * 1024 * 1024u,
+    "How much of a file an MMapStream maps at once (rounded up to a page)");
+static ConfigVar<bool>::ptr g_readahead = Config::lookup(
+    "mmapstream.readahead", true,
+    "Advise the kernel that MMapStreams are read sequentially, and prefetch "
+    "the next window");
+
+static void unmap(void *data, size_t length)
+{
+    int rc = munmap(data, length);
+    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::TRACE) << "munmap("
+        << data << ", " << length << "): " << rc << " (" << errno << ")";
+}
+
+MMapStream::MMapStream(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    int error = errno;
+    MORDOR_LOG_VERBOSE(g_log) << "open(" << path << ", O_RDONLY): " << fd
+        << " (" << error << ")";
+    if (fd < 0)
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "open");
+    init(fd, true);
+}
+
+MMapStream::MMapStream(int fd, bool own)
+{
+    init(fd, own);
+}
+
+void
+MMapStream::init(int fd, bool own)
+{
+    MORDOR_ASSERT(fd >= 0);
+    m_fd = fd;
+    m_own = own;
+    m_pos = 0;
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    m_windowSize = std::max<size_t>(g_windowSize->val(), 1u);
+    m_windowSize = (m_windowSize + pageSize - 1) / pageSize * pageSize;
+    try {
+        m_size = size();
+    } catch (...) {
+        if (own) {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+        throw;
+    }
+}
+
+MMapStream::~MMapStream()
+{
+    if (m_own && m_fd >= 0) {
+        int rc = ::close(m_fd);
+        MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+            << " close(" << m_fd << "): " << rc << " (" << errno << ")";
+    }
+}
+
+void
+MMapStream::close(CloseType type)
+{
+    MORDOR_ASSERT(type == BOTH);
+    // Buffers that were read keep their windows mapped
+    m_current.reset();
+    m_next.reset();
+    if (m_fd >= 0 && m_own) {
+        int rc = ::close(m_fd);
+        int error = errno;
+        MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+            << " close(" << m_fd << "): " << rc << " (" << error << ")";
+        if (rc)
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "close");
+        m_fd = -1;
+    }
+}
+
+void
+MMapStream::map(Window &window, long long start)
+{
+    MORDOR_ASSERT(m_fd >= 0);
+    MORDOR_ASSERT(start % m_windowSize == 0);
+    MORDOR_ASSERT(start < m_size);
+    size_t length = (size_t)std::min<long long>(m_windowSize, m_size - start);
+    if (window.start == start && window.buffer.readAvailable() == length)
+        return;
+    void *data = mmap(NULL, length, PROT_READ, MAP_SHARED, m_fd, (off_t)start);
+    int error = errno;
+    MORDOR_LOG_LEVEL(g_log, data == MAP_FAILED ? Log::ERROR : Log::DEBUG)
+        << this << " mmap(" << length << ", " << m_fd << ", " << start
+        << "): " << data << " (" << error << ")";
+    if (data == MAP_FAILED)
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "mmap");
+    if (g_readahead->val())
+        madvise(data, length, MADV_SEQUENTIAL);
+    window.reset();
+    window.start = start;
+    window.data = (const unsigned char *)data;
+    window.buffer.adopt(data, length, boost::bind(&unmap, data, length));
+}
+
+size_t
+MMapStream::prepare(size_t length)
+{
+    if (m_pos >= m_size)
+        // The file may have grown since we last looked
+        m_size = size();
+    if (m_pos >= m_size || length == 0)
+        return 0;
+    long long start = m_pos / m_windowSize * m_windowSize;
+    if (m_current.start != start && m_next.start == start) {
+        m_current.reset();
+        m_current.start = m_next.start;
+        m_current.data = m_next.data;
+        m_current.buffer.splice(m_next.buffer);
+        m_next.reset();
+    }
+    map(m_current, start);
+    return (size_t)std::min<long long>(length,
+        m_current.start + m_current.buffer.readAvailable() - m_pos);
+}
+
+void
+MMapStream::readahead()
+{
+    if (!g_readahead->val())
+        return;
+    long long next = m_current.start + m_windowSize;
+    if (m_pos - m_current.start < (long long)m_windowSize / 2 ||
+        next >= m_size || m_next.start == next)
+        return;
+    map(m_next, next);
+    madvise((void *)m_next.data, m_next.buffer.readAvailable(),
+        MADV_WILLNEED);
+}
+
+size_t
+MMapStream::read(Buffer &buffer, size_t length)
+{
+    size_t todo = prepare(length);
+    if (todo == 0)
+        return 0;
+    buffer.copyIn(m_current.buffer.slice((size_t)(m_pos - m_current.start),
+        todo));
+    m_pos += todo;
+    readahead();
+    return todo;
+}
+
+size_t
+MMapStream::read(void *buffer, size_t length)
+{
+    size_t todo = prepare(length);
+    if (todo == 0)
+        return 0;
+    memcpy(buffer, m_current.data + (m_pos - m_current.start), todo);
+    m_pos += todo;
+    readahead();
+    return todo;
+}
+
+long long
+MMapStream::seek(long long offset, Anchor anchor)
+{
+    switch (anchor) {
+        case BEGIN:
+            break;
+        case CURRENT:
+            offset += m_pos;
+            break;
+        case END:
+            offset += size();
+            break;
+        default:
+            MORDOR_NOTREACHED();
+    }
+    if (offset < 0)
+        MORDOR_THROW_EXCEPTION(std::invalid_argument(
+            "resulting offset is negative"));
+    return m_pos = offset;
+}
+
+long long
+MMapStream::size()
+{
+    MORDOR_ASSERT(m_fd >= 0);
+    struct stat statbuf;
+    int rc = fstat(m_fd, &statbuf);
+    int error = errno;
+    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+        << " fstat(" << m_fd << "): " << rc << " (" << error << ")";
+    if (rc)
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "fstat");
+    return m_size = statbuf.st_size;
+}
+
+}
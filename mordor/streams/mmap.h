@@ -0,0 +1,73 @@
+#ifndef __MORDOR_MMAP_STREAM_H__
+#define __MORDOR_MMAP_STREAM_H__
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include "buffer.h"
+#include "stream.h"
+
+namespace Mordor {
+
+/// Reads a file through memory mappings instead of read()
+
+/// read(Buffer &) hands out segments that point straight into the mapping
+/// (and so the page cache), instead of copying into heap memory.  The file
+/// is mapped lazily, a window (mmapstream.windowsize) at a time, so very
+/// large files don't need to fit in the address space; a window stays mapped
+/// as long as any Buffer still refers to it.  With mmapstream.readahead, the
+/// kernel is told the windows are read sequentially, and the next one is
+/// mapped and prefetched once a read gets halfway through the current one.
+/// @note Truncating the file while it's mapped will cause SIGBUS when the
+/// missing pages are touched
+class MMapStream : public Stream
+{
+public:
+    typedef boost::shared_ptr<MMapStream> ptr;
+
+public:
+    MMapStream(const std::string &path);
+    MMapStream(int fd, bool own = true);
+    ~MMapStream();
+
+    bool supportsRead() { return true; }
+    bool supportsSeek() { return true; }
+    bool supportsSize() { return true; }
+
+    void close(CloseType type = BOTH);
+    size_t read(Buffer &buffer, size_t length);
+    size_t read(void *buffer, size_t length);
+    long long seek(long long offset, Anchor anchor = BEGIN);
+    long long size();
+
+    int fd() { return m_fd; }
+
+private:
+    struct Window
+    {
+        Window() : start(-1), data(NULL) {}
+
+        void reset() { start = -1; data = NULL; buffer.clear(); }
+
+        long long start;
+        const unsigned char *data;
+        /// Holds the mapping, and releases it when the last slice goes away
+        Buffer buffer;
+    };
+
+    void init(int fd, bool own);
+    void map(Window &window, long long start);
+    /// Make m_current cover m_pos
+    /// @return How much of length can be read from m_current
+    size_t prepare(size_t length);
+    void readahead();
+
+private:
+    int m_fd;
+    bool m_own;
+    long long m_pos, m_size;
+    size_t m_windowSize;
+    Window m_current, m_next;
+};
+
+}
+
+#endif
@@ -38,8 +38,9 @@ SocketStream::close(CloseType type)
 size_t
 SocketStream::read(Buffer &buffer, size_t length)
 {
-    std::vector<iovec> iovs = buffer.writeBuffers(length);
-    size_t result = m_socket->receive(&iovs[0], iovs.size());
+    iovec iovs[Buffer::STACK_IOVECS];
+    size_t count = buffer.writeBuffers(iovs, Buffer::STACK_IOVECS, length);
+    size_t result = m_socket->receive(iovs, count);
     buffer.produce(result);
     return result;
 }
@@ -59,8 +60,9 @@ SocketStream::cancelRead()
 size_t
 SocketStream::write(const Buffer &buffer, size_t length)
 {
-    const std::vector<iovec> iovs = buffer.readBuffers(length);
-    size_t result = m_socket->send(&iovs[0], iovs.size());
+    iovec iovs[Buffer::STACK_IOVECS];
+    size_t count = buffer.readBuffers(iovs, Buffer::STACK_IOVECS, length);
+    size_t result = m_socket->send(iovs, count);
     MORDOR_ASSERT(result > 0);
     return result;
 }
@@ -11,6 +11,13 @@ namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:streams:throttle");
 
+unsigned long long
+ThrottleStream::clockNow() const
+{
+    // Only needs to be as precise as the TimerManager that does the sleeping
+    return m_timerManager ? m_timerManager->clockNow() : TimerManager::now();
+}
+
 size_t
 ThrottleStream::read(Buffer &b, size_t len)
 {
@@ -20,7 +27,7 @@ ThrottleStream::read(Buffer &b, size_t len)
         m_read = 0;
         return parent()->read(b, len);
     }
-    unsigned long long now = TimerManager::now();
+    unsigned long long now = clockNow();
     unsigned long long minTime = 1000000ull * (m_read * 8) / throttle;
     unsigned long long actualTime = (now - m_readTimestamp);
     MORDOR_LOG_DEBUG(g_log) << this << " read " << m_read << "B throttle "
@@ -34,7 +41,7 @@ ThrottleStream::read(Buffer &b, size_t len)
             sleep(*m_timerManager, sleepTime);
         else
             sleep(sleepTime);
-        m_readTimestamp = TimerManager::now();
+        m_readTimestamp = clockNow();
     } else {
         m_readTimestamp = now;
     }
@@ -54,7 +61,7 @@ ThrottleStream::write(const Buffer &b, size_t len)
         m_written = 0;
         return parent()->write(b, len);
     }
-    unsigned long long now = TimerManager::now();
+    unsigned long long now = clockNow();
     unsigned long long minTime = 1000000ull * (m_written * 8) / throttle;
     unsigned long long actualTime = (now - m_writeTimestamp);
     MORDOR_LOG_DEBUG(g_log) << this << " write " << m_written << "B throttle "
@@ -68,7 +75,7 @@ ThrottleStream::write(const Buffer &b, size_t len)
             sleep(*m_timerManager, sleepTime);
         else
             sleep(sleepTime);
-        m_writeTimestamp = TimerManager::now();
+        m_writeTimestamp = clockNow();
     } else {
         m_writeTimestamp = now;
     }
@@ -41,6 +41,9 @@ public:
     size_t read(Buffer &b, size_t len);
     size_t write(const Buffer &b, size_t len);
 
+private:
+    unsigned long long clockNow() const;
+
 private:
     boost::function<unsigned int ()> m_dg;
     size_t m_read, m_written;
@@ -65,7 +65,8 @@ unsigned long long transferStream(Stream &src, Stream &dst,
     // Optimize transfer to NullStream
     if (&dst == &NullStream::get()) {
         while (true) {
-            readBuffer->clear();
+            // Keep the write space for the next read
+            readBuffer->clear(false);
             todo = chunkSize;
             if (toTransfer - totalRead < (unsigned long long)todo)
                 todo = (size_t)(toTransfer - totalRead);
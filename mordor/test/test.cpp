@@ -62,6 +62,21 @@ TimeConstraint::~TimeConstraint()
     MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(TimerManager::now() - m_start, m_us);
 }
 
+ConfigOverride::ConfigOverride(const std::string &name,
+    const std::string &value)
+    : m_name(name)
+{
+    ConfigVarBase::ptr var = Config::lookup(name);
+    MORDOR_ASSERT(var);
+    m_previous = var->toString();
+    var->fromString(value);
+}
+
+ConfigOverride::~ConfigOverride()
+{
+    Config::lookup(m_name)->fromString(m_previous);
+}
+
 void
 assertion(const char *file, int line, const char *function,
                 const std::string &expr)
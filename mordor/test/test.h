@@ -206,6 +206,17 @@ private:
     unsigned long long m_us, m_start;
 };
 
+/// Sets a ConfigVar until it goes out of scope, then puts back its previous
+/// value, even if the test fails
+struct ConfigOverride
+{
+    ConfigOverride(const std::string &name, const std::string &value);
+    ~ConfigOverride();
+
+private:
+    std::string m_name, m_previous;
+};
+
 // Assertion internal functions
 void assertion(const char *file, int line, const char *function,
                const std::string &expr);
@@ -1,7 +1,10 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <string.h>
+
 #include <boost/bind.hpp>
 
+#include "mordor/statistics.h"
 #include "mordor/streams/buffer.h"
 #include "mordor/test/test.h"
 
@@ -733,6 +736,58 @@ MORDOR_UNITTEST(Buffer, findStringFalsePositiveAcrossMultipleSegments)
     MORDOR_TEST_ASSERT_EQUAL(b.find("000011"), 4);
 }
 
+// Compare against std::string::find with the delimiter at every offset of a
+// Buffer made of small segments, and every length limit around it
+static void
+findEverywhere(const std::string &delimiter, size_t segmentSize)
+{
+    std::string data(200, 'x');
+    for (size_t offset = 0; offset + delimiter.size() <= data.size();
+        ++offset) {
+        std::string haystack = data;
+        // A near miss first, to exercise the prefilter
+        if (offset >= delimiter.size())
+            haystack.replace(0, delimiter.size() - 1, delimiter, 0,
+                delimiter.size() - 1);
+        haystack.replace(offset, delimiter.size(), delimiter);
+        Buffer b;
+        for (size_t i = 0; i < haystack.size(); i += segmentSize)
+            b.copyIn(Buffer(haystack.substr(i, segmentSize)));
+        ptrdiff_t expected = (ptrdiff_t)haystack.find(delimiter);
+        MORDOR_TEST_ASSERT_EQUAL(b.find(delimiter), expected);
+        MORDOR_TEST_ASSERT_EQUAL(b.find(delimiter, expected + delimiter.size()),
+            expected);
+        MORDOR_TEST_ASSERT_EQUAL(
+            b.find(delimiter, expected + delimiter.size() - 1), -1);
+        MORDOR_TEST_ASSERT_EQUAL(b.find(delimiter[0]),
+            (ptrdiff_t)haystack.find(delimiter[0]));
+    }
+}
+
+static void
+findEverywhere()
+{
+    const char *delimiters[] = { "\r", "\r\n", "\r\n\r\n",
+        "--boundary-which-is-longer-than-a-vector--" };
+    size_t segmentSizes[] = { 1, 3, 17, 64, 1000 };
+    for (size_t i = 0; i < sizeof(delimiters) / sizeof(delimiters[0]); ++i)
+        for (size_t j = 0; j < sizeof(segmentSizes) / sizeof(segmentSizes[0]);
+            ++j)
+            findEverywhere(delimiters[i], segmentSizes[j]);
+}
+
+MORDOR_UNITTEST(Buffer, findVectorized)
+{
+    ConfigOverride simd("buffer.simd", "1");
+    findEverywhere();
+}
+
+MORDOR_UNITTEST(Buffer, findScalar)
+{
+    ConfigOverride simd("buffer.simd", "0");
+    findEverywhere();
+}
+
 MORDOR_UNITTEST(Buffer, reserve0)
 {
     Buffer b;
@@ -770,3 +825,183 @@ MORDOR_UNITTEST(Buffer, clearReadPortionOnly)
     MORDOR_TEST_ASSERT_EQUAL(b.readAvailable(), 0u);
     MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(b.writeAvailable(), 5u);
 }
+
+static unsigned long long slabAllocs()
+{
+    CountStatistic<unsigned long long> *allocs =
+        dynamic_cast<CountStatistic<unsigned long long> *>(
+            Statistics::lookup("buffer.slaballocs"));
+    MORDOR_TEST_ASSERT(allocs);
+    return allocs->count;
+}
+
+// What a socket read loop does to its Buffer
+static unsigned long long readLoopSlabAllocs(size_t iterations)
+{
+    unsigned long long before = slabAllocs();
+    for (size_t i = 0; i < iterations; ++i) {
+        Buffer b;
+        std::vector<iovec> iovs = b.writeBuffers(4096);
+        MORDOR_TEST_ASSERT_EQUAL(iovs.size(), 1u);
+        b.produce(1000);
+        b.consume(1000);
+    }
+    return slabAllocs() - before;
+}
+
+MORDOR_UNITTEST(Buffer, slabAllocationCount)
+{
+    {
+        // Without a pool, every iteration goes to the heap
+        ConfigOverride cacheSize("buffer.slabcachesize", "0");
+        MORDOR_TEST_ASSERT_EQUAL(readLoopSlabAllocs(1000), 1000u);
+    }
+    // With one, the slab freed by the last iteration is reused
+    MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(readLoopSlabAllocs(1000), 1u);
+}
+
+MORDOR_UNITTEST(Buffer, slabSharedBetweenSlices)
+{
+    Buffer b1;
+    b1.reserve(4096);
+    b1.copyIn("hello world");
+    Buffer b2;
+    b2.copyIn(b1, 5);
+    // Freeing the original doesn't recycle the storage b2 still refers to
+    b1.clear();
+    Buffer b3;
+    b3.reserve(4096);
+    b3.copyIn("HELLO");
+    MORDOR_TEST_ASSERT(b2 == "hello");
+}
+
+MORDOR_UNITTEST(Buffer, readBuffersIntoArray)
+{
+    Buffer b("hello");
+    b.copyIn(Buffer("world"));
+    b.copyIn(Buffer("!"));
+    MORDOR_TEST_ASSERT_EQUAL(b.segments(), 3u);
+    iovec iovs[2];
+    MORDOR_TEST_ASSERT_EQUAL(b.readBuffers(iovs, 2, 7), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[0].iov_len, 5u);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[1].iov_len, 2u);
+    MORDOR_TEST_ASSERT(memcmp(iovs[1].iov_base, "wo", 2) == 0);
+    // Not enough room for the last segment
+    MORDOR_TEST_ASSERT_EQUAL(b.readBuffers(iovs, 2), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[0].iov_len + iovs[1].iov_len, 10u);
+    MORDOR_TEST_ASSERT_EQUAL(b.readBuffers(iovs, 2, 0), 0u);
+}
+
+MORDOR_UNITTEST(Buffer, writeBuffersIntoArray)
+{
+    Buffer b;
+    iovec iovs[Buffer::STACK_IOVECS];
+    size_t count = b.writeBuffers(iovs, Buffer::STACK_IOVECS, 10);
+    MORDOR_TEST_ASSERT_EQUAL(count, 1u);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[0].iov_len, 10u);
+    memcpy(iovs[0].iov_base, "helloworld", 10);
+    b.produce(10);
+    MORDOR_TEST_ASSERT(b == "helloworld");
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(b.writeAvailable(), 1u);
+    // Matches the vector version
+    std::vector<iovec> vector = b.writeBuffers(b.writeAvailable());
+    count = b.writeBuffers(iovs, Buffer::STACK_IOVECS, b.writeAvailable());
+    MORDOR_TEST_ASSERT_EQUAL(count, vector.size());
+    MORDOR_TEST_ASSERT_EQUAL(iovs[0].iov_base, vector[0].iov_base);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[0].iov_len, vector[0].iov_len);
+}
+
+MORDOR_UNITTEST(Buffer, spliceWholeSegments)
+{
+    Buffer src("hello");
+    src.copyIn(Buffer("world"));
+    const void *world = src.readBuffers()[1].iov_base;
+    Buffer dst("abc");
+    dst.splice(src, 10);
+    MORDOR_TEST_ASSERT_EQUAL(src.readAvailable(), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(src.segments(), 0u);
+    MORDOR_TEST_ASSERT(dst == "abchelloworld");
+    MORDOR_TEST_ASSERT_EQUAL(dst.segments(), 3u);
+    // Not copied
+    MORDOR_TEST_ASSERT_EQUAL(dst.readBuffers()[2].iov_base, world);
+}
+
+MORDOR_UNITTEST(Buffer, splicePartialSegment)
+{
+    Buffer src("hello");
+    src.copyIn(Buffer("world"));
+    Buffer dst;
+    dst.reserve(10);
+    dst.copyIn("abc");
+    dst.splice(src, 7);
+    MORDOR_TEST_ASSERT(dst == "abchellowo");
+    MORDOR_TEST_ASSERT(src == "rld");
+    MORDOR_TEST_ASSERT_EQUAL(dst.segments(), 4u);
+    // The write space is still at the end
+    dst.copyIn("x");
+    MORDOR_TEST_ASSERT(dst == "abchellowox");
+    dst.splice(src);
+    MORDOR_TEST_ASSERT(dst == "abchellowoxrld");
+    MORDOR_TEST_ASSERT_EQUAL(src.readAvailable(), 0u);
+}
+
+MORDOR_UNITTEST(Buffer, spliceMergesContiguous)
+{
+    Buffer original("helloworld");
+    Buffer src;
+    src.copyIn(original);
+    src.consume(5);
+    Buffer dst;
+    dst.copyIn(original, 5);
+    dst.splice(src);
+    MORDOR_TEST_ASSERT(dst == "helloworld");
+    MORDOR_TEST_ASSERT_EQUAL(dst.segments(), 1u);
+}
+
+MORDOR_UNITTEST(Buffer, slice)
+{
+    Buffer b("hello");
+    b.copyIn(Buffer("world"));
+    b.reserve(10);
+    Buffer slice = b.slice(3, 4);
+    MORDOR_TEST_ASSERT(slice == "lowo");
+    MORDOR_TEST_ASSERT_EQUAL(slice.segments(), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(slice.writeAvailable(), 0u);
+    MORDOR_TEST_ASSERT_EQUAL((const char *)slice.readBuffers()[0].iov_base,
+        (const char *)b.readBuffers()[0].iov_base + 3);
+    // Writing to the slice doesn't touch the original
+    slice.copyIn("!");
+    MORDOR_TEST_ASSERT(slice == "lowo!");
+    MORDOR_TEST_ASSERT(b == "helloworld");
+    MORDOR_TEST_ASSERT(b.slice(10) == "");
+    MORDOR_TEST_ASSERT(b.slice(0) == "helloworld");
+}
+
+static void setTrue(bool &released)
+{
+    released = true;
+}
+
+MORDOR_UNITTEST(Buffer, adoptWithRelease)
+{
+    static const char data[] = "helloworld";
+    bool released = false;
+    {
+        Buffer b("abc");
+        b.adopt(data, 10, boost::bind(&setTrue, boost::ref(released)));
+        MORDOR_TEST_ASSERT(b == "abchelloworld");
+        MORDOR_TEST_ASSERT_EQUAL(b.readBuffers()[1].iov_base,
+            (const void *)data);
+        Buffer slice = b.slice(5, 3);
+        b.clear();
+        MORDOR_TEST_ASSERT(!released);
+        MORDOR_TEST_ASSERT(slice == "llo");
+    }
+    MORDOR_TEST_ASSERT(released);
+
+    released = false;
+    Buffer b;
+    b.adopt(data, 0, boost::bind(&setTrue, boost::ref(released)));
+    MORDOR_TEST_ASSERT(released);
+    MORDOR_TEST_ASSERT_EQUAL(b.segments(), 0u);
+}
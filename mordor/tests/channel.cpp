@@ -0,0 +1,228 @@
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include <iterator>
+
+#include <boost/bind.hpp>
+
+#include "mordor/channel.h"
+#include "mordor/iomanager.h"
+#include "mordor/parallel.h"
+#include "mordor/test/test.h"
+#include "mordor/workerpool.h"
+
+using namespace Mordor;
+
+MORDOR_SUITE_INVARIANT(Channel)
+{
+    MORDOR_TEST_ASSERT(!Scheduler::getThis());
+}
+
+MORDOR_UNITTEST(Channel, buffered)
+{
+    WorkerPool pool;
+    Channel<int> channel(4);
+    MORDOR_TEST_ASSERT_EQUAL(channel.capacity(), 4u);
+    for (int i = 0; i < 4; ++i)
+        MORDOR_TEST_ASSERT(channel.trySend(i));
+    MORDOR_TEST_ASSERT(!channel.trySend(4));
+    MORDOR_TEST_ASSERT_EQUAL(channel.size(), 4u);
+    int value;
+    for (int i = 0; i < 4; ++i) {
+        MORDOR_TEST_ASSERT(channel.receive(value));
+        MORDOR_TEST_ASSERT_EQUAL(value, i);
+    }
+    MORDOR_TEST_ASSERT(!channel.tryReceive(value));
+}
+
+static void produce(Channel<int> &channel, int first, int count)
+{
+    for (int i = first; i < first + count; ++i)
+        channel.send(i);
+}
+
+MORDOR_UNITTEST(Channel, blocking)
+{
+    WorkerPool pool;
+    Channel<int> channel(8);
+    pool.schedule(boost::bind(&produce, boost::ref(channel), 0, 1000));
+    int value;
+    for (int i = 0; i < 1000; ++i) {
+        MORDOR_TEST_ASSERT(channel.receive(value));
+        MORDOR_TEST_ASSERT_EQUAL(value, i);
+    }
+    MORDOR_TEST_ASSERT_EQUAL(channel.size(), 0u);
+}
+
+MORDOR_UNITTEST(Channel, unbuffered)
+{
+    WorkerPool pool;
+    Channel<int> channel(0);
+    MORDOR_TEST_ASSERT(!channel.trySend(1));
+    pool.schedule(boost::bind(&produce, boost::ref(channel), 0, 10));
+    int value;
+    for (int i = 0; i < 10; ++i) {
+        MORDOR_TEST_ASSERT(channel.receive(value));
+        MORDOR_TEST_ASSERT_EQUAL(value, i);
+    }
+}
+
+static void sendAfterClose(Channel<int> &channel, bool &threw)
+{
+    try {
+        channel.send(2);
+    } catch (ChannelClosedException &) {
+        threw = true;
+    }
+}
+
+MORDOR_UNITTEST(Channel, close)
+{
+    WorkerPool pool;
+    Channel<int> channel(1);
+    channel.send(1);
+    bool threw = false;
+    // Blocks, because the buffer is full
+    pool.schedule(boost::bind(&sendAfterClose, boost::ref(channel),
+        boost::ref(threw)));
+    pool.dispatch();
+    MORDOR_TEST_ASSERT(!threw);
+    channel.close();
+    pool.dispatch();
+    MORDOR_TEST_ASSERT(threw);
+    MORDOR_TEST_ASSERT(channel.closed());
+    MORDOR_TEST_ASSERT_EXCEPTION(channel.send(3), ChannelClosedException);
+    // Whatever was buffered is still delivered
+    int value;
+    MORDOR_TEST_ASSERT(channel.receive(value));
+    MORDOR_TEST_ASSERT_EQUAL(value, 1);
+    MORDOR_TEST_ASSERT(!channel.receive(value));
+}
+
+static void closeChannel(Channel<int> &channel)
+{
+    channel.close();
+}
+
+MORDOR_UNITTEST(Channel, closeWakesReceivers)
+{
+    WorkerPool pool;
+    Channel<int> channel(1);
+    pool.schedule(boost::bind(&closeChannel, boost::ref(channel)));
+    int value;
+    MORDOR_TEST_ASSERT(!channel.receive(value));
+}
+
+MORDOR_UNITTEST(Channel, batch)
+{
+    WorkerPool pool;
+    Channel<int> channel(4);
+    std::vector<int> values;
+    for (int i = 0; i < 10; ++i)
+        values.push_back(i);
+    pool.schedule(boost::bind(&Channel<int>::send<std::vector<int>::iterator>,
+        &channel, values.begin(), values.end()));
+    std::vector<int> received;
+    while (received.size() < 10) {
+        size_t count = channel.receive(std::back_inserter(received), 16);
+        MORDOR_TEST_ASSERT_GREATER_THAN(count, 0u);
+    }
+    MORDOR_TEST_ASSERT(received == values);
+    channel.close();
+    MORDOR_TEST_ASSERT_EQUAL(channel.receive(std::back_inserter(received), 16),
+        0u);
+}
+
+static void consume(Channel<int> &channel, long long &sum)
+{
+    int value;
+    long long local = 0;
+    while (channel.receive(value))
+        local += value;
+    atomicAdd(sum, local);
+}
+
+MORDOR_UNITTEST(Channel, multipleProducersAndConsumers)
+{
+    WorkerPool pool(4);
+    Channel<int> channel(16);
+    long long sum = 0;
+    {
+        TaskGroup consumers(4);
+        for (int i = 0; i < 4; ++i)
+            consumers.run(boost::bind(&consume, boost::ref(channel),
+                boost::ref(sum)));
+        TaskGroup producers(4);
+        for (int i = 0; i < 4; ++i)
+            producers.run(boost::bind(&produce, boost::ref(channel),
+                i * 1000, 1000));
+        producers.wait();
+        channel.close();
+        consumers.wait();
+    }
+    MORDOR_TEST_ASSERT_EQUAL(sum, 3999LL * 4000 / 2);
+}
+
+MORDOR_UNITTEST(Channel, acrossSchedulers)
+{
+    WorkerPool consumerPool;
+    WorkerPool producerPool(1, false);
+    Channel<int> channel(2);
+    producerPool.schedule(boost::bind(&produce, boost::ref(channel), 0, 100));
+    int value;
+    for (int i = 0; i < 100; ++i) {
+        MORDOR_TEST_ASSERT(channel.receive(value));
+        MORDOR_TEST_ASSERT_EQUAL(value, i);
+        MORDOR_TEST_ASSERT_EQUAL(Scheduler::getThis(), &consumerPool);
+    }
+}
+
+MORDOR_UNITTEST(Channel, select)
+{
+    WorkerPool pool;
+    Channel<int> a(1), b(1);
+    int fromA, fromB;
+    Select select;
+    size_t caseA = select.receive(a, fromA);
+    size_t caseB = select.receive(b, fromB);
+    MORDOR_TEST_ASSERT_EQUAL(select.poll(), ~0u);
+
+    b.send(2);
+    MORDOR_TEST_ASSERT_EQUAL(select.wait(), caseB);
+    MORDOR_TEST_ASSERT(select.ok());
+    MORDOR_TEST_ASSERT_EQUAL(fromB, 2);
+
+    // Blocks until a producer shows up
+    pool.schedule(boost::bind(&produce, boost::ref(a), 1, 1));
+    MORDOR_TEST_ASSERT_EQUAL(select.wait(), caseA);
+    MORDOR_TEST_ASSERT_EQUAL(fromA, 1);
+
+    // Sends too
+    int toA = 5;
+    Select sendSelect;
+    sendSelect.receive(b, fromB);
+    size_t sendCase = sendSelect.send(a, toA);
+    MORDOR_TEST_ASSERT_EQUAL(sendSelect.wait(), sendCase);
+    MORDOR_TEST_ASSERT(a.receive(fromA));
+    MORDOR_TEST_ASSERT_EQUAL(fromA, 5);
+
+    b.close();
+    MORDOR_TEST_ASSERT_EQUAL(select.wait(), caseB);
+    MORDOR_TEST_ASSERT(!select.ok());
+}
+
+MORDOR_UNITTEST(Channel, selectTimeout)
+{
+    IOManager ioManager;
+    Channel<int> channel(1);
+    int value;
+    Select select;
+    select.receive(channel, value);
+    size_t timeout = select.timeout(ioManager, 50000);
+    unsigned long long start = TimerManager::now();
+    MORDOR_TEST_ASSERT_EQUAL(select.wait(), timeout);
+    MORDOR_TEST_ASSERT_ABOUT_EQUAL(start + 50000, TimerManager::now(), 50000);
+    // The receive was withdrawn
+    channel.send(1);
+    MORDOR_TEST_ASSERT(channel.receive(value));
+    MORDOR_TEST_ASSERT_EQUAL(value, 1);
+}
@@ -0,0 +1,113 @@
+// Copyright (c) 2010 - Mozy, Inc.
+
+#ifndef WINDOWS
+#include <unistd.h>
+#endif
+
+#include <boost/bind.hpp>
+
+#include "mordor/deadline.h"
+#include "mordor/iomanager.h"
+#include "mordor/socket.h"
+#include "mordor/streams/fd.h"
+#include "mordor/test/test.h"
+
+using namespace Mordor;
+
+MORDOR_UNITTEST(Deadline, scope)
+{
+    MORDOR_TEST_ASSERT(!Deadline::getThis());
+    MORDOR_TEST_ASSERT_EQUAL(Deadline::timeLeft(), ~0ull);
+    {
+        DeadlineScope outer(1000000);
+        MORDOR_TEST_ASSERT_EQUAL(Deadline::getThis(), outer.deadline().get());
+        MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(Deadline::timeLeft(), 1000000u);
+        {
+            // Can't extend the enclosing deadline
+            DeadlineScope inner(10000000);
+            MORDOR_TEST_ASSERT_EQUAL(Deadline::getThis(),
+                inner.deadline().get());
+            MORDOR_TEST_ASSERT_EQUAL(inner.deadline()->expiration(),
+                outer.deadline()->expiration());
+        }
+        MORDOR_TEST_ASSERT_EQUAL(Deadline::getThis(), outer.deadline().get());
+        Deadline::throwIfReached();
+    }
+    MORDOR_TEST_ASSERT(!Deadline::getThis());
+}
+
+MORDOR_UNITTEST(Deadline, reached)
+{
+    DeadlineScope scope(0);
+    MORDOR_TEST_ASSERT_EQUAL(Deadline::timeLeft(), 0u);
+    MORDOR_TEST_ASSERT_EXCEPTION(Deadline::throwIfReached(),
+        TimedOutException);
+}
+
+MORDOR_UNITTEST(Deadline, cancelPropagates)
+{
+    DeadlineScope outer(~0ull);
+    DeadlineScope inner(1000000);
+    Deadline::throwIfReached();
+    outer.deadline()->cancel();
+    MORDOR_TEST_ASSERT_EQUAL(Deadline::timeLeft(), 0u);
+    MORDOR_TEST_ASSERT_EXCEPTION(Deadline::throwIfReached(),
+        OperationAbortedException);
+    MORDOR_TEST_ASSERT_EXCEPTION(outer.deadline()->check(),
+        OperationAbortedException);
+}
+
+namespace {
+struct Counter
+{
+    Counter() : calls(0), error(0) {}
+
+    void operator()(error_t e) { ++calls; error = e; }
+
+    int calls;
+    error_t error;
+};
+}
+
+MORDOR_UNITTEST(Deadline, registration)
+{
+    IOManager ioManager;
+    Counter counter;
+    {
+        DeadlineScope scope(50000);
+        Deadline::Registration registration(boost::ref(counter), &ioManager);
+        // The Deadline's single timer fires it
+        while (counter.calls == 0)
+            ioManager.dispatch();
+        MORDOR_TEST_ASSERT_EQUAL(counter.calls, 1);
+        MORDOR_TEST_ASSERT_EXCEPTION(registration.check(), TimedOutException);
+        // Only once
+        scope.deadline()->cancel();
+        MORDOR_TEST_ASSERT_EQUAL(counter.calls, 1);
+    }
+    // Without a Deadline, nothing happens
+    Deadline::Registration registration(boost::ref(counter), &ioManager);
+    registration.check();
+    MORDOR_TEST_ASSERT_EQUAL(counter.calls, 1);
+}
+
+#ifndef WINDOWS
+MORDOR_UNITTEST(Deadline, fdStream)
+{
+    IOManager ioManager;
+    int fds[2];
+    MORDOR_TEST_ASSERT_EQUAL(pipe(fds), 0);
+    // Keep the write end open, so the read would block forever
+    FDStream readStream(fds[0], &ioManager);
+    FDStream writeStream(fds[1], &ioManager);
+    char buf;
+    unsigned long long start = TimerManager::now();
+    {
+        DeadlineScope scope(100000);
+        MORDOR_TEST_ASSERT_EXCEPTION(readStream.read(&buf, 1),
+            TimedOutException);
+    }
+    MORDOR_TEST_ASSERT_ABOUT_EQUAL(start + 100000, TimerManager::now(),
+        50000);
+}
+#endif
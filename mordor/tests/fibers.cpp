@@ -1,8 +1,13 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
+#ifdef POSIX
+#include <fenv.h>
+#endif
+
 #include <boost/bind.hpp>
 
 #include "mordor/fiber.h"
+#include "mordor/statistics.h"
 #include "mordor/test/test.h"
 
 using namespace Mordor;
@@ -601,3 +606,149 @@ MORDOR_UNITTEST(Fibers, exceptionDestructsBeforeFiberDestructs)
     }
     MORDOR_TEST_ASSERT_EQUAL(++sequence, 7);
 }
+
+#ifdef POSIX
+static void recordStack(intptr_t &address)
+{
+    int local;
+    address = (intptr_t)&local;
+}
+
+MORDOR_UNITTEST(Fibers, stackReused)
+{
+    CountStatistic<unsigned int> *pooled =
+        dynamic_cast<CountStatistic<unsigned int> *>(
+        Statistics::lookup("fiber.allocstack.pooled"));
+    MORDOR_TEST_ASSERT(pooled);
+    intptr_t first = 0, second = 0;
+    Fiber::ptr fiber(new Fiber(boost::bind(&recordStack, boost::ref(first)),
+        65536));
+    fiber->call();
+    fiber.reset();
+    unsigned int count = pooled->count;
+    fiber.reset(new Fiber(boost::bind(&recordStack, boost::ref(second)),
+        65536));
+    fiber->call();
+    MORDOR_TEST_ASSERT_EQUAL(pooled->count, count + 1);
+    // Same stack from this thread's cache
+    MORDOR_TEST_ASSERT_EQUAL(first, second);
+}
+
+static void useStack(size_t bytes)
+{
+    char buffer[65536];
+    volatile char *p = buffer;
+    for (size_t i = 0; i < bytes && i < sizeof(buffer); ++i)
+        p[i] = 1;
+}
+
+MORDOR_UNITTEST(Fibers, stackUsageMeasured)
+{
+    AverageMinMaxStatistic<unsigned int> *usage =
+        dynamic_cast<AverageMinMaxStatistic<unsigned int> *>(
+        Statistics::lookup("fiber.stackusage"));
+    MORDOR_TEST_ASSERT(usage);
+    {
+        ConfigOverride measure("fiber.measurestackusage", "1");
+        // An odd size, so we get a fresh stack instead of a pooled one
+        Fiber::ptr fiber(new Fiber(boost::bind(&useStack, 65536u),
+            1024 * 1024 + 65536));
+        fiber->call();
+    }
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL((unsigned int)usage->max.max,
+        65536u);
+    MORDOR_TEST_ASSERT_LESS_THAN((unsigned int)usage->max.max,
+        1024u * 1024u);
+}
+#endif
+
+static void spin(volatile unsigned long long &until)
+{
+    while (TimerManager::now() < until);
+    Fiber::yield();
+    until = TimerManager::now() + 20000;
+    while (TimerManager::now() < until);
+}
+
+MORDOR_UNITTEST(Fibers, cpuTimeMeasured)
+{
+    volatile unsigned long long until = TimerManager::now() + 20000;
+    Fiber::ptr fiber(new Fiber(boost::bind(&spin, boost::ref(until))));
+    {
+        ConfigOverride measure("fiber.cputime", "1");
+        fiber->call();
+        // Not charged for time it isn't running
+        unsigned long long first = fiber->cpuTime();
+        until = TimerManager::now() + 20000;
+        while (TimerManager::now() < until);
+        MORDOR_TEST_ASSERT_EQUAL(fiber->cpuTime(), first);
+        fiber->call();
+    }
+    MORDOR_TEST_ASSERT_EQUAL(fiber->state(), Fiber::TERM);
+    // Both halves of its 40ms spin, give or take the clock's granularity
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(fiber->cpuTime(), 30000u);
+    fiber->reset();
+    MORDOR_TEST_ASSERT_EQUAL(fiber->cpuTime(), 0u);
+}
+
+static void accumulate(size_t count, long long &intTotal, double &doubleTotal)
+{
+    long long i1 = 0, i2 = 1, i3 = 2, i4 = 3, i5 = 4, i6 = 5;
+    double d1 = 0.5, d2 = 1.5, d3 = 2.5, d4 = 3.5;
+    for (size_t i = 0; i < count; ++i) {
+        i1 += 1; i2 += 2; i3 += 3; i4 += 4; i5 += 5; i6 += 6;
+        d1 += 1.0; d2 += 2.0; d3 += 3.0; d4 += 4.0;
+        Fiber::yield();
+    }
+    intTotal = i1 + i2 + i3 + i4 + i5 + i6;
+    doubleTotal = d1 + d2 + d3 + d4;
+}
+
+// Values live across a switch survive it, on both sides
+MORDOR_UNITTEST(Fibers, registersPreserved)
+{
+    long long fiberInt = 0;
+    double fiberDouble = 0.0;
+    Fiber::ptr fiber(new Fiber(boost::bind(&accumulate, 1000,
+        boost::ref(fiberInt), boost::ref(fiberDouble))));
+    long long i1 = 0, i2 = -1, i3 = -2, i4 = -3, i5 = -4, i6 = -5;
+    double d1 = -0.5, d2 = -1.5, d3 = -2.5, d4 = -3.5;
+    for (int i = 0; i < 1000; ++i) {
+        i1 -= 1; i2 -= 2; i3 -= 3; i4 -= 4; i5 -= 5; i6 -= 6;
+        d1 -= 1.0; d2 -= 2.0; d3 -= 3.0; d4 -= 4.0;
+        fiber->call();
+    }
+    fiber->call();
+    MORDOR_TEST_ASSERT(fiber->state() == Fiber::TERM);
+    MORDOR_TEST_ASSERT_EQUAL(fiberInt, 21015ll);
+    MORDOR_TEST_ASSERT_EQUAL(fiberDouble, 10008.0);
+    MORDOR_TEST_ASSERT_EQUAL(i1 + i2 + i3 + i4 + i5 + i6, -21015ll);
+    MORDOR_TEST_ASSERT_EQUAL(d1 + d2 + d3 + d4, -10008.0);
+}
+
+#ifdef POSIX
+static void changeRounding(int &sequence)
+{
+    MORDOR_TEST_ASSERT_EQUAL(fegetround(), FE_TONEAREST);
+    fesetround(FE_UPWARD);
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, 1);
+    Fiber::yield();
+    MORDOR_TEST_ASSERT_EQUAL(fegetround(), FE_UPWARD);
+    fesetround(FE_TONEAREST);
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, 3);
+}
+
+// The floating point rounding mode belongs to the Fiber
+MORDOR_UNITTEST(Fibers, roundingModePreserved)
+{
+    int sequence = 0;
+    Fiber::ptr fiber(new Fiber(boost::bind(&changeRounding,
+        boost::ref(sequence))));
+    fiber->call();
+    MORDOR_TEST_ASSERT_EQUAL(fegetround(), FE_TONEAREST);
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, 2);
+    fiber->call();
+    MORDOR_TEST_ASSERT_EQUAL(fegetround(), FE_TONEAREST);
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, 4);
+}
+#endif
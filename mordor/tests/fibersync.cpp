@@ -49,6 +49,63 @@ MORDOR_UNITTEST(FiberMutex, contention)
     MORDOR_TEST_ASSERT_EQUAL(++sequence, 8);
 }
 
+static void lockAndIncrement(FiberMutex &mutex, int &counter, int &inside,
+    int iterations)
+{
+    for (int i = 0; i < iterations; ++i) {
+        FiberMutex::ScopedLock lock(mutex);
+        MORDOR_TEST_ASSERT_EQUAL(++inside, 1);
+        ++counter;
+        if (i % 16 == 0)
+            Scheduler::yield();
+        --inside;
+    }
+}
+
+MORDOR_UNITTEST(FiberMutex, threadedContention)
+{
+    // Mixes the fast path, spinning, and queueing across threads
+    int counter = 0, inside = 0;
+    FiberMutex mutex;
+    {
+        WorkerPool pool(4);
+        for (int i = 0; i < 16; ++i)
+            pool.schedule(boost::bind(&lockAndIncrement, boost::ref(mutex),
+                boost::ref(counter), boost::ref(inside), 1000));
+    }
+    MORDOR_TEST_ASSERT_EQUAL(counter, 16 * 1000);
+}
+
+static void lockAndRecord(FiberMutex &mutex, std::vector<int> &order,
+    int value, Scheduler::Priority priority)
+{
+    Scheduler::priority(priority);
+    FiberMutex::ScopedLock lock(mutex);
+    order.push_back(value);
+}
+
+MORDOR_UNITTEST(FiberMutex, priority)
+{
+    std::vector<int> order;
+    WorkerPool pool;
+    FiberMutex mutex;
+    {
+        FiberMutex::ScopedLock lock(mutex);
+        pool.schedule(boost::bind(&lockAndRecord, boost::ref(mutex),
+            boost::ref(order), 3, Scheduler::LOW));
+        pool.schedule(boost::bind(&lockAndRecord, boost::ref(mutex),
+            boost::ref(order), 2, Scheduler::NORMAL));
+        pool.schedule(boost::bind(&lockAndRecord, boost::ref(mutex),
+            boost::ref(order), 1, Scheduler::HIGH));
+        pool.dispatch();
+        MORDOR_TEST_ASSERT(order.empty());
+    }
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(order.size(), 3u);
+    for (int i = 0; i < 3; ++i)
+        MORDOR_TEST_ASSERT_EQUAL(order[i], i + 1);
+}
+
 #ifdef DEBUG
 MORDOR_UNITTEST(FiberMutex, notRecursive)
 {
@@ -199,3 +256,91 @@ MORDOR_UNITTEST(FiberMutex, unlockUnique)
     MORDOR_TEST_ASSERT(lock.unlockIfNotUnique());
     pool.dispatch();
 }
+
+static void readIt(FiberRWMutex &mutex, int &sequence, int expected)
+{
+    FiberRWMutex::SharedScopedLock lock(mutex);
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, expected);
+    // Everyone else gets a chance to run while we hold it
+    Scheduler::yield();
+}
+
+MORDOR_UNITTEST(FiberRWMutex, sharedReaders)
+{
+    int sequence = 0;
+    WorkerPool pool;
+    FiberRWMutex mutex;
+
+    FiberRWMutex::SharedScopedLock lock(mutex);
+    pool.schedule(boost::bind(&readIt, boost::ref(mutex),
+        boost::ref(sequence), 1));
+    pool.schedule(boost::bind(&readIt, boost::ref(mutex),
+        boost::ref(sequence), 2));
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, 3);
+}
+
+static void writeIt(FiberRWMutex &mutex, int &sequence, int expected)
+{
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, expected);
+    FiberRWMutex::ScopedLock lock(mutex);
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, expected + 3);
+}
+
+static void readAfterWriter(FiberRWMutex &mutex, int &sequence)
+{
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, 3);
+    FiberRWMutex::SharedScopedLock lock(mutex);
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, 6);
+}
+
+MORDOR_UNITTEST(FiberRWMutex, writerPreference)
+{
+    int sequence = 0;
+    WorkerPool pool;
+    FiberRWMutex mutex;
+
+    {
+        FiberRWMutex::SharedScopedLock lock(mutex);
+        MORDOR_TEST_ASSERT_EQUAL(++sequence, 1);
+        pool.schedule(boost::bind(&writeIt, boost::ref(mutex),
+            boost::ref(sequence), 2));
+        // Has to wait for the writer, even though only readers hold it
+        pool.schedule(boost::bind(&readAfterWriter, boost::ref(mutex),
+            boost::ref(sequence)));
+        pool.dispatch();
+        MORDOR_TEST_ASSERT_EQUAL(++sequence, 4);
+    }
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, 7);
+    FiberRWMutex::ScopedLock lock(mutex);
+}
+
+static void waitSemaphore(FiberSemaphore &semaphore, int &sequence,
+    int expected)
+{
+    semaphore.wait();
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, expected);
+}
+
+MORDOR_UNITTEST(FiberSemaphore, counting)
+{
+    int sequence = 0;
+    WorkerPool pool;
+    FiberSemaphore semaphore(1);
+
+    pool.schedule(boost::bind(&waitSemaphore, boost::ref(semaphore),
+        boost::ref(sequence), 1));
+    pool.schedule(boost::bind(&waitSemaphore, boost::ref(semaphore),
+        boost::ref(sequence), 2));
+    pool.schedule(boost::bind(&waitSemaphore, boost::ref(semaphore),
+        boost::ref(sequence), 3));
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 1);
+    semaphore.notify();
+    semaphore.notify();
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 3);
+    semaphore.notify();
+    semaphore.wait();
+}
@@ -0,0 +1,152 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#ifdef LINUX
+
+#include <boost/bind.hpp>
+
+#include "mordor/exception.h"
+#include "mordor/iomanager.h"
+#include "mordor/sleep.h"
+#include "mordor/socket.h"
+#include "mordor/statistics.h"
+#include "mordor/test/test.h"
+
+using namespace Mordor;
+using namespace Mordor::Test;
+
+static void
+fired(int &sequence, int expected)
+{
+    ++sequence;
+    MORDOR_TEST_ASSERT_EQUAL(sequence, expected);
+}
+
+MORDOR_UNITTEST(IOManager, edgeTriggeredReadinessRemembered)
+{
+    int fds[2];
+    if (pipe(fds))
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("pipe");
+    int sequence = 0;
+    try {
+        IOManager manager;
+        manager.registerFd(fds[0]);
+        manager.registerEvent(fds[0], IOManager::READ,
+            boost::bind(&fired, boost::ref(sequence), 1));
+        MORDOR_TEST_ASSERT_EQUAL(write(fds[1], "a", 1), 1);
+        manager.dispatch();
+        MORDOR_TEST_ASSERT_EQUAL(sequence, 1);
+
+        // Readable again while nobody is waiting; let idle() see it
+        MORDOR_TEST_ASSERT_EQUAL(write(fds[1], "b", 1), 1);
+        manager.registerTimer(50000,
+            boost::bind(&fired, boost::ref(sequence), 2));
+        manager.dispatch();
+        MORDOR_TEST_ASSERT_EQUAL(sequence, 2);
+
+        // There won't be another edge, so this only works if it was
+        // remembered
+        manager.registerEvent(fds[0], IOManager::READ,
+            boost::bind(&fired, boost::ref(sequence), 3));
+        manager.dispatch();
+        MORDOR_TEST_ASSERT_EQUAL(sequence, 3);
+        manager.unregisterFd(fds[0]);
+    } catch (...) {
+        close(fds[0]);
+        close(fds[1]);
+        throw;
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+#ifdef IO_URING
+static void
+writeByte(int fd)
+{
+    MORDOR_TEST_ASSERT_EQUAL(write(fd, "a", 1), 1);
+}
+
+MORDOR_UNITTEST(IOManager, ioUringRead)
+{
+    IOManager manager;
+    // Kernel too old; everything falls back to epoll
+    if (!manager.asyncIo())
+        return;
+    int fds[2];
+    if (pipe(fds))
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("pipe");
+    try {
+        char buffer;
+        iovec iov;
+        iov.iov_base = &buffer;
+        iov.iov_len = 1;
+        io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(io_uring_sqe));
+        sqe.opcode = IORING_OP_READV;
+        sqe.fd = fds[0];
+        sqe.addr = (uintptr_t)&iov;
+        sqe.len = 1;
+        sqe.off = (__u64)-1;
+
+        // Suspends until the write
+        manager.schedule(boost::bind(&writeByte, fds[1]));
+        MORDOR_TEST_ASSERT_EQUAL(manager.performIo(fds[0], IOManager::READ,
+            sqe), 1);
+        MORDOR_TEST_ASSERT_EQUAL(buffer, 'a');
+        // Completes immediately
+        writeByte(fds[1]);
+        MORDOR_TEST_ASSERT_EQUAL(manager.performIo(fds[0], IOManager::READ,
+            sqe), 1);
+        // Never completes
+        MORDOR_TEST_ASSERT_EQUAL(manager.performIo(fds[0], IOManager::READ,
+            sqe, 50000), -ETIMEDOUT);
+    } catch (...) {
+        close(fds[0]);
+        close(fds[1]);
+        throw;
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void
+remoteClosed()
+{}
+
+MORDOR_UNITTEST(IOManager, ioUringSocketSkipsEpoll)
+{
+    IOManager manager;
+    if (!manager.asyncIo())
+        return;
+    CountStatistic<unsigned long long> *fdEvents =
+        dynamic_cast<CountStatistic<unsigned long long> *>(
+        Statistics::lookup("iomanager.fdevents"));
+    MORDOR_TEST_ASSERT(fdEvents);
+
+    std::vector<Address::ptr> addresses = Address::lookup("localhost",
+        AF_UNSPEC, SOCK_STREAM);
+    MORDOR_TEST_ASSERT(!addresses.empty());
+    Socket::ptr listen = addresses.front()->createSocket(manager);
+    listen->bind(addresses.front());
+    listen->listen();
+    Socket::ptr connect = addresses.front()->createSocket(manager);
+    connect->connect(listen->localAddress());
+    Socket::ptr accept = listen->accept();
+    // Waiting for CLOSE falls back to epoll; that must not drag READ along
+    connect->onRemoteClose(&remoteClosed);
+    accept->onRemoteClose(&remoteClosed);
+
+    unsigned long long before = fdEvents->count;
+    for (int i = 0; i < 10; ++i) {
+        MORDOR_TEST_ASSERT_EQUAL(accept->send("a", 1), 1u);
+        // Give idle() a chance to see the arrival, if epoll is watching
+        sleep(manager, 1000);
+        char buffer;
+        MORDOR_TEST_ASSERT_EQUAL(connect->receive(&buffer, 1), 1u);
+        MORDOR_TEST_ASSERT_EQUAL(buffer, 'a');
+    }
+    MORDOR_TEST_ASSERT_EQUAL(fdEvents->count, before);
+}
+#endif
+
+#endif
@@ -0,0 +1,112 @@
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include "mordor/pch.h"
+
+#include <unistd.h>
+
+#include "mordor/streams/buffer.h"
+#include "mordor/streams/mmap.h"
+#include "mordor/streams/temp.h"
+#include "mordor/test/test.h"
+
+using namespace Mordor;
+using namespace Mordor::Test;
+
+static std::string pattern(size_t length)
+{
+    std::string result(length, '\0');
+    for (size_t i = 0; i < length; ++i)
+        result[i] = (char)('a' + i % 26);
+    return result;
+}
+
+static void writeAll(Stream &stream, const std::string &data)
+{
+    Buffer buffer(data);
+    while (buffer.readAvailable() > 0)
+        buffer.consume(stream.write(buffer, buffer.readAvailable()));
+}
+
+MORDOR_UNITTEST(MMapStream, readIntoBuffer)
+{
+    TempStream temp;
+    std::string data = pattern(100000);
+    writeAll(temp, data);
+    MMapStream stream(temp.fd(), false);
+    MORDOR_TEST_ASSERT_EQUAL(stream.size(), 100000);
+    Buffer buffer;
+    while (stream.read(buffer, 65536) != 0);
+    MORDOR_TEST_ASSERT_EQUAL(buffer.readAvailable(), 100000u);
+    MORDOR_TEST_ASSERT(buffer == data);
+    // Consecutive reads from one window stay a single segment
+    MORDOR_TEST_ASSERT_EQUAL(buffer.segments(), 1u);
+}
+
+MORDOR_UNITTEST(MMapStream, readIntoMemory)
+{
+    TempStream temp;
+    std::string data = pattern(10000);
+    writeAll(temp, data);
+    MMapStream stream(temp.fd(), false);
+    std::string result(10000, '\0');
+    MORDOR_TEST_ASSERT_EQUAL(stream.read(&result[0], 10000), 10000u);
+    MORDOR_TEST_ASSERT(result == data);
+    MORDOR_TEST_ASSERT_EQUAL(stream.read(&result[0], 10000), 0u);
+}
+
+MORDOR_UNITTEST(MMapStream, windows)
+{
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    TempStream temp;
+    std::string data = pattern(pageSize * 3 + 100);
+    writeAll(temp, data);
+    Buffer buffer;
+    {
+        ConfigOverride windowSize("mmapstream.windowsize", "1");
+        MMapStream stream(temp.fd(), false);
+        // Windows are a page, so reads stop at their edges
+        MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 100), 100u);
+        MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, pageSize), pageSize - 100);
+        MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, pageSize * 3),
+            pageSize);
+        MORDOR_TEST_ASSERT_EQUAL(stream.seek(pageSize * 3 - 10),
+            (long long)(pageSize * 3 - 10));
+        MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 1000), 10u);
+        MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 1000), 100u);
+        MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 1000), 0u);
+    }
+    // The mappings outlive the stream
+    MORDOR_TEST_ASSERT(buffer == data.substr(0, pageSize * 2) +
+        data.substr(pageSize * 3 - 10));
+}
+
+MORDOR_UNITTEST(MMapStream, seekAndSize)
+{
+    TempStream temp;
+    std::string data = pattern(1000);
+    writeAll(temp, data);
+    MMapStream stream(temp.fd(), false);
+    MORDOR_TEST_ASSERT_EQUAL(stream.seek(-10, Stream::END), 990);
+    MORDOR_TEST_ASSERT_EQUAL(stream.seek(-90, Stream::CURRENT), 900);
+    Buffer buffer;
+    MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 1000), 100u);
+    MORDOR_TEST_ASSERT(buffer == data.substr(900));
+    MORDOR_TEST_ASSERT_EXCEPTION(stream.seek(-1), std::invalid_argument);
+    // Past the end just reads nothing
+    MORDOR_TEST_ASSERT_EQUAL(stream.seek(2000), 2000);
+    MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 1000), 0u);
+
+    // Growing the file is noticed
+    stream.seek(1000);
+    writeAll(temp, "hello");
+    MORDOR_TEST_ASSERT_EQUAL(stream.size(), 1005);
+    buffer.clear();
+    MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 1000), 5u);
+    MORDOR_TEST_ASSERT(buffer == "hello");
+}
+
+MORDOR_UNITTEST(MMapStream, openFailure)
+{
+    MORDOR_TEST_ASSERT_EXCEPTION(MMapStream stream("/nonexistent/mordor"),
+        FileNotFoundException);
+}
@@ -0,0 +1,159 @@
+// Copyright (c) 2010 - Mozy, Inc.
+
+#include <boost/bind.hpp>
+
+#include "mordor/atomic.h"
+#include "mordor/fibersynchronization.h"
+#include "mordor/iomanager.h"
+#include "mordor/offload.h"
+#include "mordor/parallel.h"
+#include "mordor/sleep.h"
+#include "mordor/statistics.h"
+#include "mordor/test/test.h"
+#include "mordor/workerpool.h"
+
+using namespace Mordor;
+using namespace Mordor::Test;
+
+static void recordScheduler(Scheduler *&scheduler)
+{
+    scheduler = Scheduler::getThis();
+}
+
+MORDOR_UNITTEST(Offload, inlineWithoutOffload)
+{
+    WorkerPool pool;
+    Scheduler *scheduler = NULL;
+    Offload::run(Offload::BLOCKING,
+        boost::bind(&recordScheduler, boost::ref(scheduler)));
+    MORDOR_TEST_ASSERT_EQUAL(scheduler, &pool);
+}
+
+MORDOR_UNITTEST(Offload, switchesAndReturns)
+{
+    WorkerPool pool;
+    Offload offload(1, 1);
+    Scheduler *blocking = NULL, *cpu = NULL;
+    Offload::run(Offload::BLOCKING,
+        boost::bind(&recordScheduler, boost::ref(blocking)));
+    MORDOR_TEST_ASSERT_EQUAL(Scheduler::getThis(), &pool);
+    Offload::run(Offload::CPU, boost::bind(&recordScheduler, boost::ref(cpu)));
+    MORDOR_TEST_ASSERT_EQUAL(Scheduler::getThis(), &pool);
+    MORDOR_TEST_ASSERT(blocking);
+    MORDOR_TEST_ASSERT(cpu);
+    MORDOR_TEST_ASSERT_NOT_EQUAL(blocking, &pool);
+    MORDOR_TEST_ASSERT_NOT_EQUAL(cpu, &pool);
+    MORDOR_TEST_ASSERT_NOT_EQUAL(blocking, cpu);
+    MORDOR_TEST_ASSERT_EQUAL(offload.pending(Offload::BLOCKING), 0u);
+}
+
+static int add(int a, int b)
+{
+    return a + b;
+}
+
+static void throwException()
+{
+    MORDOR_THROW_EXCEPTION(OperationAbortedException());
+}
+
+MORDOR_UNITTEST(Offload, resultsAndExceptions)
+{
+    WorkerPool pool;
+    Offload offload(1, 1);
+    MORDOR_TEST_ASSERT_EQUAL(Offload::run<int>(Offload::CPU,
+        boost::bind(&add, 1, 2)), 3);
+    MORDOR_TEST_ASSERT_EXCEPTION(Offload::run(Offload::CPU, &throwException),
+        OperationAbortedException);
+    MORDOR_TEST_ASSERT_EQUAL(Scheduler::getThis(), &pool);
+    MORDOR_TEST_ASSERT_EQUAL(offload.pending(Offload::CPU), 0u);
+}
+
+static void blockingSleep(FiberEvent &done)
+{
+    Offload::run(Offload::BLOCKING,
+        boost::bind((void (*)(unsigned long long))&sleep, 100000ull));
+    done.set();
+}
+
+MORDOR_UNITTEST(Offload, ioManagerKeepsRunning)
+{
+    IOManager ioManager;
+    Offload offload(1, 1);
+    FiberEvent done;
+    ioManager.schedule(boost::bind(&blockingSleep, boost::ref(done)));
+    // The IOManager's only thread isn't blocked while the call sleeps
+    unsigned long long start = TimerManager::now();
+    sleep(ioManager, 10000);
+    MORDOR_TEST_ASSERT_LESS_THAN(TimerManager::now() - start, 100000u);
+    done.wait();
+}
+
+static void track(volatile size_t &running, volatile size_t &maxRunning)
+{
+    size_t now = atomicIncrement(running);
+    if (now > maxRunning)
+        maxRunning = now;
+    sleep(10000ull);
+    atomicDecrement(running);
+}
+
+static void offloadTrack(volatile size_t &running,
+    volatile size_t &maxRunning)
+{
+    Offload::run(Offload::BLOCKING, boost::bind(&track, boost::ref(running),
+        boost::ref(maxRunning)));
+}
+
+MORDOR_UNITTEST(Offload, queueLimit)
+{
+    ConfigOverride maxQueue("offload.blocking.maxqueue", "0");
+    CountStatistic<unsigned long long> *waits =
+        dynamic_cast<CountStatistic<unsigned long long> *>(
+            Statistics::lookup("offload.blocking.waits"));
+    MORDOR_TEST_ASSERT(waits);
+    unsigned long long previousWaits = waits->count;
+    WorkerPool pool;
+    {
+        Offload offload(2, 1);
+        volatile size_t running = 0, maxRunning = 0;
+        TaskGroup group(8);
+        for (int i = 0; i < 8; ++i)
+            group.run(boost::bind(&offloadTrack, boost::ref(running),
+                boost::ref(maxRunning)));
+        group.wait();
+        MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(maxRunning, 2u);
+        MORDOR_TEST_ASSERT_EQUAL(offload.pending(Offload::BLOCKING), 0u);
+    }
+    // Only two could be admitted at once; the rest had to wait
+    MORDOR_TEST_ASSERT_GREATER_THAN(waits->count, previousWaits);
+}
+
+static void countedSleep(volatile size_t &ran)
+{
+    sleep(10000ull);
+    atomicIncrement(ran);
+}
+
+static void offloadCountedSleep(volatile size_t &ran)
+{
+    Offload::run(Offload::BLOCKING, boost::bind(&countedSleep,
+        boost::ref(ran)));
+}
+
+MORDOR_UNITTEST(Offload, destroyWithWaiters)
+{
+    ConfigOverride maxQueue("offload.blocking.maxqueue", "0");
+    WorkerPool pool;
+    volatile size_t ran = 0;
+    {
+        Offload offload(1, 1);
+        for (int i = 0; i < 4; ++i)
+            pool.schedule(boost::bind(&offloadCountedSleep, boost::ref(ran)));
+        // Let them all get as far as running, or waiting for a slot
+        Scheduler::yield();
+        MORDOR_TEST_ASSERT_EQUAL(offload.pending(Offload::BLOCKING), 4u);
+    }
+    // ~Offload let the waiters through before tearing down the pool
+    MORDOR_TEST_ASSERT_EQUAL(ran, 4u);
+}
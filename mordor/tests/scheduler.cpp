@@ -1,5 +1,8 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <set>
+#include <stdexcept>
+
 #include <boost/bind.hpp>
 
 #include "mordor/atomic.h"
@@ -7,6 +10,7 @@
 #include "mordor/iomanager.h"
 #include "mordor/parallel.h"
 #include "mordor/sleep.h"
+#include "mordor/statistics.h"
 #include "mordor/test/test.h"
 #include "mordor/workerpool.h"
 
@@ -309,6 +313,115 @@ MORDOR_UNITTEST(Scheduler, parallelForEachException)
     MORDOR_TEST_ASSERT_EQUAL(sequence, 9);
 }
 
+namespace {
+struct Concurrency
+{
+    Concurrency() : running(0), maxRunning(0), completed(0) {}
+
+    int running, maxRunning, completed;
+    std::set<Fiber *> fibers;
+};
+}
+
+static void concurrentTask(Concurrency &concurrency)
+{
+    concurrency.fibers.insert(Fiber::getThis().get());
+    concurrency.maxRunning = std::max(++concurrency.running,
+        concurrency.maxRunning);
+    Scheduler::yield();
+    Scheduler::yield();
+    --concurrency.running;
+    ++concurrency.completed;
+}
+
+MORDOR_UNITTEST(Scheduler, taskGroup)
+{
+    WorkerPool pool;
+    Concurrency concurrency;
+    TaskGroup group(3);
+    for (size_t i = 0; i < 10; ++i)
+        MORDOR_TEST_ASSERT_EQUAL(group.run(boost::bind(&concurrentTask,
+            boost::ref(concurrency))), i);
+    std::set<size_t> ids;
+    size_t id;
+    while (group.next(id))
+        MORDOR_TEST_ASSERT(ids.insert(id).second);
+    MORDOR_TEST_ASSERT_EQUAL(ids.size(), 10u);
+    MORDOR_TEST_ASSERT_EQUAL(concurrency.completed, 10);
+    MORDOR_TEST_ASSERT_EQUAL(concurrency.maxRunning, 3);
+
+    // The next batch reuses the same Fibers
+    for (size_t i = 0; i < 10; ++i)
+        MORDOR_TEST_ASSERT_EQUAL(group.run(boost::bind(&concurrentTask,
+            boost::ref(concurrency))), i);
+    group.wait();
+    MORDOR_TEST_ASSERT_EQUAL(concurrency.completed, 20);
+    MORDOR_TEST_ASSERT_EQUAL(concurrency.fibers.size(), 3u);
+}
+
+static void failingTask(int &started)
+{
+    ++started;
+    Scheduler::yield();
+    MORDOR_THROW_EXCEPTION(std::runtime_error("backend failed"));
+}
+
+static void slowTask(int &started)
+{
+    ++started;
+    while (true) {
+        Deadline::throwIfReached();
+        Scheduler::yield();
+    }
+}
+
+MORDOR_UNITTEST(Scheduler, taskGroupCancelOnError)
+{
+    WorkerPool pool;
+    int started = 0;
+    TaskGroup group(2);
+    group.run(boost::bind(&slowTask, boost::ref(started)));
+    group.run(boost::bind(&failingTask, boost::ref(started)));
+    for (int i = 0; i < 5; ++i)
+        group.run(boost::bind(&slowTask, boost::ref(started)));
+    MORDOR_TEST_ASSERT_EXCEPTION(group.wait(), std::runtime_error);
+    // Queued tasks never started, and the running one was interrupted
+    MORDOR_TEST_ASSERT_EQUAL(started, 2);
+
+    // And the group is usable again
+    started = 0;
+    group.run(boost::bind(&slowTask, boost::ref(started)));
+    Scheduler::yield();
+    MORDOR_TEST_ASSERT_EQUAL(started, 1);
+    group.cancel();
+    size_t id;
+    MORDOR_TEST_ASSERT_EXCEPTION(group.next(id), OperationAbortedException);
+    MORDOR_TEST_ASSERT_EQUAL(id, 0u);
+    MORDOR_TEST_ASSERT(!group.next(id));
+}
+
+MORDOR_UNITTEST(Scheduler, taskGroupRunAfterCancel)
+{
+    WorkerPool pool;
+    int started = 0;
+    TaskGroup group(2);
+    group.run(boost::bind(&slowTask, boost::ref(started)));
+    Scheduler::yield();
+    group.cancel();
+    // The batch hasn't drained yet, so this would never be reported
+    MORDOR_TEST_ASSERT_EXCEPTION(group.run(boost::bind(&slowTask,
+        boost::ref(started))), OperationAbortedException);
+    size_t id;
+    MORDOR_TEST_ASSERT_EXCEPTION(group.next(id), OperationAbortedException);
+    MORDOR_TEST_ASSERT_EQUAL(id, 0u);
+    MORDOR_TEST_ASSERT(!group.next(id));
+    MORDOR_TEST_ASSERT_EQUAL(started, 1);
+
+    // Once it has, the next batch starts fresh
+    MORDOR_TEST_ASSERT_EQUAL(group.run(&doNothing), 0u);
+    group.wait();
+}
+
 #ifdef DEBUG
 MORDOR_UNITTEST(Scheduler, scheduleForThreadNotOnScheduler)
 {
@@ -403,3 +516,231 @@ MORDOR_UNITTEST(Scheduler, spreadTheLoadWhileStopping)
     // Make sure we hit every thread
     MORDOR_TEST_ASSERT_EQUAL(threads.size(), 4u);
 }
+
+static void scheduleThenBlock(std::set<tid_t> &threads, boost::mutex &mutex,
+    tid_t &blocked)
+{
+    blocked = gettid();
+    for (size_t i = 0; i < 6; ++i)
+        Scheduler::getThis()->schedule(boost::bind(&sleepForABit,
+            boost::ref(threads), boost::ref(mutex), Fiber::ptr(),
+            (int *)NULL));
+    // Don't give this thread a chance to run them itself
+    Mordor::sleep(500000);
+}
+
+MORDOR_UNITTEST(Scheduler, stealFromBusyThread)
+{
+    std::set<tid_t> threads;
+    tid_t blocked = emptytid();
+    {
+        boost::mutex mutex;
+        WorkerPool pool(4, false);
+        // Wait for the other threads to get to idle first
+        Mordor::sleep(100000);
+
+        pool.schedule(boost::bind(&scheduleThenBlock, boost::ref(threads),
+            boost::ref(mutex), boost::ref(blocked)));
+        pool.stop();
+    }
+    // Everything was stolen by the other threads
+    MORDOR_TEST_ASSERT_EQUAL(threads.size(), 3u);
+    MORDOR_TEST_ASSERT(threads.find(blocked) == threads.end());
+}
+
+static void checkThread(tid_t thread, int &count)
+{
+    MORDOR_TEST_ASSERT_EQUAL(gettid(), thread);
+    ++count;
+}
+
+MORDOR_UNITTEST(Scheduler, threadTargetedWorkIsNotStolen)
+{
+    int count = 0;
+    WorkerPool pool(4);
+    // Wait for the other threads to get to idle first
+    Mordor::sleep(100000);
+    for (int i = 0; i < 100; ++i)
+        pool.schedule(boost::bind(&checkThread, gettid(), boost::ref(count)),
+            gettid());
+    pool.stop();
+    MORDOR_TEST_ASSERT_EQUAL(count, 100);
+}
+
+static size_t allocations(const char *name)
+{
+    CountStatistic<size_t> *stat = dynamic_cast<CountStatistic<size_t> *>(
+        Statistics::lookup(name));
+    MORDOR_ASSERT(stat);
+    return stat->count;
+}
+
+static void incrementThenYield(int &total)
+{
+    ++total;
+    Scheduler::yield();
+}
+
+static void scheduleIncrements(Scheduler &scheduler, int &total)
+{
+    for (int i = 0; i < 100; ++i)
+        scheduler.schedule(boost::bind(&increment, boost::ref(total)));
+    scheduler.schedule(boost::bind(&incrementThenYield, boost::ref(total)));
+}
+
+MORDOR_UNITTEST(Scheduler, scheduleDelegatesWithoutAllocating)
+{
+    int total = 0;
+    WorkerPool pool;
+    // Prime the caches
+    scheduleIncrements(pool, total);
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(total, 101);
+
+    size_t tasks = allocations("scheduler.taskallocs");
+    size_t runners = allocations("scheduler.runnerallocs");
+    scheduleIncrements(pool, total);
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(total, 202);
+    MORDOR_TEST_ASSERT_EQUAL(allocations("scheduler.taskallocs"), tasks);
+    MORDOR_TEST_ASSERT_EQUAL(allocations("scheduler.runnerallocs"), runners);
+}
+
+MORDOR_UNITTEST(Scheduler, statistics)
+{
+    int total = 0;
+    WorkerPool pool;
+    CountStatistic<unsigned long long> *runs =
+        dynamic_cast<CountStatistic<unsigned long long> *>(
+        Statistics::lookup("scheduler.runs"));
+    MORDOR_TEST_ASSERT(runs);
+    unsigned long long globalRuns = runs->count;
+
+    scheduleIncrements(pool, total);
+    std::vector<Scheduler::ThreadStatistics> before = pool.statistics();
+    MORDOR_TEST_ASSERT_EQUAL(before.size(), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(before[0].thread, gettid());
+    MORDOR_TEST_ASSERT_EQUAL(before[0].queueDepth, 101u);
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(total, 101);
+
+    std::vector<Scheduler::ThreadStatistics> after = pool.statistics();
+    MORDOR_TEST_ASSERT_EQUAL(after.size(), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(after[0].queueDepth, 0u);
+    // Every delegate, plus the yielding one coming back
+    MORDOR_TEST_ASSERT_EQUAL(after[0].runs - before[0].runs, 102u);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(after[0].maxQueueDepth, 101u);
+    unsigned long long latencies = 0;
+    for (size_t i = 0; i < HistogramStatistic<unsigned long long>::BUCKETS;
+        ++i)
+        latencies += after[0].latencyHistogram[i] -
+            before[0].latencyHistogram[i];
+    MORDOR_TEST_ASSERT_EQUAL(latencies, 102u);
+    // Reported when the thread went idle at the end of dispatch()
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(runs->count - globalRuns, 102u);
+}
+
+static void record(std::vector<int> &order, int value)
+{
+    order.push_back(value);
+}
+
+MORDOR_UNITTEST(Scheduler, priorities)
+{
+    std::vector<int> order;
+    WorkerPool pool;
+    pool.schedule(boost::bind(&record, boost::ref(order), 5), emptytid(),
+        Scheduler::LOW);
+    pool.schedule(boost::bind(&record, boost::ref(order), 3));
+    pool.schedule(boost::bind(&record, boost::ref(order), 1), emptytid(),
+        Scheduler::HIGH);
+    pool.schedule(boost::bind(&record, boost::ref(order), 6), emptytid(),
+        Scheduler::LOW);
+    pool.schedule(boost::bind(&record, boost::ref(order), 4));
+    pool.schedule(boost::bind(&record, boost::ref(order), 2), emptytid(),
+        Scheduler::HIGH);
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(order.size(), 6u);
+    for (int i = 0; i < 6; ++i)
+        MORDOR_TEST_ASSERT_EQUAL(order[i], i + 1);
+}
+
+static void recordPriority(std::vector<int> &order)
+{
+    order.push_back(Scheduler::priority());
+    // Comes back at the same priority
+    Scheduler::yield();
+    order.push_back(Scheduler::priority());
+}
+
+MORDOR_UNITTEST(Scheduler, priorityInherited)
+{
+    std::vector<int> order;
+    WorkerPool pool;
+    MORDOR_TEST_ASSERT_EQUAL(Scheduler::priority(), Scheduler::NORMAL);
+    Scheduler::priority(Scheduler::HIGH);
+    try {
+        pool.schedule(boost::bind(&recordPriority, boost::ref(order)));
+    } catch (...) {
+        Scheduler::priority(Scheduler::NORMAL);
+        throw;
+    }
+    Scheduler::priority(Scheduler::NORMAL);
+    pool.schedule(boost::bind(&recordPriority, boost::ref(order)));
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(order.size(), 4u);
+    MORDOR_TEST_ASSERT_EQUAL(order[0], Scheduler::HIGH);
+    MORDOR_TEST_ASSERT_EQUAL(order[1], Scheduler::HIGH);
+    MORDOR_TEST_ASSERT_EQUAL(order[2], Scheduler::NORMAL);
+    MORDOR_TEST_ASSERT_EQUAL(order[3], Scheduler::NORMAL);
+}
+
+MORDOR_UNITTEST(Scheduler, lowPriorityNotStarved)
+{
+    std::vector<int> order;
+    WorkerPool pool;
+    {
+        ConfigOverride limit("scheduler.starvationlimit", "2");
+        pool.schedule(boost::bind(&record, boost::ref(order), 0), emptytid(),
+            Scheduler::LOW);
+        for (int i = 1; i <= 5; ++i)
+            pool.schedule(boost::bind(&record, boost::ref(order), i),
+                emptytid(), Scheduler::HIGH);
+        pool.dispatch();
+    }
+    MORDOR_TEST_ASSERT_EQUAL(order.size(), 6u);
+    MORDOR_TEST_ASSERT_EQUAL(order[0], 1);
+    MORDOR_TEST_ASSERT_EQUAL(order[1], 2);
+    MORDOR_TEST_ASSERT_EQUAL(order[2], 0);
+    MORDOR_TEST_ASSERT_EQUAL(order[3], 3);
+}
+
+#ifdef LINUX
+static void checkPinned(std::vector<unsigned int> &processors)
+{
+    cpu_set_t set;
+    MORDOR_TEST_ASSERT_EQUAL(sched_getaffinity(0, sizeof(cpu_set_t), &set),
+        0);
+    for (unsigned int i = 0; i < CPU_SETSIZE; ++i)
+        if (CPU_ISSET(i, &set))
+            processors.push_back(i);
+}
+
+MORDOR_UNITTEST(Scheduler, affinity)
+{
+    MORDOR_TEST_ASSERT_LESS_THAN(currentNumaNode(), numaNodeCount());
+    std::vector<unsigned int> node0 = numaNodeProcessors(0);
+    MORDOR_TEST_ASSERT(!node0.empty());
+
+    std::vector<unsigned int> processors;
+    {
+        ConfigOverride affinity("scheduler.affinity", "cpu");
+        WorkerPool pool(1, false);
+        pool.schedule(boost::bind(&checkPinned, boost::ref(processors)));
+        pool.stop();
+    }
+    // The first thread goes on the first processor of the first node
+    MORDOR_TEST_ASSERT_EQUAL(processors.size(), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(processors[0], node0[0]);
+}
+#endif
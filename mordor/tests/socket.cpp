@@ -5,9 +5,12 @@
 #include <boost/scoped_array.hpp>
 #include <boost/shared_array.hpp>
 
+#include "mordor/deadline.h"
 #include "mordor/exception.h"
 #include "mordor/fiber.h"
 #include "mordor/iomanager.h"
+#include "mordor/sharded_iomanager.h"
+#include "mordor/sleep.h"
 #include "mordor/socket.h"
 #include "mordor/test/test.h"
 
@@ -100,6 +103,41 @@ MORDOR_UNITTEST(Socket, sendTimeout)
     MORDOR_TEST_ASSERT_ABOUT_EQUAL(start + 200000, TimerManager::now(), 500000);
 }
 
+MORDOR_UNITTEST(Socket, receiveDeadline)
+{
+    IOManager ioManager;
+    Connection conns = establishConn(ioManager);
+    // The (shorter) deadline wins
+    conns.connect->receiveTimeout(10000000);
+    ioManager.schedule(boost::bind(&acceptOne, boost::ref(conns)));
+    conns.connect->connect(conns.address);
+    ioManager.dispatch();
+    char buf;
+    unsigned long long start = TimerManager::now();
+    {
+        DeadlineScope scope(100000);
+        MORDOR_TEST_ASSERT_EXCEPTION(conns.connect->receive(&buf, 1),
+            TimedOutException);
+    }
+    MORDOR_TEST_ASSERT_ABOUT_EQUAL(start + 100000, TimerManager::now(), 50000);
+}
+
+MORDOR_UNITTEST(Socket, cancelDeadline)
+{
+    IOManager ioManager;
+    Connection conns = establishConn(ioManager);
+    DeadlineScope scope(~0ull);
+    // Deadline::cancel will get run when this fiber yields because it would
+    // block
+    ioManager.schedule(boost::bind(&Deadline::cancel, scope.deadline()));
+    MORDOR_TEST_ASSERT_EXCEPTION(conns.listen->accept(),
+        OperationAbortedException);
+    // And anything else under the same deadline gives up right away
+    Connection conns2 = establishConn(ioManager);
+    MORDOR_TEST_ASSERT_EXCEPTION(conns2.listen->accept(),
+        OperationAbortedException);
+}
+
 class DummyException
 {};
 
@@ -233,6 +271,59 @@ MORDOR_UNITTEST(Socket, cancelAccept)
     MORDOR_TEST_ASSERT_EXCEPTION(conns.listen->accept(), OperationAbortedException);
 }
 
+static void acceptAll(Socket::ptr listen, IOManager &shard,
+    Atomic<size_t> &accepted)
+{
+    while (true) {
+        Socket::ptr conn;
+        try {
+            conn = listen->accept();
+        } catch (OperationAbortedException &) {
+            return;
+        }
+        MORDOR_TEST_ASSERT_EQUAL(Scheduler::getThis(), (Scheduler *)&shard);
+        ++accepted;
+    }
+}
+
+MORDOR_UNITTEST(Socket, shardedAccept)
+{
+    IOManager ioManager;
+    ShardedIOManager shards(2);
+    std::vector<Address::ptr> addresses = Address::lookup("localhost",
+        AF_UNSPEC, SOCK_STREAM);
+    MORDOR_TEST_ASSERT(!addresses.empty());
+    IPAddress::ptr address =
+        boost::dynamic_pointer_cast<IPAddress>(addresses.front());
+    std::vector<Socket::ptr> listeners;
+    while (true) {
+        try {
+            address->port(rand() % 50000 + 1000);
+            listeners = shards.listen(address);
+            break;
+        } catch (AddressInUseException &) {
+        }
+    }
+#ifdef SO_REUSEPORT
+    MORDOR_TEST_ASSERT_EQUAL(listeners.size(), 2u);
+#endif
+    Atomic<size_t> accepted;
+    for (size_t i = 0; i < listeners.size(); ++i)
+        shards.shard(i).schedule(boost::bind(&acceptAll, listeners[i],
+            boost::ref(shards.shard(i)), boost::ref(accepted)));
+
+    std::vector<Socket::ptr> connections;
+    for (int i = 0; i < 8; ++i) {
+        connections.push_back(address->createSocket(ioManager));
+        connections.back()->connect(address);
+    }
+    for (int i = 0; i < 500 && accepted != 8u; ++i)
+        sleep(ioManager, 10000ull);
+    MORDOR_TEST_ASSERT_EQUAL((size_t)accepted, 8u);
+    for (size_t i = 0; i < listeners.size(); ++i)
+        listeners[i]->cancelAccept();
+}
+
 MORDOR_UNITTEST(Socket, cancelSend)
 {
     IOManager ioManager;
@@ -0,0 +1,206 @@
+// Copyright (c) 2010 - Mozy, Inc.
+
+#ifndef WINDOWS
+#include <unistd.h>
+#endif
+
+#include <boost/bind.hpp>
+
+#include "mordor/future.h"
+#include "mordor/iomanager.h"
+#include "mordor/stackless.h"
+#include "mordor/test/test.h"
+#include "mordor/workerpool.h"
+
+using namespace Mordor;
+
+namespace {
+
+struct CountingTask : public StacklessTask
+{
+    CountingTask(int steps)
+        : m_remaining(steps),
+          m_steps(0)
+    {}
+
+    void step()
+    {
+        ++m_steps;
+        MORDOR_STACKLESS_BEGIN
+        while (m_remaining-- > 0)
+            MORDOR_STACKLESS_AWAIT(yield());
+        MORDOR_STACKLESS_END
+    }
+
+    int m_remaining, m_steps;
+};
+
+struct SleepingTask : public StacklessTask
+{
+    SleepingTask(IOManager &ioManager)
+        : m_ioManager(ioManager),
+          m_sleeps(0)
+    {}
+
+    void step()
+    {
+        MORDOR_STACKLESS_BEGIN
+        for (; m_sleeps < 3; ++m_sleeps)
+            MORDOR_STACKLESS_AWAIT(awaitTimer(m_ioManager, 1000));
+        MORDOR_STACKLESS_END
+    }
+
+    IOManager &m_ioManager;
+    int m_sleeps;
+};
+
+struct FailingTask : public StacklessTask
+{
+    void step()
+    {
+        MORDOR_STACKLESS_BEGIN
+        MORDOR_STACKLESS_AWAIT(yield());
+        MORDOR_THROW_EXCEPTION(OperationAbortedException());
+        MORDOR_STACKLESS_END
+    }
+};
+
+}
+
+MORDOR_UNITTEST(StacklessTask, small)
+{
+    // The whole point is that it's much smaller than a stack
+    MORDOR_TEST_ASSERT_LESS_THAN(sizeof(CountingTask), 512u);
+}
+
+MORDOR_UNITTEST(StacklessTask, steps)
+{
+    WorkerPool pool;
+    boost::shared_ptr<CountingTask> task(new CountingTask(5));
+    task->start();
+    MORDOR_TEST_ASSERT(!task->done());
+    task->join();
+    MORDOR_TEST_ASSERT(task->done());
+    MORDOR_TEST_ASSERT_EQUAL(task->m_steps, 6);
+    // Joining again returns immediately
+    task->join();
+}
+
+MORDOR_UNITTEST(StacklessTask, manyTasks)
+{
+    WorkerPool pool(4);
+    std::vector<boost::shared_ptr<CountingTask> > tasks;
+    for (int i = 0; i < 1000; ++i) {
+        tasks.push_back(boost::shared_ptr<CountingTask>(new CountingTask(3)));
+        tasks.back()->start();
+    }
+    for (size_t i = 0; i < tasks.size(); ++i)
+        tasks[i]->join();
+    for (size_t i = 0; i < tasks.size(); ++i)
+        MORDOR_TEST_ASSERT_EQUAL(tasks[i]->m_steps, 4);
+}
+
+MORDOR_UNITTEST(StacklessTask, timer)
+{
+    IOManager ioManager;
+    boost::shared_ptr<SleepingTask> task(new SleepingTask(ioManager));
+    unsigned long long start = TimerManager::now();
+    task->start();
+    task->join();
+    MORDOR_TEST_ASSERT_EQUAL(task->m_sleeps, 3);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(TimerManager::now() - start,
+        3000u);
+}
+
+MORDOR_UNITTEST(StacklessTask, exception)
+{
+    WorkerPool pool;
+    StacklessTask::ptr task(new FailingTask());
+    task->start();
+    MORDOR_TEST_ASSERT_EXCEPTION(task->join(), OperationAbortedException);
+    MORDOR_TEST_ASSERT(task->done());
+}
+
+namespace {
+
+struct FutureTask : public StacklessTask
+{
+    FutureTask()
+        : m_awaited(false)
+    {}
+
+    void step()
+    {
+        MORDOR_STACKLESS_BEGIN
+        // Nothing to do here; whoever signals the Future resumes us
+        MORDOR_STACKLESS_AWAIT(m_awaited = true);
+        MORDOR_STACKLESS_END
+    }
+
+    bool m_awaited;
+};
+
+}
+
+MORDOR_UNITTEST(StacklessTask, future)
+{
+    WorkerPool pool;
+    boost::shared_ptr<FutureTask> task(new FutureTask());
+    Future<> future(boost::bind(&StacklessTask::resume, task));
+    task->start();
+    pool.dispatch();
+    MORDOR_TEST_ASSERT(task->m_awaited);
+    MORDOR_TEST_ASSERT(!task->done());
+    future.signal();
+    task->join();
+    MORDOR_TEST_ASSERT(task->done());
+}
+
+#ifndef WINDOWS
+namespace {
+
+struct ReadingTask : public StacklessTask
+{
+    ReadingTask(IOManager &ioManager, int fd)
+        : m_ioManager(ioManager),
+          m_fd(fd),
+          m_byte(0)
+    {}
+
+    void step()
+    {
+        MORDOR_STACKLESS_BEGIN
+        MORDOR_STACKLESS_AWAIT(awaitEvent(m_ioManager, m_fd,
+            IOManager::READ));
+        MORDOR_TEST_ASSERT_EQUAL(::read(m_fd, &m_byte, 1), 1);
+        MORDOR_STACKLESS_END
+    }
+
+    IOManager &m_ioManager;
+    int m_fd;
+    char m_byte;
+};
+
+}
+
+MORDOR_UNITTEST(StacklessTask, event)
+{
+    int fds[2];
+    MORDOR_TEST_ASSERT_EQUAL(pipe(fds), 0);
+    try {
+        IOManager ioManager;
+        boost::shared_ptr<ReadingTask> task(new ReadingTask(ioManager,
+            fds[0]));
+        task->start();
+        MORDOR_TEST_ASSERT_EQUAL(::write(fds[1], "a", 1), 1);
+        task->join();
+        MORDOR_TEST_ASSERT_EQUAL(task->m_byte, 'a');
+    } catch (...) {
+        close(fds[0]);
+        close(fds[1]);
+        throw;
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+#endif
@@ -2,6 +2,7 @@
 
 #include <boost/bind.hpp>
 
+#include "mordor/sleep.h"
 #include "mordor/timer.h"
 #include "mordor/test/test.h"
 
@@ -133,3 +134,98 @@ MORDOR_UNITTEST(Timer, later)
     timer->cancel();
     MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
 }
+
+namespace {
+// TimerManagers constructed in scope use a timing wheel
+struct WheelTimers
+{
+    WheelTimers(const char *resolution)
+        : wheel("timer.wheel", "1"),
+          resolution("timer.wheelresolution", resolution)
+    {}
+
+    ConfigOverride wheel, resolution;
+};
+}
+
+MORDOR_UNITTEST(Timer, wheel)
+{
+    // With a resolution of 1us it should behave just like the tree
+    WheelTimers wheel("1");
+    int sequence = 0;
+    TimerManager manager;
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+    Timer::ptr later = manager.registerTimer(1000 * 1000 * 1000,
+        boost::bind(&singleTimer, boost::ref(sequence), 3));
+    MORDOR_TEST_ASSERT_ABOUT_EQUAL(manager.nextTimer(),
+        1000 * 1000 * 1000u, 100 * 1000 * 1000u);
+    Timer::ptr cancelled = manager.registerTimer(0,
+        boost::bind(&singleTimer, boost::ref(sequence), 3));
+    manager.registerTimer(0, boost::bind(&singleTimer, boost::ref(sequence), 1));
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), 0u);
+    MORDOR_TEST_ASSERT(cancelled->cancel());
+    manager.executeTimers();
+    ++sequence;
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 2);
+    MORDOR_TEST_ASSERT_ABOUT_EQUAL(manager.nextTimer(),
+        1000 * 1000 * 1000u, 100 * 1000 * 1000u);
+    MORDOR_TEST_ASSERT(later->refresh());
+    MORDOR_TEST_ASSERT(later->cancel());
+    MORDOR_TEST_ASSERT(!later->cancel());
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+}
+
+static void
+wheelTimer(int &sequence, int expected, unsigned long long notBefore)
+{
+    ++sequence;
+    MORDOR_TEST_ASSERT_EQUAL(sequence, expected);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(TimerManager::now(), notBefore);
+}
+
+MORDOR_UNITTEST(Timer, wheelCascade)
+{
+    WheelTimers wheel("1000");
+    int sequence = 0;
+    TimerManager manager;
+    unsigned long long start = TimerManager::now();
+    // Past the root of the wheel (256 ticks), so it has to cascade down
+    manager.registerTimer(300000, boost::bind(&wheelTimer,
+        boost::ref(sequence), 3, start + 300000));
+    manager.registerTimer(5000, boost::bind(&wheelTimer,
+        boost::ref(sequence), 1, start + 5000));
+    Timer::ptr recurring = manager.registerTimer(100000, boost::bind(
+        &wheelTimer, boost::ref(sequence), 2, start + 100000), true);
+    while (sequence < 3) {
+        unsigned long long next = manager.nextTimer();
+        MORDOR_TEST_ASSERT_NOT_EQUAL(next, ~0ull);
+        sleep(next);
+        manager.executeTimers();
+        if (sequence == 2)
+            recurring->cancel();
+    }
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+}
+
+MORDOR_UNITTEST(Timer, coarseClock)
+{
+    unsigned long long precise = TimerManager::now();
+    unsigned long long coarse = TimerManager::coarseNow();
+    // Shares an epoch with now(), just lagging behind by up to a tick
+    MORDOR_TEST_ASSERT_ABOUT_EQUAL(coarse, precise, 20000u);
+
+    ConfigOverride coarseClock("timer.coarseclock", "1");
+    int sequence = 0;
+    TimerManager manager;
+    unsigned long long loopTime = manager.loopTime();
+    manager.registerTimer(0,
+        boost::bind(&singleTimer, boost::ref(sequence), 1));
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), 0u);
+    sleep(20000ull);
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 1);
+    // Processing timers refreshed the loop time
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(manager.loopTime(),
+        loopTime + 10000);
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+}
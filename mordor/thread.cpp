@@ -3,6 +3,8 @@
 #include "thread.h"
 
 #ifdef LINUX
+#include <fstream>
+#include <sched.h>
 #include <syscall.h>
 #endif
 #ifdef WINDOWS
@@ -10,9 +12,12 @@
 #endif
 
 #include "exception.h"
+#include "log.h"
 
 namespace Mordor {
 
+static Logger::ptr g_log = Log::lookup("mordor:thread");
+
 tid_t gettid()
 {
 #ifdef WINDOWS
@@ -24,6 +29,157 @@ tid_t gettid()
 #endif
 }
 
+#ifdef LINUX
+// Parses the kernel's list format ("0-3,8-11")
+static std::vector<unsigned int> readCpuList(const char *path)
+{
+    std::vector<unsigned int> result;
+    std::ifstream file(path);
+    unsigned int first, last;
+    while (file >> first) {
+        last = first;
+        if (file.peek() == '-') {
+            file.get();
+            file >> last;
+        }
+        for (unsigned int i = first; i <= last; ++i)
+            result.push_back(i);
+        if (file.peek() != ',')
+            break;
+        file.get();
+    }
+    return result;
+}
+
+namespace {
+struct NumaTopology
+{
+    NumaTopology()
+    {
+        std::vector<unsigned int> online =
+            readCpuList("/sys/devices/system/node/online");
+        nodes.resize(online.empty() ? 1 : online.back() + 1);
+        for (size_t i = 0; i < online.size(); ++i) {
+            std::ostringstream os;
+            os << "/sys/devices/system/node/node" << online[i] << "/cpulist";
+            nodes[online[i]] = readCpuList(os.str().c_str());
+            for (size_t j = 0; j < nodes[online[i]].size(); ++j) {
+                unsigned int cpu = nodes[online[i]][j];
+                if (cpuToNode.size() <= cpu)
+                    cpuToNode.resize(cpu + 1);
+                cpuToNode[cpu] = online[i];
+            }
+        }
+    }
+
+    std::vector<std::vector<unsigned int> > nodes;
+    std::vector<size_t> cpuToNode;
+};
+}
+
+static const NumaTopology &numaTopology()
+{
+    static NumaTopology topology;
+    return topology;
+}
+#endif
+
+size_t processorCount()
+{
+#ifdef WINDOWS
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (size_t)count : 1u;
+#endif
+}
+
+size_t numaNodeCount()
+{
+#ifdef LINUX
+    return numaTopology().nodes.size();
+#else
+    return 1;
+#endif
+}
+
+std::vector<unsigned int> numaNodeProcessors(size_t node)
+{
+#ifdef LINUX
+    const NumaTopology &topology = numaTopology();
+    if (node < topology.nodes.size() && !topology.nodes[node].empty())
+        return topology.nodes[node];
+#endif
+    std::vector<unsigned int> result;
+    if (node == 0)
+        for (unsigned int i = 0; i < processorCount(); ++i)
+            result.push_back(i);
+    return result;
+}
+
+size_t currentNumaNode()
+{
+#ifdef LINUX
+    const NumaTopology &topology = numaTopology();
+    if (topology.nodes.size() == 1)
+        return 0;
+    // sched_getcpu is answered by the vDSO, so it's cheap
+    int cpu = sched_getcpu();
+    if (cpu < 0 || (size_t)cpu >= topology.cpuToNode.size())
+        return 0;
+    return topology.cpuToNode[cpu];
+#else
+    return 0;
+#endif
+}
+
+bool setThreadAffinity(const std::vector<unsigned int> &processors)
+{
+#ifdef LINUX
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < processors.size(); ++i)
+        if (processors[i] < CPU_SETSIZE)
+            CPU_SET(processors[i], &set);
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &set)) {
+        MORDOR_LOG_WARNING(g_log) << "sched_setaffinity(" << gettid()
+            << "): (" << lastError() << ")";
+        return false;
+    }
+    return true;
+#elif defined(WINDOWS)
+    DWORD_PTR mask = 0;
+    for (size_t i = 0; i < processors.size(); ++i)
+        if (processors[i] < sizeof(DWORD_PTR) * 8)
+            mask |= (DWORD_PTR)1 << processors[i];
+    if (!SetThreadAffinityMask(GetCurrentThread(), mask)) {
+        MORDOR_LOG_WARNING(g_log) << "SetThreadAffinityMask(" << gettid()
+            << "): (" << lastError() << ")";
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+size_t pinThread(size_t index, bool toProcessor)
+{
+    size_t nodes = numaNodeCount();
+    size_t node = index % nodes;
+    std::vector<unsigned int> processors = numaNodeProcessors(node);
+    if (processors.empty())
+        return node;
+    if (toProcessor)
+        processors.assign(1, processors[(index / nodes) % processors.size()]);
+    MORDOR_LOG_VERBOSE(g_log) << "pinning thread " << gettid() << " to node "
+        << node << " (" << processors.size() << " processors)";
+    setThreadAffinity(processors);
+    return node;
+}
+
 Thread::Thread(boost::function<void ()> dg)
 {
 #ifdef WINDOWS
@@ -3,6 +3,7 @@
 // Copyright (c) 2010 - Mozy, Inc.
 
 #include <iosfwd>
+#include <vector>
 
 #include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
@@ -23,6 +24,25 @@ typedef pid_t tid_t;
 inline tid_t emptytid() { return (tid_t)-1; }
 tid_t gettid();
 
+/// @return The number of processors that threads can run on
+size_t processorCount();
+/// @return The number of NUMA nodes (1 if the machine isn't NUMA, or it can't
+/// be determined)
+size_t numaNodeCount();
+/// @return The processors that belong to NUMA node node
+std::vector<unsigned int> numaNodeProcessors(size_t node);
+/// @return The NUMA node that the calling thread is currently running on
+size_t currentNumaNode();
+/// Restrict the calling thread to only run on the given processors
+/// @return If the operating system honored the request
+bool setThreadAffinity(const std::vector<unsigned int> &processors);
+/// Pin the calling thread as the index'th of a set of threads spread
+/// round-robin across NUMA nodes
+/// @param toProcessor Pin to a single processor, instead of to all of the
+/// node's processors
+/// @return The node the thread was pinned to
+size_t pinThread(size_t index, bool toProcessor);
+
 class Thread : boost::noncopyable
 {
 public:
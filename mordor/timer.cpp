@@ -7,6 +7,7 @@
 
 #include "assert.h"
 #include "atomic.h"
+#include "config.h"
 #include "exception.h"
 #include "log.h"
 #include "version.h"
@@ -25,6 +26,17 @@ namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:timer");
 
+static ConfigVar<bool>::ptr g_wheel = Config::lookup(
+    "timer.wheel", false,
+    "Keep timers in a timing wheel instead of a tree (for new TimerManagers)");
+static ConfigVar<unsigned long long>::ptr g_wheelResolution =
+    Config::lookup<unsigned long long>("timer.wheelresolution", 1000ull,
+    "Granularity (in microseconds) of timers in a timing wheel");
+static ConfigVar<bool>::ptr g_coarseClock = Config::lookup(
+    "timer.coarseclock", false,
+    "Measure timers with a cheaper, millisecond precision clock "
+    "(for new TimerManagers)");
+
 #ifdef WINDOWS
 static unsigned long long queryFrequency()
 {
@@ -70,15 +82,49 @@ TimerManager::now()
 #endif
 }
 
+#if defined(LINUX) && defined(CLOCK_MONOTONIC_COARSE)
+static clockid_t chooseCoarseClock()
+{
+    // CLOCK_MONOTONIC_COARSE is just CLOCK_MONOTONIC as of the last tick, so
+    // it shares its epoch with now(); don't use it if ticks are too far apart
+    struct timespec ts;
+    if (clock_getres(CLOCK_MONOTONIC_COARSE, &ts) == 0 && ts.tv_sec == 0 &&
+        ts.tv_nsec <= 10000000) {
+        MORDOR_LOG_VERBOSE(g_log) << "using CLOCK_MONOTONIC_COARSE ("
+            << ts.tv_nsec << "ns resolution)";
+        return CLOCK_MONOTONIC_COARSE;
+    }
+    return CLOCK_MONOTONIC;
+}
+#endif
+
+unsigned long long
+TimerManager::coarseNow()
+{
+#if defined(LINUX) && defined(CLOCK_MONOTONIC_COARSE)
+    static const clockid_t clock = chooseCoarseClock();
+    struct timespec ts;
+
+    if (clock_gettime(clock, &ts))
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("clock_gettime");
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+#else
+    return now();
+#endif
+}
+
 Timer::Timer(unsigned long long us, boost::function<void ()> dg, bool recurring,
              TimerManager *manager)
     : m_recurring(recurring),
       m_us(us),
       m_dg(dg),
-      m_manager(manager)
+      m_manager(manager),
+      m_prevInSlot(NULL),
+      m_nextInSlot(NULL),
+      m_slot(0)
 {
     MORDOR_ASSERT(m_dg);
-    m_next = TimerManager::now() + m_us;
+    m_next = m_manager->clockNow() + m_us;
 }
 
 Timer::Timer(unsigned long long next)
@@ -89,13 +135,13 @@ bool
 Timer::cancel()
 {
     MORDOR_LOG_DEBUG(g_log) << this << " cancel";
+    // Released after the lock
+    Timer::ptr self;
     boost::mutex::scoped_lock lock(m_manager->m_mutex);
     if (m_dg) {
         m_dg = NULL;
-        std::set<Timer::ptr, Timer::Comparator>::iterator it =
-            m_manager->m_timers.find(shared_from_this());
-        MORDOR_ASSERT(it != m_manager->m_timers.end());
-        m_manager->m_timers.erase(it);
+        m_manager->erase(shared_from_this());
+        self.swap(m_self);
         return true;
     }
     return false;
@@ -107,12 +153,10 @@ Timer::refresh()
     boost::mutex::scoped_lock lock(m_manager->m_mutex);
     if (!m_dg)
         return false;
-    std::set<Timer::ptr, Timer::Comparator>::iterator it =
-        m_manager->m_timers.find(shared_from_this());
-    MORDOR_ASSERT(it != m_manager->m_timers.end());
-    m_manager->m_timers.erase(it);
-    m_next = TimerManager::now() + m_us;
-    m_manager->m_timers.insert(shared_from_this());
+    Timer::ptr self = shared_from_this();
+    m_manager->erase(self);
+    m_next = m_manager->clockNow() + m_us;
+    m_manager->insert(self);
     lock.unlock();
     MORDOR_LOG_DEBUG(g_log) << this << " refresh";
     return true;
@@ -127,19 +171,16 @@ Timer::reset(unsigned long long us, bool fromNow)
     // No change
     if (us == m_us && !fromNow)
         return true;
-    std::set<Timer::ptr, Timer::Comparator>::iterator it =
-        m_manager->m_timers.find(shared_from_this());
-    MORDOR_ASSERT(it != m_manager->m_timers.end());
-    m_manager->m_timers.erase(it);
+    Timer::ptr self = shared_from_this();
+    m_manager->erase(self);
     unsigned long long start;
     if (fromNow)
-        start = TimerManager::now();
+        start = m_manager->clockNow();
     else
         start = m_next - m_us;
     m_us = us;
     m_next = start + m_us;
-    it = m_manager->m_timers.insert(shared_from_this()).first;
-    bool atFront = (it == m_manager->m_timers.begin()) && !m_manager->m_tickled;
+    bool atFront = m_manager->insert(self) && !m_manager->m_tickled;
     if (atFront)
         m_manager->m_tickled = true;
     lock.unlock();
@@ -150,14 +191,25 @@ Timer::reset(unsigned long long us, bool fromNow)
 }
 
 TimerManager::TimerManager()
-: m_tickled(false)
-{}
+: m_tickled(false),
+  m_coarse(g_coarseClock->val()),
+  m_wheel(g_wheel->val()),
+  m_resolution(std::max(g_wheelResolution->val(), 1ull)),
+  m_earliest(~0ull),
+  m_wheelCount(0)
+{
+    m_loopTime = clockNow();
+    m_tick = m_loopTime / m_resolution;
+    memset(m_slots, 0, sizeof(m_slots));
+    memset(m_occupied, 0, sizeof(m_occupied));
+}
 
 TimerManager::~TimerManager()
 {
 #ifndef NDEBUG
     boost::mutex::scoped_lock lock(m_mutex);
     MORDOR_ASSERT(m_timers.empty());
+    MORDOR_ASSERT(m_wheelCount == 0);
 #endif
 }
 
@@ -168,9 +220,7 @@ TimerManager::registerTimer(unsigned long long us, boost::function<void ()> dg,
     MORDOR_ASSERT(dg);
     Timer::ptr result(new Timer(us, dg, recurring, this));
     boost::mutex::scoped_lock lock(m_mutex);
-    std::set<Timer::ptr, Timer::Comparator>::iterator it =
-        m_timers.insert(result).first;
-    bool atFront = (it == m_timers.begin()) && !m_tickled;
+    bool atFront = insert(result) && !m_tickled;
     if (atFront)
         m_tickled = true;
     lock.unlock();
@@ -186,17 +236,22 @@ TimerManager::nextTimer()
 {
     boost::mutex::scoped_lock lock(m_mutex);
     m_tickled = false;
-    if (m_timers.empty()) {
+    unsigned long long next;
+    if (m_wheel) {
+        m_earliest = next = wheelNext();
+    } else {
+        next = m_timers.empty() ? ~0ull : (*m_timers.begin())->m_next;
+    }
+    if (next == ~0ull) {
         MORDOR_LOG_DEBUG(g_log) << this << " nextTimer(): ~0ull";
         return ~0ull;
     }
-    const Timer::ptr &next = *m_timers.begin();
-    unsigned long long nowUs = now();
+    unsigned long long nowUs = clockNow();
     unsigned long long result;
-    if (nowUs >= next->m_next)
+    if (nowUs >= next)
         result = 0;
     else
-        result = next->m_next - nowUs;
+        result = next - nowUs;
     MORDOR_LOG_DEBUG(g_log) << this << " nextTimer(): " << result;
     return result;
 }
@@ -206,20 +261,29 @@ TimerManager::processTimers()
 {
     std::vector<Timer::ptr> expired;
     std::vector<boost::function<void ()> > result;
-    unsigned long long nowUs = now();
+    unsigned long long nowUs = clockNow();
     {
         boost::mutex::scoped_lock lock(m_mutex);
-        if (m_timers.empty() || (*m_timers.begin())->m_next > nowUs)
-            return result;
-        Timer nowTimer(nowUs);
-        Timer::ptr nowTimerPtr(&nowTimer, &nop<Timer *>);
-        // Find all timers that are expired
-        std::set<Timer::ptr, Timer::Comparator>::iterator it =
-            m_timers.lower_bound(nowTimerPtr);
-        while (it != m_timers.end() && (*it)->m_next == nowUs ) ++it;
-        // Copy to expired, remove from m_timers;
-        expired.insert(expired.begin(), m_timers.begin(), it);
-        m_timers.erase(m_timers.begin(), it);
+        // Another thread may have processed timers in the meantime
+        if (nowUs > m_loopTime)
+            m_loopTime = nowUs;
+        if (m_wheel) {
+            wheelExpire(nowUs, expired);
+            if (expired.empty())
+                return result;
+        } else {
+            if (m_timers.empty() || (*m_timers.begin())->m_next > nowUs)
+                return result;
+            Timer nowTimer(nowUs);
+            Timer::ptr nowTimerPtr(&nowTimer, &nop<Timer *>);
+            // Find all timers that are expired
+            std::set<Timer::ptr, Timer::Comparator>::iterator it =
+                m_timers.lower_bound(nowTimerPtr);
+            while (it != m_timers.end() && (*it)->m_next == nowUs ) ++it;
+            // Copy to expired, remove from m_timers;
+            expired.insert(expired.begin(), m_timers.begin(), it);
+            m_timers.erase(m_timers.begin(), it);
+        }
         result.reserve(expired.size());
         // Look at expired timers and re-register recurring timers
         // (while under the same lock)
@@ -232,10 +296,14 @@ TimerManager::processTimers()
             if (timer->m_recurring) {
                 MORDOR_LOG_TRACE(g_log) << timer << " expired and refreshed";
                 timer->m_next = nowUs + timer->m_us;
-                m_timers.insert(timer);
+                if (m_wheel)
+                    wheelInsert(timer.get());
+                else
+                    m_timers.insert(timer);
             } else {
                 MORDOR_LOG_TRACE(g_log) << timer << " expired";
                 timer->m_dg = NULL;
+                timer->m_self.reset();
             }
         }
     }
@@ -254,6 +322,200 @@ TimerManager::executeTimers()
     }
 }
 
+bool
+TimerManager::insert(const Timer::ptr &timer)
+{
+    if (!m_wheel)
+        return m_timers.insert(timer).first == m_timers.begin();
+    timer->m_self = timer;
+    unsigned long long expires = wheelInsert(timer.get()) * m_resolution;
+    if (expires >= m_earliest)
+        return false;
+    m_earliest = expires;
+    return true;
+}
+
+void
+TimerManager::erase(const Timer::ptr &timer)
+{
+    if (m_wheel) {
+        wheelErase(timer.get());
+        return;
+    }
+    std::set<Timer::ptr, Timer::Comparator>::iterator it =
+        m_timers.find(timer);
+    MORDOR_ASSERT(it != m_timers.end());
+    m_timers.erase(it);
+}
+
+static unsigned int
+countTrailingZeros(unsigned long long word)
+{
+    MORDOR_ASSERT(word);
+#ifdef __GNUC__
+    return __builtin_ctzll(word);
+#else
+    unsigned int result = 0;
+    for (; !(word & 1); word >>= 1)
+        ++result;
+    return result;
+#endif
+}
+
+// Offset (going around the ring of size slots at base, from start) of the
+// first occupied slot; size if there isn't one
+static unsigned int
+firstOccupied(const unsigned long long *occupied, unsigned int base,
+    unsigned int size, unsigned int start)
+{
+    unsigned int offset = 0;
+    while (offset < size) {
+        unsigned int slot = base + (start + offset) % size;
+        unsigned long long word = occupied[slot / 64] >> (slot % 64);
+        if (word)
+            return offset + countTrailingZeros(word);
+        offset += 64 - slot % 64;
+    }
+    return size;
+}
+
+unsigned long long
+TimerManager::wheelInsert(Timer *timer)
+{
+    unsigned long long expires =
+        (timer->m_next + m_resolution - 1) / m_resolution;
+    if (expires < m_tick)
+        expires = m_tick;
+    unsigned long long delta = expires - m_tick;
+    unsigned int slot;
+    if (delta < (1ull << ROOT_BITS)) {
+        slot = (unsigned int)expires & ((1 << ROOT_BITS) - 1);
+    } else {
+        // Beyond the end of the wheel; it'll be re-inserted when the top
+        // level cascades
+        const unsigned long long maxDelta =
+            (1ull << (ROOT_BITS + LEVELS * LEVEL_BITS)) - 1;
+        if (delta > maxDelta) {
+            delta = maxDelta;
+            expires = m_tick + maxDelta;
+        }
+        unsigned int level = 0, shift = ROOT_BITS;
+        while (delta >= (1ull << (shift + LEVEL_BITS))) {
+            ++level;
+            shift += LEVEL_BITS;
+        }
+        slot = (1 << ROOT_BITS) + (level << LEVEL_BITS) +
+            ((unsigned int)(expires >> shift) & ((1 << LEVEL_BITS) - 1));
+    }
+    timer->m_slot = slot;
+    timer->m_prevInSlot = NULL;
+    timer->m_nextInSlot = m_slots[slot];
+    if (m_slots[slot])
+        m_slots[slot]->m_prevInSlot = timer;
+    m_slots[slot] = timer;
+    m_occupied[slot / 64] |= 1ull << (slot % 64);
+    ++m_wheelCount;
+    return expires;
+}
+
+void
+TimerManager::wheelErase(Timer *timer)
+{
+    unsigned int slot = timer->m_slot;
+    if (timer->m_prevInSlot)
+        timer->m_prevInSlot->m_nextInSlot = timer->m_nextInSlot;
+    else
+        m_slots[slot] = timer->m_nextInSlot;
+    if (timer->m_nextInSlot)
+        timer->m_nextInSlot->m_prevInSlot = timer->m_prevInSlot;
+    timer->m_prevInSlot = timer->m_nextInSlot = NULL;
+    if (!m_slots[slot])
+        m_occupied[slot / 64] &= ~(1ull << (slot % 64));
+    --m_wheelCount;
+}
+
+void
+TimerManager::wheelCascade(unsigned int level, unsigned int index)
+{
+    unsigned int slot = (1 << ROOT_BITS) + (level << LEVEL_BITS) + index;
+    Timer *timer = m_slots[slot];
+    m_slots[slot] = NULL;
+    m_occupied[slot / 64] &= ~(1ull << (slot % 64));
+    while (timer) {
+        Timer *next = timer->m_nextInSlot;
+        --m_wheelCount;
+        wheelInsert(timer);
+        timer = next;
+    }
+}
+
+unsigned long long
+TimerManager::wheelNext()
+{
+    if (m_wheelCount == 0)
+        return ~0ull;
+    const unsigned int rootSize = 1 << ROOT_BITS, levelSize = 1 << LEVEL_BITS;
+    unsigned long long result = ~0ull;
+    unsigned int offset = firstOccupied(m_occupied, 0, rootSize,
+        (unsigned int)m_tick & (rootSize - 1));
+    if (offset != rootSize)
+        result = m_tick + offset;
+    // A slot in a higher level may hold timers that expire before the next
+    // occupied slot in the root, so it has to be woken for at the tick it
+    // cascades (the current slot of each level already has; it is a whole
+    // revolution away)
+    for (unsigned int level = 0; level < LEVELS; ++level) {
+        unsigned int shift = ROOT_BITS + level * LEVEL_BITS;
+        unsigned long long position = (m_tick >> shift) + 1;
+        offset = firstOccupied(m_occupied, rootSize + level * levelSize,
+            levelSize, (unsigned int)position & (levelSize - 1));
+        if (offset != levelSize)
+            result = std::min(result, (position + offset) << shift);
+    }
+    MORDOR_ASSERT(result != ~0ull);
+    return result * m_resolution;
+}
+
+void
+TimerManager::wheelExpire(unsigned long long nowUs,
+    std::vector<Timer::ptr> &expired)
+{
+    const unsigned int rootMask = (1 << ROOT_BITS) - 1;
+    unsigned long long target = nowUs / m_resolution;
+    while (m_tick <= target) {
+        if (m_wheelCount == 0) {
+            m_tick = target + 1;
+            break;
+        }
+        unsigned int index = (unsigned int)m_tick & rootMask;
+        if (index == 0) {
+            for (unsigned int level = 0; level < LEVELS; ++level) {
+                unsigned int levelIndex = (unsigned int)(m_tick >>
+                    (ROOT_BITS + level * LEVEL_BITS)) & ((1 << LEVEL_BITS) - 1);
+                wheelCascade(level, levelIndex);
+                if (levelIndex != 0)
+                    break;
+            }
+        }
+        // Nothing in the root; skip to the next cascade
+        if (!(m_occupied[0] | m_occupied[1] | m_occupied[2] | m_occupied[3])) {
+            m_tick = std::min((m_tick | rootMask) + 1, target + 1);
+            continue;
+        }
+        Timer *timer = m_slots[index];
+        m_slots[index] = NULL;
+        m_occupied[index / 64] &= ~(1ull << (index % 64));
+        while (timer) {
+            Timer *next = timer->m_nextInSlot;
+            timer->m_prevInSlot = timer->m_nextInSlot = NULL;
+            --m_wheelCount;
+            expired.push_back(timer->m_self);
+            timer = next;
+        }
+        ++m_tick;
+    }
+}
+
 bool
 Timer::Comparator::operator()(const Timer::ptr &lhs,
                               const Timer::ptr &rhs) const
@@ -48,6 +48,11 @@ private:
     unsigned long long m_us;
     boost::function<void ()> m_dg;
     TimerManager *m_manager;
+    // Timing wheel bookkeeping (see TimerManager)
+    Timer *m_prevInSlot, *m_nextInSlot;
+    unsigned int m_slot;
+    // The wheel's reference to the Timer while it's registered
+    Timer::ptr m_self;
 
 private:
     struct Comparator
@@ -57,6 +62,20 @@ private:
 
 };
 
+/// Keeps track of Timers, and when they expire
+
+/// By default, Timers are kept in a tree ordered by when they expire, so
+/// registering, cancelling and refreshing them is O(log n).  With timer.wheel
+/// set (when the TimerManager is constructed), they're kept in a hierarchical
+/// timing wheel instead, where all of those are O(1), at the cost of only
+/// expiring Timers on timer.wheelresolution boundaries (they can fire up to
+/// that much late, but never early).  Use the wheel when there are a large
+/// number of short-lived timeouts.
+///
+/// Similarly, with timer.coarseclock set, a TimerManager measures time with
+/// coarseNow() instead of now(), trading precision (to within a few
+/// milliseconds) for not having to make a system call every time a Timer is
+/// registered, refreshed or reset.
 class TimerManager : public boost::noncopyable
 {
     friend class Timer;
@@ -77,15 +96,60 @@ public:
     /// equal to the time that elapsed between calls.  This is true even if the
     /// system clock is changed.
     static unsigned long long now();
+    /// @return The same as now(), but cheaper and only as precise as the
+    /// system tick (typically 1-4ms).  Falls back to now() on platforms
+    /// without a coarse clock.
+    static unsigned long long coarseNow();
+
+    /// @return The clock that this TimerManager measures Timers against
+    /// (either now() or coarseNow())
+    unsigned long long clockNow() const
+    { return m_coarse ? coarseNow() : now(); }
+    /// @return The time (as clockNow()) that Timers were last processed;
+    /// IOManagers do this every time they wake up, so this is the start of
+    /// the current iteration of the event loop.  It is essentially free, but
+    /// it can be stale if fibers run for a long time without yielding to
+    /// idle().
+    unsigned long long loopTime() const { return m_loopTime; }
 
 protected:
     virtual void onTimerInsertedAtFront() {}
     std::vector<boost::function<void ()> > processTimers();
 
+private:
+    bool insert(const Timer::ptr &timer);
+    void erase(const Timer::ptr &timer);
+
+    unsigned long long wheelInsert(Timer *timer);
+    void wheelErase(Timer *timer);
+    void wheelCascade(unsigned int level, unsigned int index);
+    unsigned long long wheelNext();
+    void wheelExpire(unsigned long long nowUs, std::vector<Timer::ptr> &expired);
+
 private:
     std::set<Timer::ptr, Timer::Comparator> m_timers;
     boost::mutex m_mutex;
     bool m_tickled;
+    bool m_coarse;
+    unsigned long long m_loopTime;
+
+    // 256 slots of one tick each, then 4 levels of 64 slots that are each
+    // as wide as the entire level below
+    enum {
+        ROOT_BITS = 8,
+        LEVEL_BITS = 6,
+        LEVELS = 4,
+        SLOTS = (1 << ROOT_BITS) + LEVELS * (1 << LEVEL_BITS)
+    };
+    bool m_wheel;
+    unsigned long long m_resolution;
+    /// The next tick to be expired
+    unsigned long long m_tick;
+    /// When the earliest Timer expires, as last reported by nextTimer()
+    unsigned long long m_earliest;
+    size_t m_wheelCount;
+    Timer *m_slots[SLOTS];
+    unsigned long long m_occupied[SLOTS / 64];
 };
 
 }